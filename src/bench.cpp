@@ -0,0 +1,177 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vulkan/vulkan.h>
+
+#include "app.hpp"
+
+// Builds acceleration structures for synthetic scenes of growing size, through
+// the same `create_blas()` and `create_tlas()` as the renderer, and writes one
+// CSV row per build.
+//
+// Usage: raytracing_bench [--max-triangles N] [--meshes N] [--instances N]
+//                         [--repeat N] [--output PATH] [--host]
+
+namespace {
+
+struct Variant {
+    char const* p_name;
+    VkBuildAccelerationStructureFlagsKHR build_flags;
+    bool should_compact;
+};
+
+constexpr Variant variants[] = {
+    {"fast_trace", VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR,
+     false},
+    {"fast_build", VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR,
+     false},
+    {"fast_trace_compact",
+     VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR, true},
+    {"fast_build_compact",
+     VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR, true},
+};
+
+constexpr uint32_t triangle_counts[] = {
+    1'000, 10'000, 100'000, 1'000'000, 10'000'000,
+};
+
+}  // namespace
+
+auto main(int argc, char* argv[]) -> int {
+    uint32_t max_triangle_count = 10'000'000;
+    uint32_t mesh_count = 4;
+    uint32_t tlas_instance_count = 10'000;
+    uint32_t repeat_count = 3;
+    char const* p_output_path = "raytracing_bench.csv";
+    bool should_build_on_host = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--host") == 0) {
+            should_build_on_host = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            break;
+        }
+        uint32_t const value =
+            static_cast<uint32_t>(std::strtoul(argv[i + 1], nullptr, 10));
+        if (strcmp(argv[i], "--max-triangles") == 0) {
+            max_triangle_count = value;
+        } else if (strcmp(argv[i], "--meshes") == 0) {
+            mesh_count = value > 0 ? value : 1;
+        } else if (strcmp(argv[i], "--instances") == 0) {
+            tlas_instance_count = value;
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            repeat_count = value > 0 ? value : 1;
+        } else if (strcmp(argv[i], "--output") == 0) {
+            p_output_path = argv[i + 1];
+        }
+        i++;
+    }
+
+    std::FILE* p_file = std::fopen(p_output_path, "w");
+    if (p_file == nullptr) {
+        std::cout << "Failed to open " << p_output_path << ".\n";
+        return EXIT_FAILURE;
+    }
+    std::fprintf(p_file,
+                 "triangles,meshes,builder,variant,repeat,blas_build_ms,"
+                 "blas_compact_ms,blas_wall_ms,mtriangles_per_s,"
+                 "blas_scratch_bytes,blas_build_bytes,blas_bytes,"
+                 "tlas_instances,tlas_build_ms,tlas_scratch_bytes,"
+                 "tlas_bytes\n");
+
+    // No window, so this also runs on software implementations.
+    App app;
+    app.is_headless = true;
+    app.should_build_blas_on_host = should_build_on_host;
+    app.initialize_device();
+    // Host builds are only used if the device supports them.
+    char const* p_builder_name = app.should_build_blas_on_host ? "host" : "gpu";
+
+    for (uint32_t triangle_count : triangle_counts) {
+        if (triangle_count > max_triangle_count) {
+            break;
+        }
+        app.scene.load_grid(triangle_count, mesh_count);
+        app.create_vertex_buffer();
+        app.create_index_buffer();
+        app.create_mesh_buffer();
+        uint32_t const actual_triangle_count = app.scene.index_count / 3;
+
+        for (Variant const& variant : variants) {
+            for (uint32_t repeat = 0; repeat < repeat_count; repeat++) {
+                app.blas_build_flags = variant.build_flags;
+                app.should_compact_blas = variant.should_compact;
+
+                auto const build_begin = std::chrono::steady_clock::now();
+                app.create_blas();
+                std::chrono::duration<double, std::milli> const wall_time =
+                    std::chrono::steady_clock::now() - build_begin;
+
+                // Spread copies of the meshes over a grid, so the TLAS has
+                // more than a handful of instances to sort.
+                app.create_tlas();
+                while (app.instances.count < tlas_instance_count) {
+                    uint32_t const i = app.instances.count;
+                    float const x = static_cast<float>(i % 100) * 5.0f;
+                    float const z = static_cast<float>(i / 100) * 2.0f;
+                    VkTransformMatrixKHR transform = {
+                        1, 0, 0, x,  //
+                        0, 1, 0, 0,  //
+                        0, 0, 1, z,  //
+                    };
+                    app.add_instance(i % app.blas_count, transform);
+                }
+                app.update_tlas();
+
+                // Every build has been waited on, so this finds them all.
+                app.profiler.resolve();
+                double const build_ms =
+                    app.profiler.get_last_sample_ms("blas_build");
+                double const compact_ms =
+                    variant.should_compact
+                        ? app.profiler.get_last_sample_ms("blas_compact")
+                        : 0.0;
+                double const tlas_build_ms =
+                    app.profiler.get_last_sample_ms("tlas_build");
+                // Without timestamps, or for host builds, fall back to the
+                // host's view.
+                double const rate_ms =
+                    build_ms > 0 ? build_ms : wall_time.count();
+
+                std::fprintf(
+                    p_file,
+                    "%u,%u,%s,%s,%u,%f,%f,%f,%f,%llu,%llu,%llu,%u,%f,%llu,"
+                    "%llu\n",
+                    actual_triangle_count, mesh_count, p_builder_name,
+                    variant.p_name, repeat,
+                    build_ms, compact_ms, wall_time.count(),
+                    static_cast<double>(actual_triangle_count) / rate_ms /
+                        1e3,
+                    static_cast<unsigned long long>(app.blas_scratch_size),
+                    static_cast<unsigned long long>(app.blas_build_size),
+                    static_cast<unsigned long long>(app.blas_size),
+                    app.instances.count, tlas_build_ms,
+                    static_cast<unsigned long long>(
+                        app.tlas_scratch_pool.size),
+                    static_cast<unsigned long long>(app.tlas_size));
+                std::fflush(p_file);
+
+                std::printf("%9u triangles, %-18s %10.3f ms, %8.2f "
+                            "Mtriangles/s\n",
+                            actual_triangle_count, variant.p_name, rate_ms,
+                            static_cast<double>(actual_triangle_count) /
+                                rate_ms / 1e3);
+
+                app.free_acceleration_structures();
+            }
+        }
+        app.free_scene();
+    }
+
+    std::fclose(p_file);
+    app.free();
+    return EXIT_SUCCESS;
+}
@@ -2,11 +2,46 @@
 
 #include "memory.hpp"
 
-void AccelerationStructure::create_buffer(VkDevice* p_logical_device,
-                                          VkPhysicalDevice* p_physical_device,
-                                          VkDeviceSize size,
-                                          VkBufferUsageFlags usage_flags,
-                                          VkMemoryPropertyFlags property_flags,
-                                          VkBuffer* p_buffer,
-                                          VkDeviceMemory* p_buffer_memory) {
+void ScratchPool::reserve(
+    DeviceAllocator& allocator,
+    PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR,  // NOLINT
+    VkDeviceSize size) {
+    if (size <= this->size) {
+        return;
+    }
+    // Only called between builds, so nothing can still be using the old
+    // buffer.
+    if (this->buffer != VK_NULL_HANDLE) {
+        destroy_buffer(allocator, this->buffer, &this->allocation);
+    }
+
+    // The device address itself must also be aligned, so leave room to
+    // round it up.
+    create_buffer(allocator,
+                  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, size + this->alignment,
+                  this->buffer, &this->allocation);
+    this->size = size;
+
+    VkBufferDeviceAddressInfo scratch_buffer_device_address_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = this->buffer,
+    };
+    VkDeviceAddress buffer_address = vkGetBufferDeviceAddressKHR(
+        allocator.logical_device, &scratch_buffer_device_address_info);
+    this->device_address = this->aligned_size(buffer_address);
+}
+
+auto ScratchPool::aligned_size(VkDeviceSize scratch_size) const
+    -> VkDeviceSize {
+    return (scratch_size + this->alignment - 1) / this->alignment *
+           this->alignment;
+}
+
+void ScratchPool::free(DeviceAllocator& allocator) {
+    if (this->buffer != VK_NULL_HANDLE) {
+        destroy_buffer(allocator, this->buffer, &this->allocation);
+    }
+    this->size = 0;
 }
@@ -1,13 +1,24 @@
 #include "app.hpp"
 
 #include <GLFW/glfw3.h>
+#include <algorithm>
 #include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
 #include <cstring>
+#include <iostream>
 #include <limits>
+#include <string>
+#include <thread>
 #include <vulkan/vulkan_core.h>
 
 #include "memory.hpp"
+#include "mesh_encoding.hpp"
+#include "ppm.hpp"
 #include "stx/panic.h"
+#include "trace.hpp"
 
 static std::array<char, 500> key_down_index;
 
@@ -21,18 +32,82 @@ static void key_callback(GLFWwindow* /*p_window*/, int key, int /*scancode*/,
     }
 }
 
-void App::create_surface() {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    this->window =
-        glfwCreateWindow(800, 600, "Raytracing Demo", nullptr, nullptr);
-    glfwSetInputMode(this->window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
-    glfwSetKeyCallback(this->window, key_callback);
+static void framebuffer_size_callback(GLFWwindow* p_window, int /*width*/,
+                                      int /*height*/) {
+    static_cast<App*>(glfwGetWindowUserPointer(p_window))->resized = true;
+}
+
+static auto get_present_mode_name(VkPresentModeKHR present_mode)
+    -> char const* {
+    switch (present_mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR:
+            return "immediate";
+        case VK_PRESENT_MODE_MAILBOX_KHR:
+            return "mailbox";
+        case VK_PRESENT_MODE_FIFO_KHR:
+            return "FIFO";
+        default:
+            return "another mode";
+    }
+}
+
+// Every device extension the renderer needs. The swapchain extension is last,
+// so that headless mode can leave it out.
+static constexpr uint32_t device_extension_count = 12;
+static char const* const device_extension_names[device_extension_count] = {
+    "VK_KHR_ray_tracing_pipeline",
+    "VK_KHR_acceleration_structure",
+    "VK_KHR_spirv_1_4",
+    "VK_KHR_shader_float_controls",
+    "VK_KHR_get_memory_requirements2",
+    "VK_EXT_descriptor_indexing",
+    "VK_KHR_buffer_device_address",
+    "VK_KHR_deferred_host_operations",
+    "VK_KHR_pipeline_library",
+    "VK_KHR_maintenance3",
+    "VK_KHR_maintenance1",
+    "VK_KHR_swapchain",
+};
+
+// Whether the device has every one of `name_count` extensions.
+static auto are_extensions_supported(VkPhysicalDevice physical_device,
+                                     char const* const* p_names,
+                                     uint32_t name_count) -> bool {
+    uint32_t available_extension_count = 0;
+    vkEnumerateDeviceExtensionProperties(physical_device, nullptr,
+                                         &available_extension_count, nullptr);
+    VkExtensionProperties* p_available_extensions =
+        new (std::nothrow) VkExtensionProperties[available_extension_count];
+    vkEnumerateDeviceExtensionProperties(physical_device, nullptr,
+                                         &available_extension_count,
+                                         p_available_extensions);
+
+    bool is_supported = true;
+    for (uint32_t i = 0; i < name_count; i++) {
+        bool is_found = false;
+        for (uint32_t j = 0; j < available_extension_count; j++) {
+            if (strcmp(p_names[i], p_available_extensions[j].extensionName) ==
+                0) {
+                is_found = true;
+                break;
+            }
+        }
+        is_supported = is_supported && is_found;
+    }
+
+    delete[] p_available_extensions;
+    return is_supported;
+}
 
+void App::create_instance() {
+    TRACE_ZONE("create_instance");
     uint32_t glfw_extension_count = 0;
-    char const** p_glfw_extension_names =
-        glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    char const** p_glfw_extension_names = nullptr;
+    if (!this->is_headless) {
+        glfwInit();
+        p_glfw_extension_names =
+            glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    }
     uint32_t const extension_count = glfw_extension_count + 1;
     char const** p_extension_names =
         new (std::nothrow) char const*[extension_count];
@@ -52,10 +127,23 @@ void App::create_surface() {
         .apiVersion = VK_API_VERSION_1_2,
     };
 
-    constexpr uint32_t layer_count = 1;
-    char const* layer_names[layer_count] = {
-        "VK_LAYER_KHRONOS_validation",
-    };
+    // Render nodes and regression rigs do not necessarily have the SDK's
+    // layers installed.
+    char const* p_validation_layer_name = "VK_LAYER_KHRONOS_validation";
+    uint32_t available_layer_count = 0;
+    vkEnumerateInstanceLayerProperties(&available_layer_count, nullptr);
+    VkLayerProperties* p_available_layers =
+        new (std::nothrow) VkLayerProperties[available_layer_count];
+    vkEnumerateInstanceLayerProperties(&available_layer_count,
+                                       p_available_layers);
+    uint32_t layer_count = 0;
+    for (uint32_t i = 0; i < available_layer_count; i++) {
+        if (strcmp(p_available_layers[i].layerName, p_validation_layer_name) ==
+            0) {
+            layer_count = 1;
+        }
+    }
+    delete[] p_available_layers;
 
     VkInstanceCreateInfo instance_create_info = {
         .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
@@ -63,7 +151,7 @@ void App::create_surface() {
         .flags = 0,
         .pApplicationInfo = &application_info,
         .enabledLayerCount = layer_count,
-        .ppEnabledLayerNames = layer_names,
+        .ppEnabledLayerNames = &p_validation_layer_name,
         .enabledExtensionCount = extension_count,
         .ppEnabledExtensionNames = p_extension_names,
     };
@@ -73,20 +161,164 @@ void App::create_surface() {
         stx::panic("Failed to create instance!");
     }
 
-    if (!glfwCreateWindowSurface(this->instance, this->window, nullptr,
-                                 &this->surface)) {
+    delete[] p_extension_names;
+}
+
+auto App::has_ray_tracing_device() -> bool {
+    TRACE_ZONE("has_ray_tracing_device");
+    VkApplicationInfo application_info = {
+        .sType = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pNext = VK_NULL_HANDLE,
+        .pApplicationName = "Raytracing Demo",
+        .applicationVersion = VK_MAKE_VERSION(1, 0, 0),
+        .pEngineName = "",
+        .engineVersion = VK_MAKE_VERSION(1, 0, 0),
+        .apiVersion = VK_API_VERSION_1_2,
+    };
+    VkInstanceCreateInfo instance_create_info = {
+        .sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .pApplicationInfo = &application_info,
+        .enabledLayerCount = 0,
+        .ppEnabledLayerNames = nullptr,
+        .enabledExtensionCount = 0,
+        .ppEnabledExtensionNames = nullptr,
+    };
+    // Machines without any driver fail here already.
+    VkInstance probe_instance;
+    if (vkCreateInstance(&instance_create_info, nullptr, &probe_instance) !=
+        VK_SUCCESS) {
+        return false;
+    }
+
+    uint32_t device_count = 0;
+    vkEnumeratePhysicalDevices(probe_instance, &device_count, nullptr);
+    VkPhysicalDevice* p_devices =
+        new (std::nothrow) VkPhysicalDevice[device_count];
+    vkEnumeratePhysicalDevices(probe_instance, &device_count, p_devices);
+    bool is_found = false;
+    for (uint32_t i = 0; i < device_count && !is_found; i++) {
+        is_found = this->does_device_support_extensions(p_devices[i]) &&
+                   does_device_support_features(p_devices[i]);
     }
+    delete[] p_devices;
 
-    delete[] p_extension_names;
+    vkDestroyInstance(probe_instance, nullptr);
+    return is_found;
+}
+
+void App::create_surface() {
+    TRACE_ZONE("create_surface");
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
+    this->window =
+        glfwCreateWindow(static_cast<int>(this->width),
+                         static_cast<int>(this->height), "Raytracing Demo",
+                         nullptr, nullptr);
+    glfwSetInputMode(this->window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    glfwSetKeyCallback(this->window, key_callback);
+    glfwSetWindowUserPointer(this->window, this);
+    glfwSetFramebufferSizeCallback(this->window, framebuffer_size_callback);
+
+    if (glfwCreateWindowSurface(this->instance, this->window, nullptr,
+                                &this->surface) != VK_SUCCESS) {
+        stx::panic("Failed to create a window surface!");
+    }
+}
+
+auto App::does_device_support_extensions(VkPhysicalDevice physical_device)
+    -> bool {
+    return are_extensions_supported(
+        physical_device, device_extension_names,
+        device_extension_count - (this->is_headless ? 1 : 0));
+}
+
+auto App::does_device_support_features(VkPhysicalDevice physical_device)
+    -> bool {
+    VkPhysicalDeviceDescriptorIndexingFeatures descriptor_indexing_features = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+        .pNext = nullptr,
+    };
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .pNext = &descriptor_indexing_features,
+    };
+    VkPhysicalDeviceBufferDeviceAddressFeatures
+        buffer_device_address_features = {
+            .sType =
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES_EXT,
+            .pNext = &timeline_semaphore_features,
+        };
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR
+        ray_tracing_pipeline_features = {
+            .sType =
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
+            .pNext = &buffer_device_address_features,
+        };
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR
+        acceleration_structure_features = {
+            .sType =
+                VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
+            .pNext = &ray_tracing_pipeline_features,
+        };
+    VkPhysicalDeviceFeatures2 physical_device_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &acceleration_structure_features,
+    };
+    vkGetPhysicalDeviceFeatures2(physical_device, &physical_device_features);
+
+    // Everything `create_logical_device()` enables unconditionally.
+    VkBool32 const required_features[] = {
+        acceleration_structure_features.accelerationStructure,
+        ray_tracing_pipeline_features.rayTracingPipeline,
+        buffer_device_address_features.bufferDeviceAddress,
+        timeline_semaphore_features.timelineSemaphore,
+        descriptor_indexing_features.shaderSampledImageArrayNonUniformIndexing,
+        descriptor_indexing_features
+            .descriptorBindingSampledImageUpdateAfterBind,
+        descriptor_indexing_features.descriptorBindingPartiallyBound,
+        descriptor_indexing_features.descriptorBindingVariableDescriptorCount,
+        descriptor_indexing_features.runtimeDescriptorArray,
+    };
+    for (VkBool32 is_supported : required_features) {
+        if (is_supported != VK_TRUE) {
+            return false;
+        }
+    }
+    return true;
 }
 
 void App::create_physical_device() {
+    TRACE_ZONE("create_physical_device");
     uint32_t device_count = 0;
     vkEnumeratePhysicalDevices(this->instance, &device_count, nullptr);
     VkPhysicalDevice* p_devices =
         new (std::nothrow) VkPhysicalDevice[device_count];
     vkEnumeratePhysicalDevices(this->instance, &device_count, p_devices);
-    this->physical_device = p_devices[1];
+
+    // Take the first device that can ray trace, but prefer a discrete GPU.
+    // Software implementations such as lavapipe are only picked when nothing
+    // else is available.
+    this->physical_device = VK_NULL_HANDLE;
+    for (uint32_t i = 0; i < device_count; i++) {
+        if (!this->does_device_support_extensions(p_devices[i]) ||
+            !does_device_support_features(p_devices[i])) {
+            continue;
+        }
+        VkPhysicalDeviceProperties device_properties;
+        vkGetPhysicalDeviceProperties(p_devices[i], &device_properties);
+        if (this->physical_device == VK_NULL_HANDLE ||
+            device_properties.deviceType ==
+                VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+            this->physical_device = p_devices[i];
+        }
+        if (device_properties.deviceType ==
+            VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) {
+            break;
+        }
+    }
 
     if (this->physical_device == VK_NULL_HANDLE) {
         stx::panic("Failed to select a physical device!");
@@ -95,56 +327,218 @@ void App::create_physical_device() {
     vkGetPhysicalDeviceMemoryProperties(this->physical_device,
                                         &(this->memory_properties));
 
+    this->acceleration_structure_properties = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR,
+        .pNext = nullptr,
+    };
+    this->ray_tracing_pipeline_properties = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR,
+        .pNext = &this->acceleration_structure_properties,
+    };
+    VkPhysicalDeviceProperties2 physical_device_properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &this->ray_tracing_pipeline_properties,
+    };
+    vkGetPhysicalDeviceProperties2(this->physical_device,
+                                   &physical_device_properties);
+    this->scratch_pool.alignment =
+        this->acceleration_structure_properties
+            .minAccelerationStructureScratchOffsetAlignment;
+    this->tlas_scratch_pool.alignment = this->scratch_pool.alignment;
+
+    if (this->should_build_blas_on_host) {
+        VkPhysicalDeviceAccelerationStructureFeaturesKHR
+            supported_acceleration_structure_features = {
+                .sType =
+                    VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
+                .pNext = nullptr,
+            };
+        VkPhysicalDeviceFeatures2 physical_device_features = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            .pNext = &supported_acceleration_structure_features,
+        };
+        vkGetPhysicalDeviceFeatures2(this->physical_device,
+                                     &physical_device_features);
+        if (supported_acceleration_structure_features
+                .accelerationStructureHostCommands != VK_TRUE) {
+            std::cout << "Host acceleration structure builds are not "
+                         "supported, so BLASes are built on the GPU.\n";
+            this->should_build_blas_on_host = false;
+        }
+    }
+
+    VkPhysicalDeviceProperties device_properties;
+    vkGetPhysicalDeviceProperties(this->physical_device, &device_properties);
+    std::cout << "Using " << device_properties.deviceName << ".\n";
+
     delete[] p_devices;
 }
 
-void App::create_logical_device() {
-    this->generic_queue_index = 0;
+void App::find_queue_families() {
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(this->physical_device,
+                                             &queue_family_count, nullptr);
+    VkQueueFamilyProperties* p_queue_families =
+        new (std::nothrow) VkQueueFamilyProperties[queue_family_count];
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        this->physical_device, &queue_family_count, p_queue_families);
+
+    // Tracing and the blit need a family that does everything, and can
+    // present to the window.
+    this->generic_queue_index = queue_family_count;
+    for (uint32_t i = 0; i < queue_family_count; i++) {
+        VkQueueFlags const required_flags =
+            VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT;
+        if ((p_queue_families[i].queueFlags & required_flags) !=
+            required_flags) {
+            continue;
+        }
+        if (!this->is_headless) {
+            VkBool32 is_present_supported = 0;
+            vkGetPhysicalDeviceSurfaceSupportKHR(this->physical_device, i,
+                                                 this->surface,
+                                                 &is_present_supported);
+            if (is_present_supported != VK_TRUE) {
+                continue;
+            }
+        }
+        this->generic_queue_index = i;
+        break;
+    }
+    if (this->generic_queue_index == queue_family_count) {
+        stx::panic("Failed to find a queue family that can present!");
+    }
 
-    VkBool32 is_present_supported = 0;
-    vkGetPhysicalDeviceSurfaceSupportKHR(this->physical_device,
-                                         this->generic_queue_index,
-                                         this->surface, &is_present_supported);
-    if (is_present_supported != VK_TRUE) {
-        stx::panic("Surface presentation is not supported!");
+    // Prefer families that can not do graphics, since those are the ones
+    // that run alongside the generic queue. Builds are profiled, so the
+    // compute family also needs timestamps.
+    this->compute_queue_index = this->generic_queue_index;
+    this->transfer_queue_index = this->generic_queue_index;
+    for (uint32_t i = 0; i < queue_family_count; i++) {
+        VkQueueFlags const flags = p_queue_families[i].queueFlags;
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) != 0) {
+            continue;
+        }
+        if ((flags & VK_QUEUE_COMPUTE_BIT) != 0 &&
+            p_queue_families[i].timestampValidBits > 0 &&
+            this->compute_queue_index == this->generic_queue_index) {
+            this->compute_queue_index = i;
+        }
+        if ((flags & VK_QUEUE_TRANSFER_BIT) != 0 &&
+            (flags & VK_QUEUE_COMPUTE_BIT) == 0 &&
+            this->transfer_queue_index == this->generic_queue_index) {
+            this->transfer_queue_index = i;
+        }
     }
+    delete[] p_queue_families;
 
-    constexpr uint32_t device_enabled_extension_count = 12;
-    char const* device_enabled_extension_names[device_enabled_extension_count] =
-        {
-            "VK_KHR_swapchain",
-            "VK_KHR_ray_tracing_pipeline",
-            "VK_KHR_acceleration_structure",
-            "VK_KHR_spirv_1_4",
-            "VK_KHR_shader_float_controls",
-            "VK_KHR_get_memory_requirements2",
-            "VK_EXT_descriptor_indexing",
-            "VK_KHR_buffer_device_address",
-            "VK_KHR_deferred_host_operations",
-            "VK_KHR_pipeline_library",
-            "VK_KHR_maintenance3",
-            "VK_KHR_maintenance1",
-        };
+    std::cout << "Queue families: generic " << this->generic_queue_index
+              << ", compute " << this->compute_queue_index << ", transfer "
+              << this->transfer_queue_index << ".\n";
+}
+
+void App::create_logical_device() {
+    TRACE_ZONE("create_logical_device");
+    this->find_queue_families();
 
+    // One queue from each distinct family.
     float const queue_priority = 1.0f;
-    constexpr uint32_t device_queue_create_info_count = 1;
-    // TODO: Move to struct?
-    VkDeviceQueueCreateInfo
-        device_queue_create_infos[device_queue_create_info_count] = {
-            {
-                .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-                .pNext = nullptr,
-                .flags = 0,
-                .queueFamilyIndex = this->generic_queue_index,
-                .queueCount = 1,
-                .pQueuePriorities = &queue_priority,
-            },
+    uint32_t const queue_family_indices[3] = {
+        this->generic_queue_index,
+        this->compute_queue_index,
+        this->transfer_queue_index,
+    };
+    uint32_t device_queue_create_info_count = 0;
+    VkDeviceQueueCreateInfo device_queue_create_infos[3];
+    for (uint32_t queue_family_index : queue_family_indices) {
+        bool is_duplicate = false;
+        for (uint32_t i = 0; i < device_queue_create_info_count; i++) {
+            is_duplicate |= device_queue_create_infos[i].queueFamilyIndex ==
+                            queue_family_index;
+        }
+        if (is_duplicate) {
+            continue;
+        }
+        device_queue_create_infos[device_queue_create_info_count++] = {
+            .sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0,
+            .queueFamilyIndex = queue_family_index,
+            .queueCount = 1,
+            .pQueuePriorities = &queue_priority,
+        };
+    }
+    // Buffers are shared by every family that is in use.
+    for (uint32_t i = 0; i < device_queue_create_info_count; i++) {
+        this->allocator.queue_family_indices[i] =
+            device_queue_create_infos[i].queueFamilyIndex;
+    }
+    this->allocator.queue_family_count = device_queue_create_info_count;
+
+    // The profiler resets its queries on the host, and turns itself off
+    // where that is not supported.
+    this->host_query_reset_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES,
+        .pNext = nullptr,
+    };
+    VkPhysicalDeviceFeatures2 supported_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &this->host_query_reset_features,
+    };
+    vkGetPhysicalDeviceFeatures2(this->physical_device, &supported_features);
+
+    // Presentation can only be waited on with both extensions, which need a
+    // swapchain. Without them, latency is measured to the GPU instead.
+    this->present_id_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
+        .pNext = nullptr,
+    };
+    this->present_wait_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        .pNext = &this->present_id_features,
+    };
+    char const* const present_extension_names[2] = {
+        "VK_KHR_present_id",
+        "VK_KHR_present_wait",
+    };
+    if (!this->is_headless &&
+        are_extensions_supported(this->physical_device,
+                                 present_extension_names, 2)) {
+        VkPhysicalDeviceFeatures2 present_features = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+            .pNext = &this->present_wait_features,
         };
+        vkGetPhysicalDeviceFeatures2(this->physical_device,
+                                     &present_features);
+        this->is_present_wait_enabled =
+            this->present_id_features.presentId == VK_TRUE &&
+            this->present_wait_features.presentWait == VK_TRUE;
+    }
+
+    // Just what the texture array of the material sets needs.
+    this->descriptor_indexing_features = {
+        .sType =
+            VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES,
+        .pNext = &this->host_query_reset_features,
+        .shaderSampledImageArrayNonUniformIndexing = VK_TRUE,
+        .descriptorBindingSampledImageUpdateAfterBind = VK_TRUE,
+        .descriptorBindingPartiallyBound = VK_TRUE,
+        .descriptorBindingVariableDescriptorCount = VK_TRUE,
+        .runtimeDescriptorArray = VK_TRUE,
+    };
+
+    this->timeline_semaphore_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_TIMELINE_SEMAPHORE_FEATURES,
+        .pNext = &this->descriptor_indexing_features,
+        .timelineSemaphore = VK_TRUE,
+    };
 
     this->buffer_device_address_features = {
         .sType =
             VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES_EXT,
-        .pNext = nullptr,
+        .pNext = &timeline_semaphore_features,
         .bufferDeviceAddress = VK_TRUE,
         .bufferDeviceAddressCaptureReplay = VK_FALSE,
         .bufferDeviceAddressMultiDevice = VK_FALSE,
@@ -167,22 +561,51 @@ void App::create_logical_device() {
             VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR,
         .pNext = &ray_tracing_pipeline_features,
         .accelerationStructure = VK_TRUE,
-        .accelerationStructureCaptureReplay = VK_TRUE,
+        .accelerationStructureCaptureReplay = VK_FALSE,
         .accelerationStructureIndirectBuild = VK_FALSE,
-        .accelerationStructureHostCommands = VK_FALSE,
+        .accelerationStructureHostCommands =
+            this->should_build_blas_on_host ? VK_TRUE : VK_FALSE,
         .descriptorBindingAccelerationStructureUpdateAfterBind = VK_FALSE,
     };
 
+    // Textures are block compressed, and are skipped without it.
+    this->device_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &acceleration_structure_features,
+        .features =
+            {
+                .textureCompressionBC =
+                    supported_features.features.textureCompressionBC,
+            },
+    };
+
+    if (this->is_present_wait_enabled) {
+        this->present_id_features.pNext = &acceleration_structure_features;
+        this->device_features.pNext = &this->present_wait_features;
+    }
+
+    char const* extension_names[device_extension_count + 2];
+    uint32_t extension_count =
+        device_extension_count - (this->is_headless ? 1 : 0);
+    for (uint32_t i = 0; i < extension_count; i++) {
+        extension_names[i] = device_extension_names[i];
+    }
+    if (this->is_present_wait_enabled) {
+        extension_names[extension_count++] = present_extension_names[0];
+        extension_names[extension_count++] = present_extension_names[1];
+    }
+
     VkDeviceCreateInfo device_create_info = {
         .sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pNext = &acceleration_structure_features,
+        .pNext = &this->device_features,
         .flags = 0,
         .queueCreateInfoCount = device_queue_create_info_count,
         .pQueueCreateInfos = device_queue_create_infos,
         .enabledLayerCount = 0,
         .ppEnabledLayerNames = nullptr,
-        .enabledExtensionCount = device_enabled_extension_count,
-        .ppEnabledExtensionNames = device_enabled_extension_names,
+        .enabledExtensionCount = extension_count,
+        .ppEnabledExtensionNames = extension_names,
+        // Core features are enabled through `device_features` instead.
         .pEnabledFeatures = nullptr,
     };
 
@@ -195,11 +618,28 @@ void App::create_logical_device() {
                      &this->present_queue);
     vkGetDeviceQueue(this->logical_device, this->generic_queue_index, 0,
                      &this->graphics_queue);
-    vkGetDeviceQueue(this->logical_device, this->generic_queue_index, 0,
+    vkGetDeviceQueue(this->logical_device, this->compute_queue_index, 0,
                      &this->compute_queue);
+    vkGetDeviceQueue(this->logical_device, this->transfer_queue_index, 0,
+                     &this->transfer_queue);
+
+    VkSemaphoreTypeCreateInfo semaphore_type_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+    VkSemaphoreCreateInfo semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &semaphore_type_create_info,
+    };
+    if (vkCreateSemaphore(this->logical_device, &semaphore_create_info,
+                          nullptr, &this->build_timeline) != VK_SUCCESS) {
+        stx::panic("Failed to create the build timeline semaphore!");
+    }
 }
 
 void App::create_swapchain() {
+    TRACE_ZONE("create_swapchain");
     VkSurfaceCapabilitiesKHR surface_capabilities;
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(
         this->physical_device, this->surface, &surface_capabilities);
@@ -223,11 +663,67 @@ void App::create_swapchain() {
         this->physical_device, this->surface, &present_mode_count,
         p_surface_present_modes);
 
+    // FIFO is the one mode every surface has.
+    this->present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    for (uint32_t i = 0; i < present_mode_count; i++) {
+        if (p_surface_present_modes[i] == this->requested_present_mode) {
+            this->present_mode = this->requested_present_mode;
+        }
+    }
+    if (this->present_mode != this->requested_present_mode &&
+        this->swapchain == VK_NULL_HANDLE) {
+        std::cout << "The surface can not present with "
+                  << get_present_mode_name(this->requested_present_mode)
+                  << ", so presenting with FIFO.\n";
+    }
+
+    // The storage image is linear, so an sRGB format lets the blit encode
+    // it. Otherwise, whatever the surface prefers.
     VkSurfaceFormatKHR surface_format = p_surface_formats[0];
-    VkPresentModeKHR present_mode = p_surface_present_modes[0];
+    for (uint32_t i = 0; i < format_count; i++) {
+        VkSurfaceFormatKHR const& candidate = p_surface_formats[i];
+        if ((candidate.format == VK_FORMAT_B8G8R8A8_SRGB ||
+             candidate.format == VK_FORMAT_R8G8B8A8_SRGB) &&
+            candidate.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+            surface_format = candidate;
+            break;
+        }
+    }
+
     VkExtent2D extent = surface_capabilities.currentExtent;
+    // Some window systems leave the extent up to the swapchain.
+    if (extent.width == std::numeric_limits<uint32_t>::max()) {
+        int framebuffer_width;
+        int framebuffer_height;
+        glfwGetFramebufferSize(this->window, &framebuffer_width,
+                               &framebuffer_height);
+        // Which must still be within what the surface allows.
+        extent = {
+            .width = std::clamp(static_cast<uint32_t>(framebuffer_width),
+                                surface_capabilities.minImageExtent.width,
+                                surface_capabilities.maxImageExtent.width),
+            .height = std::clamp(static_cast<uint32_t>(framebuffer_height),
+                                 surface_capabilities.minImageExtent.height,
+                                 surface_capabilities.maxImageExtent.height),
+        };
+    }
 
-    this->image_count = surface_capabilities.minImageCount + 1;
+    // Mailbox needs an image to render into besides the one on screen and
+    // the one waiting for it. FIFO gets one image on screen and the rest
+    // queued.
+    uint32_t const min_image_count = surface_capabilities.minImageCount;
+    switch (this->present_mode) {
+        case VK_PRESENT_MODE_MAILBOX_KHR:
+            this->image_count = std::max(min_image_count + 1, 3u);
+            break;
+        case VK_PRESENT_MODE_FIFO_KHR:
+            this->image_count =
+                std::max(min_image_count, this->max_queued_frames + 1);
+            break;
+        default:
+            this->image_count = min_image_count + 1;
+            break;
+    }
     if (surface_capabilities.maxImageCount > 0 &&
         this->image_count > surface_capabilities.maxImageCount) {
         this->image_count = surface_capabilities.maxImageCount;
@@ -237,9 +733,8 @@ void App::create_swapchain() {
         .sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR,
         .surface = this->surface,
         .minImageCount = this->image_count,
-        // TODO: UNORM might be better than SRGB.
-        .imageFormat = VK_FORMAT_B8G8R8A8_SRGB,
-        .imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR,
+        .imageFormat = surface_format.format,
+        .imageColorSpace = surface_format.colorSpace,
         .imageExtent = extent,
         .imageArrayLayers = 1,
         .imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT |
@@ -249,9 +744,11 @@ void App::create_swapchain() {
     swapchain_create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     swapchain_create_info.preTransform = surface_capabilities.currentTransform;
     swapchain_create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    swapchain_create_info.presentMode = present_mode;
+    swapchain_create_info.presentMode = this->present_mode;
     swapchain_create_info.clipped = VK_TRUE;
-    swapchain_create_info.oldSwapchain = nullptr;
+    // Lets the presentation engine hand over to the new swapchain without
+    // the old one being destroyed first.
+    swapchain_create_info.oldSwapchain = this->swapchain;
 
     if (vkCreateSwapchainKHR(this->logical_device, &swapchain_create_info,
                              nullptr, &this->swapchain) != VK_SUCCESS) {
@@ -264,15 +761,20 @@ void App::create_swapchain() {
     vkGetSwapchainImagesKHR(this->logical_device, this->swapchain,
                             &this->image_count, this->swapchain_images);
 
-    this->swapchain_image_format = surface_format.format;
+    this->swapchain_image_format = swapchain_create_info.imageFormat;
+    this->swapchain_extent = extent;
 
     delete[] p_surface_formats;
     delete[] p_surface_present_modes;
 }
 
 void App::create_cmd_pool() {
+    TRACE_ZONE("create_cmd_pool");
     VkCommandPoolCreateInfo command_pool_create_info = {
         .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        // Only one-time command buffers come from here. Frames have their own
+        // pools, in `frame_cmd_pools`.
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
         .queueFamilyIndex = this->generic_queue_index,
     };
 
@@ -280,13 +782,22 @@ void App::create_cmd_pool() {
                             NULL, &this->cmd_pool) != VK_SUCCESS) {
         stx::panic("Failed to create a command pool!");
     }
+
+    command_pool_create_info.queueFamilyIndex = this->compute_queue_index;
+    if (vkCreateCommandPool(this->logical_device, &command_pool_create_info,
+                            NULL, &this->compute_cmd_pool) != VK_SUCCESS) {
+        stx::panic("Failed to create a command pool!");
+    }
 }
 
-void App::create_storage_image() {
-    VkImageCreateInfo image = {
+void App::create_image(StorageImage& image, VkFormat format,
+                       VkImageUsageFlags usage_flags) {
+    image.format = format;
+
+    VkImageCreateInfo image_create_info = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
         .imageType = VK_IMAGE_TYPE_2D,
-        .format = this->swapchain_image_format,
+        .format = image.format,
         .extent =
             {
                 .width = this->width,
@@ -297,43 +808,33 @@ void App::create_storage_image() {
         .arrayLayers = 1,
         .samples = VK_SAMPLE_COUNT_1_BIT,
         .tiling = VK_IMAGE_TILING_OPTIMAL,
-        .usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
+        .usage = usage_flags,
         .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
     };
 
-    if (vkCreateImage(this->logical_device, &image, nullptr,
-                      &this->storage_image.image) != VK_SUCCESS) {
+    if (vkCreateImage(this->logical_device, &image_create_info, nullptr,
+                      &image.image) != VK_SUCCESS) {
         stx::panic("Failed to create image!");
     }
 
     VkMemoryRequirements memory_requirements;
-    vkGetImageMemoryRequirements(
-        this->logical_device, this->storage_image.image, &memory_requirements);
-
-    VkMemoryAllocateInfo memory_allocate_info = {
-        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .pNext = nullptr,
-        .allocationSize = memory_requirements.size,
-        .memoryTypeIndex = find_memory_type(memory_requirements.memoryTypeBits,
-                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-                                            this->physical_device),
-    };
+    vkGetImageMemoryRequirements(this->logical_device, image.image,
+                                 &memory_requirements);
 
-    if (vkAllocateMemory(this->logical_device, &memory_allocate_info, nullptr,
-                         &this->storage_image.memory) != VK_SUCCESS) {
-        stx::panic("Faile to allocate image memory!");
-    }
+    image.allocation = this->allocator.allocate(
+        memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
 
-    if (vkBindImageMemory(this->logical_device, this->storage_image.image,
-                          this->storage_image.memory, 0) != VK_SUCCESS) {
+    if (vkBindImageMemory(this->logical_device, image.image,
+                          image.allocation.memory,
+                          image.allocation.offset) != VK_SUCCESS) {
         stx::panic("Failed to bind image memory!");
     }
 
     VkImageViewCreateInfo color_image_view = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
-        .image = this->storage_image.image,
+        .image = image.image,
         .viewType = VK_IMAGE_VIEW_TYPE_2D,
-        .format = this->swapchain_image_format,
+        .format = image.format,
         .subresourceRange =
             {
                 .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
@@ -345,12 +846,84 @@ void App::create_storage_image() {
     };
 
     if (vkCreateImageView(this->logical_device, &color_image_view, nullptr,
-                          &this->storage_image.view) != VK_SUCCESS) {
+                          &image.view) != VK_SUCCESS) {
         stx::panic("Failed to create an image view");
     }
 }
 
+void App::create_storage_image() {
+    TRACE_ZONE("create_storage_image");
+    // Swapchain formats are rarely usable as storage images, so shaders write
+    // to a plain UNORM image that is copied out of afterwards.
+    this->create_image(
+        this->storage_image, VK_FORMAT_R8G8B8A8_UNORM,
+        VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+    // Full precision, because the mean moves by ever smaller steps as
+    // samples accumulate.
+    this->create_image(this->accumulation_image,
+                       VK_FORMAT_R32G32B32A32_SFLOAT,
+                       VK_IMAGE_USAGE_STORAGE_BIT);
+    this->create_image(this->variance_image, VK_FORMAT_R32_SFLOAT,
+                       VK_IMAGE_USAGE_STORAGE_BIT);
+    this->create_image(this->sample_count_image, VK_FORMAT_R32_UINT,
+                       VK_IMAGE_USAGE_STORAGE_BIT);
+
+    // The images stay in the general layout, which shaders and transfers can
+    // all use. Their contents start out undefined, which the first frame
+    // ignores because `should_reset_accumulation` starts out set.
+    constexpr uint32_t image_count = 4;
+    VkImage const images[image_count] = {
+        this->storage_image.image,
+        this->accumulation_image.image,
+        this->variance_image.image,
+        this->sample_count_image.image,
+    };
+    VkImageMemoryBarrier image_memory_barriers[image_count];
+    for (uint32_t i = 0; i < image_count; i++) {
+        image_memory_barriers[i] = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = images[i],
+            .subresourceRange =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .baseMipLevel = 0,
+                    .levelCount = 1,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1,
+                },
+        };
+    }
+    VkCommandBuffer p_command_buffer =
+        this->begin_one_time_cmd_buffer(this->graphics_queue);
+    vkCmdPipelineBarrier(p_command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         0, 0, nullptr, 0, nullptr, image_count,
+                         image_memory_barriers);
+    this->submit_one_time_cmd_buffer(p_command_buffer, this->graphics_queue);
+}
+
+void App::create_sampling_stats_buffer() {
+    VkDeviceSize const buffer_size =
+        sizeof(SamplingStats) * this->max_frames_in_flight;
+    create_buffer(this->allocator, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  buffer_size, this->sampling_stats_buffer,
+                  &this->sampling_stats_buffer_allocation);
+    this->p_sampling_stats = static_cast<SamplingStats*>(
+        this->sampling_stats_buffer_allocation.p_mapped);
+    std::memset(this->p_sampling_stats, 0, buffer_size);
+}
+
 void App::load_every_pfn() {
+    TRACE_ZONE("load_every_pfn");
     vkGetBufferDeviceAddressKHR =
         reinterpret_cast<PFN_vkGetBufferDeviceAddressKHR>(vkGetDeviceProcAddr(
             this->logical_device, "vkGetBufferDeviceAddressKHR"));
@@ -378,6 +951,34 @@ void App::load_every_pfn() {
         reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(
             vkGetDeviceProcAddr(this->logical_device,
                                 "vkGetAccelerationStructureDeviceAddressKHR"));
+    vkCmdWriteAccelerationStructuresPropertiesKHR =
+        reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(
+            vkGetDeviceProcAddr(
+                this->logical_device,
+                "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    vkCmdCopyAccelerationStructureKHR =
+        reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(
+            vkGetDeviceProcAddr(this->logical_device,
+                                "vkCmdCopyAccelerationStructureKHR"));
+    vkCreateDeferredOperationKHR =
+        reinterpret_cast<PFN_vkCreateDeferredOperationKHR>(
+            vkGetDeviceProcAddr(this->logical_device,
+                                "vkCreateDeferredOperationKHR"));
+    vkDestroyDeferredOperationKHR =
+        reinterpret_cast<PFN_vkDestroyDeferredOperationKHR>(
+            vkGetDeviceProcAddr(this->logical_device,
+                                "vkDestroyDeferredOperationKHR"));
+    vkGetDeferredOperationMaxConcurrencyKHR =
+        reinterpret_cast<PFN_vkGetDeferredOperationMaxConcurrencyKHR>(
+            vkGetDeviceProcAddr(this->logical_device,
+                                "vkGetDeferredOperationMaxConcurrencyKHR"));
+    vkGetDeferredOperationResultKHR =
+        reinterpret_cast<PFN_vkGetDeferredOperationResultKHR>(
+            vkGetDeviceProcAddr(this->logical_device,
+                                "vkGetDeferredOperationResultKHR"));
+    vkDeferredOperationJoinKHR =
+        reinterpret_cast<PFN_vkDeferredOperationJoinKHR>(vkGetDeviceProcAddr(
+            this->logical_device, "vkDeferredOperationJoinKHR"));
     vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(
         vkGetDeviceProcAddr(this->logical_device, "vkCmdTraceRaysKHR"));
     vkGetRayTracingShaderGroupHandlesKHR =
@@ -388,94 +989,203 @@ void App::load_every_pfn() {
         reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(
             vkGetDeviceProcAddr(this->logical_device,
                                 "vkCreateRayTracingPipelinesKHR"));
+    if (this->is_present_wait_enabled) {
+        vkWaitForPresentKHR = reinterpret_cast<PFN_vkWaitForPresentKHR>(
+            vkGetDeviceProcAddr(this->logical_device, "vkWaitForPresentKHR"));
+    }
 }
 
 void App::create_vertex_buffer() {
-    // TODO: Make this take a real mesh instead of a hard-coded triangle.
-    VkDeviceSize position_buffer_size = sizeof(App::Vertex) * 3;
-
-    VkBuffer p_position_staging_buffer;
-    VkDeviceMemory p_position_staging_buffer_memory;
-
-    create_buffer(this->logical_device, this->physical_device,
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  position_buffer_size, p_position_staging_buffer,
-                  &p_position_staging_buffer_memory);
-
-    void* p_position_data;
-    vkMapMemory(this->logical_device, p_position_staging_buffer_memory, 0,
-                position_buffer_size, 0, &p_position_data);
-    memcpy(p_position_data, &this->vertices, position_buffer_size);
-    vkUnmapMemory(this->logical_device, p_position_staging_buffer_memory);
+    TRACE_ZONE("create_vertex_buffer");
+    // Every device can build from half floats, but SNORM16 is optional.
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(this->physical_device,
+                                        VK_FORMAT_R16G16B16A16_SNORM,
+                                        &format_properties);
+    this->position_format =
+        (format_properties.bufferFeatures &
+         VK_FORMAT_FEATURE_ACCELERATION_STRUCTURE_VERTEX_BUFFER_BIT_KHR) != 0
+            ? VK_FORMAT_R16G16B16A16_SNORM
+            : VK_FORMAT_R16G16B16A16_SFLOAT;
+
+    void const* p_positions = this->scene.p_encoded_positions;
+    uint32_t const component_count = 4 * this->scene.vertex_count;
+    if (this->position_format == VK_FORMAT_R16G16B16A16_SFLOAT) {
+        this->p_half_positions =
+            new (std::nothrow) uint16_t[component_count];
+        for (uint32_t i = 0; i < component_count; i++) {
+            this->p_half_positions[i] = float_to_half(
+                static_cast<float>(this->scene.p_encoded_positions[i]) /
+                32767.0f);
+        }
+        p_positions = this->p_half_positions;
+    }
 
+    VkDeviceSize position_buffer_size = sizeof(int16_t) * component_count;
     create_buffer(
-        this->logical_device, this->physical_device,
+        this->allocator,
         VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, position_buffer_size,
-        vertex_position_buffer, &this->vertex_position_buffer_memory);
-
-    copy_buffer(this->logical_device, this->cmd_pool, p_position_staging_buffer,
-                this->vertex_position_buffer, position_buffer_size,
-                this->graphics_queue);
-
-    vkDestroyBuffer(this->logical_device, p_position_staging_buffer, nullptr);
-    vkFreeMemory(this->logical_device, p_position_staging_buffer_memory,
-                 nullptr);
+        this->vertex_position_buffer, &this->vertex_position_buffer_allocation);
+    this->uploader.upload_buffer(this->vertex_position_buffer, 0, p_positions,
+                                 position_buffer_size);
+
+    // Normals and UVs are only read by hit shaders.
+    VkDeviceSize normal_buffer_size =
+        sizeof(float) * 3 * this->scene.vertex_count;
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, normal_buffer_size,
+                  this->vertex_normal_buffer,
+                  &this->vertex_normal_buffer_allocation);
+    this->uploader.upload_buffer(this->vertex_normal_buffer, 0,
+                                 this->scene.p_normals, normal_buffer_size);
+
+    VkDeviceSize uv_buffer_size = sizeof(float) * 2 * this->scene.vertex_count;
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, uv_buffer_size,
+                  this->vertex_uv_buffer, &this->vertex_uv_buffer_allocation);
+    this->uploader.upload_buffer(this->vertex_uv_buffer, 0, this->scene.p_uvs,
+                                 uv_buffer_size);
 }
 
 void App::create_index_buffer() {
-    // TODO: Take arbitrary mesh instead of hard-coded triangle.
-    uint32_t num_faces = 1;
-    VkDeviceSize buffer_size = sizeof(uint32_t) * num_faces;
-    uint32_t* p_position_indices = new (std::nothrow) uint32_t[3];
-    p_position_indices[0] = 0;
-    p_position_indices[1] = 1;
-    p_position_indices[2] = 2;
-
-    VkBuffer p_staging_buffer;
-    VkDeviceMemory p_staging_buffer_memory;
-    create_buffer(this->logical_device, this->physical_device,
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  buffer_size, p_staging_buffer, &p_staging_buffer_memory);
-
-    void* p_data;
-    vkMapMemory(this->logical_device, p_staging_buffer_memory, 0, buffer_size,
-                0, &p_data);
-    memcpy(p_data, p_position_indices, buffer_size);
-    vkUnmapMemory(this->logical_device, p_staging_buffer_memory);
+    TRACE_ZONE("create_index_buffer");
+    VkDeviceSize buffer_size =
+        sizeof(uint32_t) * this->scene.encoded_index_word_count;
 
     create_buffer(
-        this->logical_device, this->physical_device,
+        this->allocator,
         VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
             VK_BUFFER_USAGE_TRANSFER_DST_BIT |
             VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer_size, this->index_buffer,
-        &this->index_buffer_memory);
+        &this->index_buffer_allocation);
+
+    this->uploader.upload_buffer(this->index_buffer, 0,
+                                 this->scene.p_encoded_indices, buffer_size);
+
+    VkDeviceSize const encoded_size =
+        sizeof(int16_t) * 4 * VkDeviceSize{this->scene.vertex_count} +
+        buffer_size;
+    VkDeviceSize const float_size =
+        sizeof(float) * 3 * VkDeviceSize{this->scene.vertex_count} +
+        sizeof(uint32_t) * VkDeviceSize{this->scene.index_count};
+    std::cout << "Encoded positions and indices into " << encoded_size / 1024
+              << " KiB, down from " << float_size / 1024 << " KiB.\n";
+}
+
+auto App::begin_one_time_cmd_buffer(VkQueue& queue) -> VkCommandBuffer {
+    VkCommandBufferAllocateInfo buffer_allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = queue == this->compute_queue ? this->compute_cmd_pool
+                                                    : this->cmd_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+
+    VkCommandBuffer p_command_buffer;
+    if (vkAllocateCommandBuffers(this->logical_device, &buffer_allocate_info,
+                                 &p_command_buffer) != VK_SUCCESS) {
+        stx::panic("Failed to allocate a one-time command buffer!");
+    }
+
+    VkCommandBufferBeginInfo command_buffer_begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(p_command_buffer, &command_buffer_begin_info) !=
+        VK_SUCCESS) {
+        stx::panic("Failed to begin a one-time command buffer!");
+    }
+    return p_command_buffer;
+}
+
+void App::submit_one_time_cmd_buffer(VkCommandBuffer p_command_buffer,
+                                     VkQueue& queue) {
+    if (vkEndCommandBuffer(p_command_buffer) != VK_SUCCESS) {
+        stx::panic("Failed to end a one-time command buffer!");
+    }
 
-    copy_buffer(this->logical_device, this->cmd_pool, p_staging_buffer,
-                this->index_buffer, buffer_size, this->graphics_queue);
+    VkFenceCreateInfo fence_create_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+    VkFence p_fence;
+    if (vkCreateFence(this->logical_device, &fence_create_info, nullptr,
+                      &p_fence) != VK_SUCCESS) {
+        stx::panic("Failed to create a one-time fence!");
+    }
 
-    vkDestroyBuffer(this->logical_device, p_staging_buffer, nullptr);
-    vkFreeMemory(this->logical_device, p_staging_buffer_memory, nullptr);
+    // Pending uploads go out first, so that this submission can wait on
+    // them. Earlier one-time submissions may have been on another queue.
+    this->uploader.flush();
+    VkSemaphore wait_semaphores[2] = {
+        this->uploader.timeline,
+        this->build_timeline,
+    };
+    uint64_t const wait_values[2] = {
+        this->uploader.timeline_value,
+        this->build_timeline_value,
+    };
+    VkPipelineStageFlags const wait_stages[2] = {
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+    };
+    uint64_t const signal_value = this->build_timeline_value + 1;
+    VkTimelineSemaphoreSubmitInfo timeline_semaphore_submit_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = 2,
+        .pWaitSemaphoreValues = wait_values,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &signal_value,
+    };
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timeline_semaphore_submit_info,
+        .waitSemaphoreCount = 2,
+        .pWaitSemaphores = wait_semaphores,
+        .pWaitDstStageMask = wait_stages,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &p_command_buffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &this->build_timeline,
+    };
+    {
+        TRACE_ZONE("queue_submit");
+        if (vkQueueSubmit(queue, 1, &submit_info, p_fence) != VK_SUCCESS) {
+            stx::panic("Failed to submit a one-time command buffer!");
+        }
+    }
+    this->build_timeline_value = signal_value;
+    // Only this submission is waited on, rather than the whole queue.
+    {
+        TRACE_ZONE("fence_wait");
+        if (vkWaitForFences(this->logical_device, 1, &p_fence, VK_TRUE,
+                            UINT64_MAX) != VK_SUCCESS) {
+            stx::panic("Failed to wait on a one-time command buffer!");
+        }
+    }
 
-    delete[] p_position_indices;
+    vkDestroyFence(this->logical_device, p_fence, nullptr);
+    vkFreeCommandBuffers(this->logical_device,
+                         queue == this->compute_queue ? this->compute_cmd_pool
+                                                      : this->cmd_pool,
+                         1, &p_command_buffer);
 }
 
 void App::create_blas() {
-    // Setup identity transform matrix
-    VkTransformMatrixKHR transform_matrix = {
-        1.0f, 0.0f, 0.0f, 0.0f,  //
-        0.0f, 1.0f, 0.0f, 0.0f,  //
-        0.0f, 0.0f, 1.0f, 0.0f,  //
-    };
+    TRACE_ZONE("create_blas");
+    // The vertex and index copies must be submitted ahead of the builds.
+    this->uploader.flush();
 
     VkBufferDeviceAddressInfo vertex_buffer_device_address_info = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
@@ -501,291 +1211,644 @@ void App::create_blas() {
         .deviceAddress = index_buffer_address,
     };
 
-    VkAccelerationStructureGeometryTrianglesDataKHR
-        acceleration_structure_geometry_triangles_data = {
-            .sType =
-                VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
+    VkBufferDeviceAddressInfo transform_buffer_device_address_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = this->blas_transform_buffer,
+    };
+    VkDeviceOrHostAddressConstKHR transform_device_or_host_address_const = {
+        .deviceAddress = vkGetBufferDeviceAddressKHR(
+            this->logical_device, &transform_buffer_device_address_info),
+    };
+
+    // Host builds read the scene straight out of host memory, and write into
+    // acceleration structures that the host can map.
+    VkAccelerationStructureBuildTypeKHR build_type =
+        VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR;
+    VkMemoryPropertyFlags blas_memory_property_flags =
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+    if (this->should_build_blas_on_host) {
+        build_type = VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR;
+        vertex_device_or_host_address_const.hostAddress =
+            this->p_half_positions != nullptr
+                ? static_cast<void const*>(this->p_half_positions)
+                : this->scene.p_encoded_positions;
+        index_device_or_host_address_const.hostAddress =
+            this->scene.p_encoded_indices;
+        transform_device_or_host_address_const.hostAddress =
+            this->p_blas_transforms;
+        blas_memory_property_flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    }
+
+    this->blas_build_size = 0;
+    // Every mesh gets its own BLAS, so that meshes can be instanced and
+    // rebuilt independently.
+    this->blas_count = this->scene.mesh_count;
+    this->p_blases = new (std::nothrow) AccelerationStructure[this->blas_count];
+
+    VkAccelerationStructureGeometryKHR* p_acceleration_structure_geometries =
+        new (std::nothrow) VkAccelerationStructureGeometryKHR[this->blas_count];
+    VkAccelerationStructureBuildGeometryInfoKHR*
+        p_acceleration_structure_build_geometry_infos = new (std::nothrow)
+            VkAccelerationStructureBuildGeometryInfoKHR[this->blas_count];
+    VkAccelerationStructureBuildRangeInfoKHR*
+        p_acceleration_structure_build_range_infos = new (std::nothrow)
+            VkAccelerationStructureBuildRangeInfoKHR[this->blas_count];
+    const VkAccelerationStructureBuildRangeInfoKHR**
+        pp_acceleration_structure_build_range_infos = new (std::nothrow)
+            const VkAccelerationStructureBuildRangeInfoKHR*[this->blas_count];
+    VkDeviceSize* p_scratch_sizes =
+        new (std::nothrow) VkDeviceSize[this->blas_count];
+
+    VkBuildAccelerationStructureFlagsKHR build_flags = this->blas_build_flags;
+    if (this->should_compact_blas) {
+        build_flags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+    }
+
+    for (uint32_t i = 0; i < this->blas_count; i++) {
+        Mesh const& mesh = this->scene.p_meshes[i];
+
+        VkAccelerationStructureGeometryTrianglesDataKHR
+            acceleration_structure_geometry_triangles_data = {
+                .sType =
+                    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
+                .pNext = nullptr,
+                .vertexFormat = this->position_format,
+                .vertexData = vertex_device_or_host_address_const,
+                .vertexStride = sizeof(int16_t) * 4,
+                .maxVertex = mesh.first_vertex + mesh.vertex_count - 1,
+                .indexType = mesh.is_index_16_bit != 0
+                                 ? VK_INDEX_TYPE_UINT16
+                                 : VK_INDEX_TYPE_UINT32,
+                .indexData = index_device_or_host_address_const,
+                .transformData = transform_device_or_host_address_const,
+            };
+
+        p_acceleration_structure_geometries[i] = {
+            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
             .pNext = nullptr,
-            .vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
-            .vertexData = vertex_device_or_host_address_const,
-            .vertexStride = sizeof(Vertex),
-            .maxVertex = 3,  // TODO: Change this to mesh vertex count.
-            .indexType = VK_INDEX_TYPE_UINT32,
-            .indexData = index_device_or_host_address_const,
-            .transformData = (VkDeviceOrHostAddressConstKHR){},
+            .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
+            .geometry =
+                {
+                    .triangles =
+                        acceleration_structure_geometry_triangles_data,
+                },
+            .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
         };
 
-    VkAccelerationStructureGeometryDataKHR
-        acceleration_structure_geometry_data = {
-            .triangles = acceleration_structure_geometry_triangles_data,
+        p_acceleration_structure_build_range_infos[i] = {
+            .primitiveCount = mesh.triangle_count(),
+            .primitiveOffset = static_cast<uint32_t>(
+                sizeof(uint32_t) * mesh.index_word_offset),
+            .firstVertex = mesh.first_vertex,
+            .transformOffset =
+                static_cast<uint32_t>(sizeof(VkTransformMatrixKHR) * i),
         };
+        pp_acceleration_structure_build_range_infos[i] =
+            &p_acceleration_structure_build_range_infos[i];
 
-    VkAccelerationStructureGeometryKHR acceleration_structure_geometry = {
-        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
-        .pNext = nullptr,
-        .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
-        .geometry = acceleration_structure_geometry_data,
-        .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
-    };
-
-    VkAccelerationStructureBuildGeometryInfoKHR
-        acceleration_structure_build_geometry_info = {
+        p_acceleration_structure_build_geometry_infos[i] = {
             .sType =
                 VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
             .pNext = nullptr,
             .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
-            .flags = 0,
+            .flags = build_flags,
             .mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
             .srcAccelerationStructure = VK_NULL_HANDLE,
             .dstAccelerationStructure = VK_NULL_HANDLE,
             .geometryCount = 1,
-            .pGeometries = &acceleration_structure_geometry,
+            .pGeometries = &p_acceleration_structure_geometries[i],
             .ppGeometries = nullptr,
             .scratchData = {},
         };
 
-    VkAccelerationStructureBuildSizesInfoKHR
-        acceleration_structure_build_sizes_info = {
-            .sType =
-                VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
-            .pNext = nullptr,
-            .accelerationStructureSize = 0,
-            .updateScratchSize = 0,
-            .buildScratchSize = 0,
-        };
+        VkAccelerationStructureBuildSizesInfoKHR
+            acceleration_structure_build_sizes_info = {
+                .sType =
+                    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+                .pNext = nullptr,
+                .accelerationStructureSize = 0,
+                .updateScratchSize = 0,
+                .buildScratchSize = 0,
+            };
 
-    vkGetAccelerationStructureBuildSizesKHR(
-        this->logical_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR,
-        &acceleration_structure_build_geometry_info,
-        &acceleration_structure_build_geometry_info.geometryCount,
-        &acceleration_structure_build_sizes_info);
+        uint32_t const max_primitive_count = mesh.triangle_count();
+        vkGetAccelerationStructureBuildSizesKHR(
+            this->logical_device, build_type,
+            &p_acceleration_structure_build_geometry_infos[i],
+            &max_primitive_count, &acceleration_structure_build_sizes_info);
+
+        AccelerationStructure& blas = this->p_blases[i];
+        blas.size =
+            acceleration_structure_build_sizes_info.accelerationStructureSize;
+        this->blas_build_size += blas.size;
+        create_buffer(this->allocator,
+                      VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                      blas_memory_property_flags, blas.size, blas.buffer,
+                      &blas.allocation);
+
+        VkAccelerationStructureCreateInfoKHR
+            acceleration_structure_create_info = {
+                .sType =
+                    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+                .pNext = nullptr,
+                .createFlags = 0,
+                .buffer = blas.buffer,
+                .offset = 0,
+                .size = blas.size,
+                .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                .deviceAddress = 0,
+            };
+        if (vkCreateAccelerationStructureKHR(
+                this->logical_device, &acceleration_structure_create_info,
+                nullptr, &blas.handle) != VK_SUCCESS) {
+            stx::panic("Failed to create a blas!");
+        }
+
+        VkAccelerationStructureDeviceAddressInfoKHR
+            acceleration_structure_device_address_info = {
+                .sType =
+                    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+                .accelerationStructure = blas.handle,
+            };
+        blas.device_address = vkGetAccelerationStructureDeviceAddressKHR(
+            this->logical_device, &acceleration_structure_device_address_info);
 
-    create_buffer(
-        this->logical_device, this->physical_device,
-        VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        acceleration_structure_build_sizes_info.accelerationStructureSize,
-        this->blas_buffer, &this->blas_buffer_memory);
-
-    VkBuffer p_scratch_buffer;
-    VkDeviceMemory p_scratch_buffer_memory;
-    create_buffer(
-        this->logical_device, this->physical_device,
-        VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        acceleration_structure_build_sizes_info.buildScratchSize,
-        p_scratch_buffer, &p_scratch_buffer_memory);
+        p_acceleration_structure_build_geometry_infos[i]
+            .dstAccelerationStructure = blas.handle;
+        p_scratch_sizes[i] = this->scratch_pool.aligned_size(
+            acceleration_structure_build_sizes_info.buildScratchSize);
+    }
 
-    VkBufferDeviceAddressInfo scratch_buffer_device_address_info = {
-        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
-        .buffer = p_scratch_buffer,
-    };
+    // Group consecutive meshes into batches whose scratch fits under the
+    // budget. A mesh that is over budget on its own still gets a batch.
+    uint32_t* p_batch_ends = new (std::nothrow) uint32_t[this->blas_count];
+    uint32_t batch_count = 0;
+    VkDeviceSize batch_scratch_size = 0;
+    VkDeviceSize max_batch_scratch_size = 0;
+    for (uint32_t i = 0; i < this->blas_count; i++) {
+        if (batch_scratch_size > 0 && batch_scratch_size + p_scratch_sizes[i] >
+                                          this->blas_scratch_budget) {
+            p_batch_ends[batch_count++] = i;
+            batch_scratch_size = 0;
+        }
+        batch_scratch_size += p_scratch_sizes[i];
+        if (batch_scratch_size > max_batch_scratch_size) {
+            max_batch_scratch_size = batch_scratch_size;
+        }
+    }
+    p_batch_ends[batch_count++] = this->blas_count;
+
+    this->blas_scratch_size = max_batch_scratch_size;
+    this->blas_size = this->blas_build_size;
+
+    VkCommandBuffer p_command_buffer = VK_NULL_HANDLE;
+    if (this->should_build_blas_on_host) {
+        this->build_blas_on_host(
+            p_acceleration_structure_build_geometry_infos,
+            pp_acceleration_structure_build_range_infos, p_scratch_sizes,
+            p_batch_ends, batch_count, max_batch_scratch_size);
+        // Queue submission makes the host's writes visible to the GPU.
+        p_command_buffer = this->begin_one_time_cmd_buffer(this->compute_queue);
+    } else {
+        this->scratch_pool.reserve(this->allocator,
+                                   this->vkGetBufferDeviceAddressKHR,
+                                   max_batch_scratch_size);
+
+        // Record every batch into one command buffer. Batches reuse the same
+        // scratch memory, so each one waits for the previous batch's builds.
+        p_command_buffer = this->begin_one_time_cmd_buffer(this->compute_queue);
+        uint32_t const build_scope =
+            this->profiler.begin_scope(p_command_buffer, "blas_build");
+        uint32_t batch_begin = 0;
+        for (uint32_t batch = 0; batch < batch_count; batch++) {
+            uint32_t batch_end = p_batch_ends[batch];
+
+            VkDeviceSize scratch_offset = 0;
+            for (uint32_t i = batch_begin; i < batch_end; i++) {
+                p_acceleration_structure_build_geometry_infos[i]
+                    .scratchData.deviceAddress =
+                    this->scratch_pool.device_address + scratch_offset;
+                scratch_offset += p_scratch_sizes[i];
+            }
+
+            if (batch > 0) {
+                VkMemoryBarrier memory_barrier = {
+                    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+                    .srcAccessMask =
+                        VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                    .dstAccessMask =
+                        VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                        VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+                };
+                vkCmdPipelineBarrier(
+                    p_command_buffer,
+                    VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                    VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0,
+                    1, &memory_barrier, 0, nullptr, 0, nullptr);
+            }
+            vkCmdBuildAccelerationStructuresKHR(
+                p_command_buffer, batch_end - batch_begin,
+                &p_acceleration_structure_build_geometry_infos[batch_begin],
+                &pp_acceleration_structure_build_range_infos[batch_begin]);
+
+            batch_begin = batch_end;
+        }
+        this->profiler.end_scope(p_command_buffer, build_scope);
+
+        // Make the BLASes visible to the TLAS build.
+        VkMemoryBarrier memory_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+            .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+        };
+        vkCmdPipelineBarrier(
+            p_command_buffer,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1,
+            &memory_barrier, 0, nullptr, 0, nullptr);
+    }
 
-    VkDeviceAddress scratch_buffer_address = vkGetBufferDeviceAddressKHR(
-        this->logical_device, &scratch_buffer_device_address_info);
+    // Ask for the compacted sizes in the same submission as the builds. Host
+    // built BLASes are compacted on the GPU all the same.
+    VkQueryPool p_compacted_size_query_pool = VK_NULL_HANDLE;
+    if (this->should_compact_blas) {
+        VkQueryPoolCreateInfo query_pool_create_info = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType =
+                VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+            .queryCount = this->blas_count,
+        };
+        if (vkCreateQueryPool(this->logical_device, &query_pool_create_info,
+                              nullptr,
+                              &p_compacted_size_query_pool) != VK_SUCCESS) {
+            stx::panic("Failed to create the compacted size query pool!");
+        }
+
+        VkAccelerationStructureKHR* p_blas_handles =
+            new (std::nothrow) VkAccelerationStructureKHR[this->blas_count];
+        for (uint32_t i = 0; i < this->blas_count; i++) {
+            p_blas_handles[i] = this->p_blases[i].handle;
+        }
+        vkCmdResetQueryPool(p_command_buffer, p_compacted_size_query_pool, 0,
+                            this->blas_count);
+        vkCmdWriteAccelerationStructuresPropertiesKHR(
+            p_command_buffer, this->blas_count, p_blas_handles,
+            VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+            p_compacted_size_query_pool, 0);
+        delete[] p_blas_handles;
+    }
+    this->submit_one_time_cmd_buffer(p_command_buffer, this->compute_queue);
 
-    VkDeviceOrHostAddressKHR scratch_device_or_host_address = {
-        .deviceAddress = scratch_buffer_address,
-    };
+    std::cout << "Built " << this->blas_count << " BLASes in " << batch_count
+              << " batches with " << max_batch_scratch_size
+              << " bytes of scratch.\n";
 
-    acceleration_structure_build_geometry_info.scratchData =
-        scratch_device_or_host_address;
+    if (this->should_compact_blas) {
+        this->compact_blas(p_compacted_size_query_pool);
+        vkDestroyQueryPool(this->logical_device, p_compacted_size_query_pool,
+                           nullptr);
+    }
 
-    VkAccelerationStructureCreateInfoKHR acceleration_structure_create_info = {
-        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
-        .pNext = nullptr,
-        .createFlags = 0,
-        .buffer = this->blas_buffer,
-        .offset = 0,
-        .size =
-            acceleration_structure_build_sizes_info.accelerationStructureSize,
-        .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
-        .deviceAddress = 0,
-    };
+    delete[] p_acceleration_structure_geometries;
+    delete[] p_acceleration_structure_build_geometry_infos;
+    delete[] p_acceleration_structure_build_range_infos;
+    delete[] pp_acceleration_structure_build_range_infos;
+    delete[] p_scratch_sizes;
+    delete[] p_batch_ends;
+}
 
-    vkCreateAccelerationStructureKHR(this->logical_device,
-                                     &acceleration_structure_create_info,
-                                     nullptr, &this->blas);
+namespace {
+
+// A batch of deferred host builds, shared by every thread that joins them.
+struct HostBuildJob {
+    VkDevice logical_device;
+    PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoinKHR;  // NOLINT
+    VkDeferredOperationKHR const* p_operations;
+    uint32_t operation_count;
+    uint32_t thread_count;
+};
+
+// Each thread walks over every operation, starting at its own offset so that
+// threads spread out over the batch, and helps until the operation has no
+// more work to hand out.
+void join_host_builds(uint32_t thread_index, void* p_data) {
+    TRACE_ZONE("join_host_builds");
+    HostBuildJob const& job = *static_cast<HostBuildJob*>(p_data);
+    uint32_t const first_operation = static_cast<uint32_t>(
+        static_cast<uint64_t>(thread_index) * job.operation_count /
+        job.thread_count);
+    for (uint32_t i = 0; i < job.operation_count; i++) {
+        VkDeferredOperationKHR operation =
+            job.p_operations[(first_operation + i) % job.operation_count];
+        if (operation == VK_NULL_HANDLE) {
+            continue;
+        }
+        // Idle means that more work may still be handed out, once the
+        // threads already in the operation get further.
+        VkResult result =
+            job.vkDeferredOperationJoinKHR(job.logical_device, operation);
+        while (result == VK_THREAD_IDLE_KHR) {
+            std::this_thread::yield();
+            result =
+                job.vkDeferredOperationJoinKHR(job.logical_device, operation);
+        }
+    }
+}
 
-    acceleration_structure_build_geometry_info.dstAccelerationStructure =
-        this->blas;
+// A range of the instance table for every thread to pack.
+struct InstanceWriteJob {
+    InstanceTable const* p_table;
+    VkAccelerationStructureInstanceKHR* p_instances;
+    uint32_t thread_count;
+};
+
+void write_instance_range(uint32_t thread_index, void* p_data) {
+    TRACE_ZONE("write_instance_range");
+    InstanceWriteJob const& job = *static_cast<InstanceWriteJob*>(p_data);
+    // Ranges start on multiples of four, so only the last one has a tail
+    // that is not vectorized.
+    uint32_t const range_size =
+        ((job.p_table->count + job.thread_count - 1) / job.thread_count + 3) &
+        ~3u;
+    uint32_t const begin =
+        std::min(thread_index * range_size, job.p_table->count);
+    uint32_t const end = std::min(begin + range_size, job.p_table->count);
+    job.p_table->write(begin, end, job.p_instances + begin);
+}
 
-    const VkAccelerationStructureBuildRangeInfoKHR*
-        p_acceleration_structure_build_range_info =
-            new (std::nothrow) VkAccelerationStructureBuildRangeInfoKHR{
-                .primitiveCount = 1,  // TODO: Number of faces.
-                .primitiveOffset = 0,
-                .firstVertex = 0,
-                .transformOffset = 0,
+}  // namespace
+
+void App::build_blas_on_host(
+    VkAccelerationStructureBuildGeometryInfoKHR* p_build_geometry_infos,
+    VkAccelerationStructureBuildRangeInfoKHR const* const*
+        pp_build_range_infos,
+    VkDeviceSize const* p_scratch_sizes, uint32_t const* p_batch_ends,
+    uint32_t batch_count, VkDeviceSize max_batch_scratch_size) {
+    TRACE_ZONE("build_blas_on_host");
+    auto const build_begin = std::chrono::steady_clock::now();
+
+    // Batches take turns with one host scratch allocation, like they do with
+    // the scratch pool on the GPU.
+    VkDeviceSize const scratch_alignment = this->scratch_pool.alignment;
+    uint8_t* p_scratch =
+        new (std::nothrow) uint8_t[max_batch_scratch_size + scratch_alignment];
+    uintptr_t const scratch_address =
+        (reinterpret_cast<uintptr_t>(p_scratch) + scratch_alignment - 1) &
+        ~static_cast<uintptr_t>(scratch_alignment - 1);
+
+    VkDeferredOperationKHR* p_operations =
+        new (std::nothrow) VkDeferredOperationKHR[this->blas_count];
+    uint32_t max_thread_count = 1;
+    uint32_t batch_begin = 0;
+    for (uint32_t batch = 0; batch < batch_count; batch++) {
+        uint32_t batch_end = p_batch_ends[batch];
+
+        // Start every build in the batch, then join them all at once.
+        uint64_t total_concurrency = 0;
+        VkDeviceSize scratch_offset = 0;
+        for (uint32_t i = batch_begin; i < batch_end; i++) {
+            p_build_geometry_infos[i].scratchData.hostAddress =
+                reinterpret_cast<void*>(scratch_address + scratch_offset);
+            scratch_offset += p_scratch_sizes[i];
+
+            VkDeferredOperationKHR& operation = p_operations[i];
+            if (vkCreateDeferredOperationKHR(this->logical_device, nullptr,
+                                             &operation) != VK_SUCCESS) {
+                stx::panic("Failed to create a deferred operation!");
+            }
+            VkResult const result = vkBuildAccelerationStructuresKHR(
+                this->logical_device, operation, 1, &p_build_geometry_infos[i],
+                &pp_build_range_infos[i]);
+            if (result == VK_OPERATION_DEFERRED_KHR) {
+                total_concurrency += vkGetDeferredOperationMaxConcurrencyKHR(
+                    this->logical_device, operation);
+            } else if (result == VK_OPERATION_NOT_DEFERRED_KHR ||
+                       result == VK_SUCCESS) {
+                // Already built on this thread.
+                vkDestroyDeferredOperationKHR(this->logical_device, operation,
+                                              nullptr);
+                operation = VK_NULL_HANDLE;
+            } else {
+                stx::panic("Failed to start a host blas build!");
+            }
+        }
+
+        if (total_concurrency > 0) {
+            HostBuildJob job = {
+                .logical_device = this->logical_device,
+                .vkDeferredOperationJoinKHR = vkDeferredOperationJoinKHR,
+                .p_operations = &p_operations[batch_begin],
+                .operation_count = batch_end - batch_begin,
+                .thread_count = static_cast<uint32_t>(std::min<uint64_t>(
+                    total_concurrency, this->thread_pool.thread_count)),
             };
-    const VkAccelerationStructureBuildRangeInfoKHR**
-        p_acceleration_structure_build_range_infos =
-            &p_acceleration_structure_build_range_info;
-
-    VkCommandBufferAllocateInfo buffer_allocate_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = this->cmd_pool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
-    };
+            this->thread_pool.run(job.thread_count, join_host_builds, &job);
+            max_thread_count = std::max(max_thread_count, job.thread_count);
+        }
+
+        for (uint32_t i = batch_begin; i < batch_end; i++) {
+            if (p_operations[i] == VK_NULL_HANDLE) {
+                continue;
+            }
+            if (vkGetDeferredOperationResultKHR(this->logical_device,
+                                                p_operations[i]) !=
+                VK_SUCCESS) {
+                stx::panic("Failed to build a blas on the host!");
+            }
+            vkDestroyDeferredOperationKHR(this->logical_device,
+                                          p_operations[i], nullptr);
+        }
+        batch_begin = batch_end;
+    }
 
-    VkCommandBuffer p_commandBuffer;
-    vkAllocateCommandBuffers(this->logical_device, &buffer_allocate_info,
-                             &p_commandBuffer);
+    std::chrono::duration<double, std::milli> const build_time =
+        std::chrono::steady_clock::now() - build_begin;
+    std::cout << "Built " << this->blas_count << " BLASes on the host with "
+              << max_thread_count << " threads in " << build_time.count()
+              << " ms.\n";
 
-    VkCommandBufferBeginInfo command_buffer_begin_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    };
+    delete[] p_operations;
+    delete[] p_scratch;
+}
 
-    if (vkBeginCommandBuffer(p_commandBuffer, &command_buffer_begin_info) !=
-        VK_SUCCESS) {
-        stx::panic("Failed to begin blas build command buffer!");
-    }
-    vkCmdBuildAccelerationStructuresKHR(
-        p_commandBuffer, 1, &acceleration_structure_build_geometry_info,
-        p_acceleration_structure_build_range_infos);
-    if (vkEndCommandBuffer(p_commandBuffer) != VK_SUCCESS) {
-        stx::panic("Failed to end blas build command buffer!");
+void App::compact_blas(VkQueryPool& compacted_size_query_pool) {
+    TRACE_ZONE("compact_blas");
+    VkDeviceSize* p_compacted_sizes =
+        new (std::nothrow) VkDeviceSize[this->blas_count];
+    if (vkGetQueryPoolResults(
+            this->logical_device, compacted_size_query_pool, 0,
+            this->blas_count, sizeof(VkDeviceSize) * this->blas_count,
+            p_compacted_sizes, sizeof(VkDeviceSize),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+        stx::panic("Failed to read the compacted blas sizes!");
     }
 
-    VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &p_commandBuffer,
-    };
-
-    if (vkQueueSubmit(this->compute_queue, 1, &submit_info, nullptr) !=
-        VK_SUCCESS) {
-        stx::panic("Failed to submit blas build command queue!");
+    // Copy every BLAS into a right-sized buffer, in one submission.
+    AccelerationStructure* p_compacted_blases =
+        new (std::nothrow) AccelerationStructure[this->blas_count];
+    VkCommandBuffer p_command_buffer =
+        this->begin_one_time_cmd_buffer(this->compute_queue);
+    uint32_t const compact_scope =
+        this->profiler.begin_scope(p_command_buffer, "blas_compact");
+    for (uint32_t i = 0; i < this->blas_count; i++) {
+        AccelerationStructure& compacted_blas = p_compacted_blases[i];
+        compacted_blas.size = p_compacted_sizes[i];
+        create_buffer(this->allocator,
+                      VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                          VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, compacted_blas.size,
+                      compacted_blas.buffer, &compacted_blas.allocation);
+
+        VkAccelerationStructureCreateInfoKHR
+            acceleration_structure_create_info = {
+                .sType =
+                    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+                .pNext = nullptr,
+                .createFlags = 0,
+                .buffer = compacted_blas.buffer,
+                .offset = 0,
+                .size = compacted_blas.size,
+                .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                .deviceAddress = 0,
+            };
+        if (vkCreateAccelerationStructureKHR(
+                this->logical_device, &acceleration_structure_create_info,
+                nullptr, &compacted_blas.handle) != VK_SUCCESS) {
+            stx::panic("Failed to create a compacted blas!");
+        }
+
+        VkCopyAccelerationStructureInfoKHR copy_acceleration_structure_info = {
+            .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+            .pNext = nullptr,
+            .src = this->p_blases[i].handle,
+            .dst = compacted_blas.handle,
+            .mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR,
+        };
+        vkCmdCopyAccelerationStructureKHR(p_command_buffer,
+                                          &copy_acceleration_structure_info);
     }
-    if (vkQueueWaitIdle(this->compute_queue) != VK_SUCCESS) {
-        stx::panic("Failed to wait on blas build command queue!");
+    this->profiler.end_scope(p_command_buffer, compact_scope);
+    VkMemoryBarrier memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+        .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+    };
+    vkCmdPipelineBarrier(p_command_buffer,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0, 1, &memory_barrier, 0, nullptr, 0, nullptr);
+    this->submit_one_time_cmd_buffer(p_command_buffer, this->compute_queue);
+
+    // Release the originals, and keep the compacted copies in their place.
+    VkDeviceSize total_size = 0;
+    VkDeviceSize total_compacted_size = 0;
+    for (uint32_t i = 0; i < this->blas_count; i++) {
+        AccelerationStructure& blas = this->p_blases[i];
+        AccelerationStructure& compacted_blas = p_compacted_blases[i];
+        std::cout << "BLAS " << i << ": " << blas.size << " -> "
+                  << compacted_blas.size << " bytes.\n";
+        total_size += blas.size;
+        total_compacted_size += compacted_blas.size;
+
+        vkDestroyAccelerationStructureKHR(this->logical_device, blas.handle,
+                                          nullptr);
+        destroy_buffer(this->allocator, blas.buffer, &blas.allocation);
+
+        VkAccelerationStructureDeviceAddressInfoKHR
+            acceleration_structure_device_address_info = {
+                .sType =
+                    VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+                .accelerationStructure = compacted_blas.handle,
+            };
+        compacted_blas.device_address =
+            vkGetAccelerationStructureDeviceAddressKHR(
+                this->logical_device,
+                &acceleration_structure_device_address_info);
+        blas = compacted_blas;
     }
+    std::cout << "Compacted BLASes from " << total_size << " to "
+              << total_compacted_size << " bytes.\n";
+    this->blas_size = total_compacted_size;
 
-    vkFreeCommandBuffers(this->logical_device, this->cmd_pool, 1,
-                         &p_commandBuffer);
-
-    vkDestroyBuffer(this->logical_device, p_scratch_buffer, nullptr);
-    vkFreeMemory(this->logical_device, p_scratch_buffer_memory, nullptr);
-    delete p_acceleration_structure_build_range_info;
+    delete[] p_compacted_sizes;
+    delete[] p_compacted_blases;
 }
 
-void App::create_tlas() {
-    VkTransformMatrixKHR transform_matrix = {
-        1, 0, 0, 0,  //
-        0, 1, 0, 0,  //
-        0, 0, 1, 0,  //
+void App::wait_for_tlas_users() {
+    TRACE_ZONE("fence_wait");
+    if (this->is_renderer_initialized && !this->is_headless) {
+        vkWaitForFences(this->logical_device, this->max_frames_in_flight,
+                        this->in_flight_fences, VK_TRUE, UINT64_MAX);
+    }
+    VkSemaphoreWaitInfo semaphore_wait_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .semaphoreCount = 1,
+        .pSemaphores = &this->build_timeline,
+        .pValues = &this->build_timeline_value,
     };
+    vkWaitSemaphores(this->logical_device, &semaphore_wait_info, UINT64_MAX);
+}
 
-    VkAccelerationStructureDeviceAddressInfoKHR
-        acceleration_structure_device_address_info = {};
-    acceleration_structure_device_address_info.sType =
-        VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
-    acceleration_structure_device_address_info.accelerationStructure =
-        this->blas;
-
-    VkDeviceAddress acceleration_structure_device_address =
-        vkGetAccelerationStructureDeviceAddressKHR(
-            this->logical_device, &acceleration_structure_device_address_info);
+void App::reserve_instances(uint32_t capacity) {
+    if (capacity <= this->instances.capacity) {
+        return;
+    }
+    // Both the instance buffer and the TLAS itself are replaced, so nothing
+    // in flight may still be using them. Only the frames and builds that
+    // can are waited on, which leaves the other queues running.
+    bool const has_instance_buffer = this->instances.capacity > 0;
+    if (has_instance_buffer) {
+        this->wait_for_tlas_users();
+    }
 
-    VkAccelerationStructureInstanceKHR geometry_instance = {};
-    geometry_instance.transform = transform_matrix;
-    geometry_instance.instanceCustomIndex = 0;
-    geometry_instance.mask = 0xFF;
-    geometry_instance.instanceShaderBindingTableRecordOffset = 0;
-    geometry_instance.flags =
-        VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
-    geometry_instance.accelerationStructureReference =
-        acceleration_structure_device_address;
-
-    VkDeviceSize geometry_instance_buffer_size =
-        sizeof(VkAccelerationStructureInstanceKHR);
-
-    VkBuffer p_geometry_instance_staging_buffer;
-    VkDeviceMemory p_geometry_instance_staging_buffer_memory;
-    create_buffer(this->logical_device, this->physical_device,
-                  VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                  geometry_instance_buffer_size,
-                  p_geometry_instance_staging_buffer,
-                  &p_geometry_instance_staging_buffer_memory);
-
-    void* p_geometry_instance_data;
-    vkMapMemory(this->logical_device, p_geometry_instance_staging_buffer_memory,
-                0, geometry_instance_buffer_size, 0, &p_geometry_instance_data);
-    memcpy(p_geometry_instance_data, &geometry_instance,
-           geometry_instance_buffer_size);
-    vkUnmapMemory(this->logical_device,
-                  p_geometry_instance_staging_buffer_memory);
-
-    VkBuffer p_geometry_instance_buffer;
-    VkDeviceMemory p_geometry_instance_buffer_memory;
+    // Every frame in flight gets its own slot of the instance buffer, so the
+    // host never overwrites instances that a pending build still reads.
+    VkBuffer p_new_instance_buffer;
+    Allocation p_new_instance_buffer_allocation;
     create_buffer(
-        this->logical_device, this->physical_device,
+        this->allocator,
         VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
-            VK_BUFFER_USAGE_TRANSFER_DST_BIT |
             VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, geometry_instance_buffer_size,
-        p_geometry_instance_buffer, &p_geometry_instance_buffer_memory);
-
-    copy_buffer(this->logical_device, this->cmd_pool,
-                p_geometry_instance_staging_buffer, p_geometry_instance_buffer,
-                geometry_instance_buffer_size, this->graphics_queue);
-
-    vkDestroyBuffer(this->logical_device, p_geometry_instance_staging_buffer,
-                    nullptr);
-    vkFreeMemory(this->logical_device,
-                 p_geometry_instance_staging_buffer_memory, nullptr);
-
-    VkBufferDeviceAddressInfo geometry_instance_buffer_device_address_info = {};
-    geometry_instance_buffer_device_address_info.sType =
-        VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
-    geometry_instance_buffer_device_address_info.buffer =
-        p_geometry_instance_buffer;
-
-    VkDeviceAddress geometry_instance_buffer_address =
-        vkGetBufferDeviceAddressKHR(
-            this->logical_device,
-            &geometry_instance_buffer_device_address_info);
-
-    VkDeviceOrHostAddressConstKHR
-        geometry_instance_device_or_host_address_const = {
-            .deviceAddress = geometry_instance_buffer_address,
-        };
-
-    VkAccelerationStructureGeometryInstancesDataKHR
-        acceleration_structure_geometry_instances_data = {
-            .sType =
-                VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
-            .pNext = nullptr,
-            .arrayOfPointers = VK_FALSE,
-            .data = geometry_instance_device_or_host_address_const,
-        };
-
-    VkAccelerationStructureGeometryDataKHR
-        acceleration_structure_geometry_data = {
-            .instances = acceleration_structure_geometry_instances_data,
-        };
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+            VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        sizeof(VkAccelerationStructureInstanceKHR) * capacity *
+            this->max_frames_in_flight,
+        p_new_instance_buffer, &p_new_instance_buffer_allocation);
+
+    if (has_instance_buffer) {
+        destroy_buffer(this->allocator, this->instance_buffer,
+                       &this->instance_buffer_allocation);
+        vkDestroyAccelerationStructureKHR(this->logical_device, this->tlas,
+                                          nullptr);
+        destroy_buffer(this->allocator, this->tlas_buffer,
+                       &this->tlas_buffer_allocation);
+    }
+    this->instance_buffer = p_new_instance_buffer;
+    this->instance_buffer_allocation = p_new_instance_buffer_allocation;
+    this->instances.reserve(capacity);
 
-    VkAccelerationStructureGeometryKHR acceleration_structure_geometry = {
-        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
-        .pNext = nullptr,
-        .geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
-        .geometry = acceleration_structure_geometry_data,
-        .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
+    VkBufferDeviceAddressInfo instance_buffer_device_address_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = this->instance_buffer,
     };
+    this->instance_buffer_address = vkGetBufferDeviceAddressKHR(
+        this->logical_device, &instance_buffer_device_address_info);
 
+    // Size the TLAS and its scratch for the whole capacity, so that adding
+    // instances below it never has to reallocate.
+    VkAccelerationStructureGeometryKHR acceleration_structure_geometry =
+        this->get_tlas_geometry(0);
     VkAccelerationStructureBuildGeometryInfoKHR
         acceleration_structure_build_geometry_info = {
             .sType =
                 VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
             .pNext = nullptr,
             .type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
-            .flags = VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+            .flags = this->get_tlas_build_flags(),
             .mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
             .srcAccelerationStructure = nullptr,
             .dstAccelerationStructure = nullptr,
@@ -806,42 +1869,27 @@ void App::create_tlas() {
         };
 
     vkGetAccelerationStructureBuildSizesKHR(
-        this->logical_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_HOST_KHR,
-        &acceleration_structure_build_geometry_info,
-        &acceleration_structure_build_geometry_info.geometryCount,
+        this->logical_device, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+        &acceleration_structure_build_geometry_info, &capacity,
         &acceleration_structure_build_sizes_info);
 
-    create_buffer(
-        this->logical_device, this->physical_device,
-        VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        acceleration_structure_build_sizes_info.accelerationStructureSize,
-        this->tlas_buffer, &this->tlas_buffer_memory);
-
-    VkBuffer p_scratch_buffer;
-    VkDeviceMemory p_scratch_buffer_memory;
-    create_buffer(
-        this->logical_device, this->physical_device,
-        VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
-            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-        acceleration_structure_build_sizes_info.buildScratchSize,
-        p_scratch_buffer, &p_scratch_buffer_memory);
-
-    VkBufferDeviceAddressInfo scratch_buffer_device_address_info = {};
-    scratch_buffer_device_address_info.sType =
-        VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
-    scratch_buffer_device_address_info.buffer = p_scratch_buffer;
-
-    VkDeviceAddress scratch_buffer_address = vkGetBufferDeviceAddressKHR(
-        this->logical_device, &scratch_buffer_device_address_info);
-
-    VkDeviceOrHostAddressKHR scratch_device_or_host_address = {};
-    scratch_device_or_host_address.deviceAddress = scratch_buffer_address;
-
-    acceleration_structure_build_geometry_info.scratchData =
-        scratch_device_or_host_address;
+    this->tlas_size =
+        acceleration_structure_build_sizes_info.accelerationStructureSize;
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->tlas_size,
+                  this->tlas_buffer, &this->tlas_buffer_allocation);
+
+    // Refits need their own scratch, which stays alive between frames.
+    VkDeviceSize scratch_size =
+        acceleration_structure_build_sizes_info.buildScratchSize;
+    if (acceleration_structure_build_sizes_info.updateScratchSize >
+        scratch_size) {
+        scratch_size = acceleration_structure_build_sizes_info.updateScratchSize;
+    }
+    this->tlas_scratch_pool.reserve(
+        this->allocator, this->vkGetBufferDeviceAddressKHR, scratch_size);
 
     VkAccelerationStructureCreateInfoKHR acceleration_structure_create_info = {
         .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
@@ -855,131 +1903,2219 @@ void App::create_tlas() {
         .deviceAddress = 0,
     };
 
-    vkCreateAccelerationStructureKHR(this->logical_device,
-                                     &acceleration_structure_create_info,
-                                     nullptr, &this->tlas);
+    if (vkCreateAccelerationStructureKHR(this->logical_device,
+                                         &acceleration_structure_create_info,
+                                         nullptr, &this->tlas) != VK_SUCCESS) {
+        stx::panic("Failed to create the tlas!");
+    }
+
+    VkAccelerationStructureDeviceAddressInfoKHR
+        acceleration_structure_device_address_info = {
+            .sType =
+                VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+            .accelerationStructure = this->tlas,
+        };
+    this->tlas_address = vkGetAccelerationStructureDeviceAddressKHR(
+        this->logical_device, &acceleration_structure_device_address_info);
+
+    // Growing after startup replaces the TLAS, which every frame picks up
+    // when it next writes its descriptors.
+    this->ray_trace_descriptors.tlas = this->tlas;
+
+    this->does_tlas_need_rebuild = true;
+}
 
-    acceleration_structure_build_geometry_info.dstAccelerationStructure =
-        this->tlas;
+auto App::get_tlas_geometry(uint32_t frame_index)
+    -> VkAccelerationStructureGeometryKHR {
+    VkAccelerationStructureGeometryInstancesDataKHR
+        acceleration_structure_geometry_instances_data = {
+            .sType =
+                VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR,
+            .pNext = nullptr,
+            .arrayOfPointers = VK_FALSE,
+            .data =
+                {
+                    .deviceAddress =
+                        this->instance_buffer_address +
+                        sizeof(VkAccelerationStructureInstanceKHR) *
+                            this->instances.capacity * frame_index,
+                },
+        };
 
+    return {
+        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+        .pNext = nullptr,
+        .geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR,
+        .geometry =
+            {
+                .instances = acceleration_structure_geometry_instances_data,
+            },
+        .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
+    };
+}
+
+auto App::get_tlas_build_flags() const -> VkBuildAccelerationStructureFlagsKHR {
+    // Updates must use the same flags as the build they refit.
+    return VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR |
+           (this->is_scene_dynamic
+                ? VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_BUILD_BIT_KHR
+                : VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+}
+
+auto App::add_instance(uint32_t blas_index,
+                       VkTransformMatrixKHR const& transform) -> uint32_t {
+    if (this->instances.count == this->instances.capacity) {
+        this->reserve_instances(this->instances.capacity * 2 + 1);
+    }
+    // The custom index lets hit shaders find the mesh's range of the shared
+    // vertex and index buffers.
+    uint32_t const instance_index = this->instances.add(
+        transform, blas_index, 0xFF, 0,
+        VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
+        this->p_blases[blas_index].device_address);
+
+    this->does_tlas_need_rebuild = true;
+    return instance_index;
+}
+
+void App::remove_instance(uint32_t instance_index) {
+    this->instances.remove(instance_index);
+    this->does_tlas_need_rebuild = true;
+}
+
+void App::set_instance_transform(uint32_t instance_index,
+                                 VkTransformMatrixKHR const& transform) {
+    this->instances.set_transform(instance_index, transform);
+    this->are_instances_dirty = true;
+}
+
+void App::write_instances(uint32_t frame_index) {
+    TRACE_ZONE("write_instances");
+    InstanceWriteJob job = {
+        .p_table = &this->instances,
+        .p_instances = static_cast<VkAccelerationStructureInstanceKHR*>(
+                           this->instance_buffer_allocation.p_mapped) +
+                       this->instances.capacity * frame_index,
+        .thread_count =
+            this->instances.count < this->min_parallel_instance_count
+                ? 1
+                : this->thread_pool.thread_count,
+    };
+    this->thread_pool.run(job.thread_count, write_instance_range, &job);
+}
+
+void App::record_tlas_build(VkCommandBuffer p_command_buffer,
+                            uint32_t frame_index) {
+    // Refitting keeps the tree topology of the last full build, so trace
+    // performance slowly degrades as instances move. Rebuild every so often,
+    // and whenever instances were added or removed.
+    bool const is_update =
+        !this->does_tlas_need_rebuild &&
+        this->tlas_updates_since_build < this->max_tlas_updates;
+
+    // The previous frame's rays may still be traversing the TLAS.
+    VkMemoryBarrier memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+        .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+    };
+    vkCmdPipelineBarrier(p_command_buffer,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0, 1, &memory_barrier, 0, nullptr, 0, nullptr);
+
+    VkAccelerationStructureGeometryKHR acceleration_structure_geometry =
+        this->get_tlas_geometry(frame_index);
+    VkAccelerationStructureBuildGeometryInfoKHR
+        acceleration_structure_build_geometry_info = {
+            .sType =
+                VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+            .pNext = nullptr,
+            .type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
+            .flags = this->get_tlas_build_flags(),
+            .mode = is_update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR
+                              : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+            .srcAccelerationStructure = is_update ? this->tlas : nullptr,
+            .dstAccelerationStructure = this->tlas,
+            .geometryCount = 1,
+            .pGeometries = &acceleration_structure_geometry,
+            .ppGeometries = nullptr,
+            .scratchData =
+                {
+                    .deviceAddress = this->tlas_scratch_pool.device_address,
+                },
+        };
+
+    VkAccelerationStructureBuildRangeInfoKHR
+        acceleration_structure_build_range_info = {
+            .primitiveCount = this->instances.count,
+            .primitiveOffset = 0,
+            .firstVertex = 0,
+            .transformOffset = 0,
+        };
     const VkAccelerationStructureBuildRangeInfoKHR*
         p_acceleration_structure_build_range_info =
-            new (std::nothrow) VkAccelerationStructureBuildRangeInfoKHR{
-                .primitiveCount = 1,
-                .primitiveOffset = 0,
-                .firstVertex = 0,
-                .transformOffset = 0,
+            &acceleration_structure_build_range_info;
+
+    uint32_t const scope = this->profiler.begin_scope(
+        p_command_buffer, is_update ? "tlas_refit" : "tlas_build");
+    vkCmdBuildAccelerationStructuresKHR(
+        p_command_buffer, 1, &acceleration_structure_build_geometry_info,
+        &p_acceleration_structure_build_range_info);
+    this->profiler.end_scope(p_command_buffer, scope);
+
+    // Later builds also reuse the same scratch memory.
+    memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+        .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                         VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+    };
+    vkCmdPipelineBarrier(p_command_buffer,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                             VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         0, 1, &memory_barrier, 0, nullptr, 0, nullptr);
+
+    if (is_update) {
+        this->tlas_updates_since_build++;
+    } else {
+        this->tlas_updates_since_build = 0;
+        this->does_tlas_need_rebuild = false;
+    }
+    this->are_instances_dirty = false;
+}
+
+void App::create_tlas() {
+    TRACE_ZONE("create_tlas");
+    // Copies of the scene past the first one share its BLASes, and are laid
+    // out on a square grid with a little space between them.
+    uint32_t const copy_count = std::max(
+        1u, (this->scene_instance_count + this->blas_count - 1) /
+                std::max(this->blas_count, 1u));
+    uint32_t const columns = static_cast<uint32_t>(
+        std::ceil(std::sqrt(static_cast<double>(copy_count))));
+    float min[3] = {0, 0, 0};
+    float max[3] = {0, 0, 0};
+    for (uint32_t i = 0; i < this->scene.mesh_count; i++) {
+        Mesh const& mesh = this->scene.p_meshes[i];
+        for (uint32_t axis = 0; axis < 3; axis++) {
+            float const low =
+                mesh.position_offset[axis] - mesh.position_scale[axis];
+            float const high =
+                mesh.position_offset[axis] + mesh.position_scale[axis];
+            min[axis] = i == 0 ? low : std::min(min[axis], low);
+            max[axis] = i == 0 ? high : std::max(max[axis], high);
+        }
+    }
+    float const spacing_x = 1.1f * (max[0] - min[0]);
+    float const spacing_z = 1.1f * (max[2] - min[2]);
+
+    this->reserve_instances(copy_count * this->blas_count);
+    for (uint32_t copy = 0; copy < copy_count; copy++) {
+        VkTransformMatrixKHR transform_matrix = {
+            1, 0, 0, spacing_x * static_cast<float>(copy % columns),  //
+            0, 1, 0, 0,                                                //
+            0, 0, 1, -spacing_z * static_cast<float>(copy / columns),  //
+        };
+        for (uint32_t i = 0; i < this->blas_count; i++) {
+            this->add_instance(i, transform_matrix);
+        }
+    }
+    if (copy_count > 1) {
+        std::cout << "Instanced the scene " << copy_count << " times, for "
+                  << this->instances.count << " instances.\n";
+    }
+
+    this->write_instances(0);
+    VkCommandBuffer p_command_buffer =
+        this->begin_one_time_cmd_buffer(this->compute_queue);
+    this->record_tlas_build(p_command_buffer, 0);
+    this->submit_one_time_cmd_buffer(p_command_buffer, this->compute_queue);
+}
+
+void App::update_tlas() {
+    TRACE_ZONE("update_tlas");
+    if (!this->are_instances_dirty && !this->does_tlas_need_rebuild) {
+        return;
+    }
+    // This borrows the first frame's instance slot, so the frames and builds
+    // that may still read it are waited on first. The render loop records
+    // its own builds instead.
+    this->wait_for_tlas_users();
+    this->write_instances(0);
+    VkCommandBuffer p_command_buffer =
+        this->begin_one_time_cmd_buffer(this->compute_queue);
+    this->record_tlas_build(p_command_buffer, 0);
+    this->submit_one_time_cmd_buffer(p_command_buffer, this->compute_queue);
+    this->should_reset_accumulation = true;
+}
+
+void App::animate_instances(double seconds) {
+    // Bob every instance up and down, so that dynamic mode has something to
+    // refit. Only the vertical translation changes.
+    float* p_translations_y = this->instances.p_transforms[7];
+    for (uint32_t i = 0; i < this->instances.count; i++) {
+        p_translations_y[i] = 0.1f * static_cast<float>(std::sin(seconds + i));
+    }
+    this->are_instances_dirty = true;
+}
+
+void App::create_mesh_buffer() {
+    TRACE_ZONE("create_mesh_buffer");
+    VkDeviceSize buffer_size = sizeof(Mesh) * this->scene.mesh_count;
+
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer_size,
+                  this->mesh_buffer, &this->mesh_buffer_allocation);
+
+    this->uploader.upload_buffer(this->mesh_buffer, 0, this->scene.p_meshes,
+                                 buffer_size);
+
+    // Host builds read the transforms from here too.
+    this->p_blas_transforms =
+        new (std::nothrow) VkTransformMatrixKHR[this->scene.mesh_count];
+    for (uint32_t i = 0; i < this->scene.mesh_count; i++) {
+        Mesh const& mesh = this->scene.p_meshes[i];
+        float const* p_scale = mesh.position_scale;
+        float const* p_offset = mesh.position_offset;
+        this->p_blas_transforms[i] = {{
+            {p_scale[0], 0, 0, p_offset[0]},
+            {0, p_scale[1], 0, p_offset[1]},
+            {0, 0, p_scale[2], p_offset[2]},
+        }};
+    }
+    VkDeviceSize const transform_buffer_size =
+        sizeof(VkTransformMatrixKHR) * this->scene.mesh_count;
+    create_buffer(
+        this->allocator,
+        VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+            VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+            VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, transform_buffer_size,
+        this->blas_transform_buffer, &this->blas_transform_buffer_allocation);
+    this->uploader.upload_buffer(this->blas_transform_buffer, 0,
+                                 this->p_blas_transforms,
+                                 transform_buffer_size);
+}
+
+void App::create_textures() {
+    TRACE_ZONE("create_textures");
+    this->texture_streamer.initialize(this->logical_device, this->allocator,
+                                      this->uploader);
+    this->texture_streamer.is_block_compression_enabled =
+        this->device_features.features.textureCompressionBC == VK_TRUE;
+    char const* p_name = this->scene.p_texture_names;
+    for (uint32_t i = 0; i < this->scene.texture_count; i++) {
+        std::string const path = this->scene.directory + p_name;
+        this->texture_streamer.add(path.c_str());
+        p_name += std::strlen(p_name) + 1;
+    }
+
+    // Each material set binds its own slot, so slots are aligned to the
+    // largest `minStorageBufferOffsetAlignment` that devices may have,
+    // which is 256 bytes.
+    constexpr uint32_t slot_alignment = 256 / sizeof(uint32_t);
+    this->texture_feedback_stride =
+        (std::max(this->scene.texture_count, 1u) + slot_alignment - 1) /
+        slot_alignment * slot_alignment;
+    VkDeviceSize const buffer_size = sizeof(uint32_t) *
+                                     this->texture_feedback_stride *
+                                     this->max_frames_in_flight;
+    create_buffer(this->allocator, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  buffer_size, this->texture_feedback_buffer,
+                  &this->texture_feedback_buffer_allocation);
+    this->p_texture_feedback = static_cast<uint32_t*>(
+        this->texture_feedback_buffer_allocation.p_mapped);
+    std::fill_n(this->p_texture_feedback,
+                this->texture_feedback_stride * this->max_frames_in_flight,
+                no_texture_request);
+}
+
+void App::stream_textures(uint32_t frame_index, uint64_t frame) {
+    uint32_t* p_feedback =
+        this->p_texture_feedback + this->texture_feedback_stride * frame_index;
+    for (uint32_t i = 0; i < this->scene.texture_count; i++) {
+        if (p_feedback[i] == no_texture_request) {
+            continue;
+        }
+        uint32_t const level_count =
+            this->texture_streamer.textures[i].file.level_count;
+        uint32_t const level =
+            p_feedback[i] < level_count ? level_count - p_feedback[i] : 0;
+        this->texture_streamer.request(i, level, frame);
+        p_feedback[i] = no_texture_request;
+    }
+    // Frames that may still be reading retired images are those in flight.
+    uint64_t const first_pending_frame =
+        frame >= this->max_frames_in_flight - 1
+            ? frame - (this->max_frames_in_flight - 1)
+            : 0;
+    this->texture_streamer.update(frame, first_pending_frame);
+    // The frame's submission waits on the uploads, which must be submitted
+    // first.
+    this->uploader.flush();
+
+    if (this->p_material_descriptor_sets == nullptr) {
+        return;
+    }
+    if (this->texture_streamer.are_views_dirty) {
+        this->texture_streamer.are_views_dirty = false;
+        std::fill_n(this->p_are_material_sets_stale,
+                    this->max_frames_in_flight, true);
+    }
+    if (this->p_are_material_sets_stale[frame_index]) {
+        this->write_texture_descriptors(frame_index);
+    }
+}
+
+void App::create_material_buffer() {
+    TRACE_ZONE("create_material_buffer");
+    // Materials whose texture failed to load fall back to their color, since
+    // their array element is never written.
+    uint32_t const material_count = this->scene.material_count;
+    Material* p_materials = new (std::nothrow) Material[material_count];
+    std::copy_n(this->scene.p_materials, material_count, p_materials);
+    for (uint32_t i = 0; i < material_count; i++) {
+        uint32_t const texture_index = p_materials[i].texture_index;
+        if (texture_index != Material::no_texture &&
+            this->texture_streamer.textures[texture_index].image ==
+                VK_NULL_HANDLE) {
+            p_materials[i].texture_index = Material::no_texture;
+        }
+    }
+    VkDeviceSize const buffer_size = sizeof(Material) * material_count;
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer_size,
+                  this->material_buffer, &this->material_buffer_allocation);
+    this->uploader.upload_buffer(this->material_buffer, 0, p_materials,
+                                 buffer_size);
+    delete[] p_materials;
+
+    VkDeviceSize const index_buffer_size =
+        sizeof(uint32_t) * (this->scene.index_count / 3);
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, index_buffer_size,
+                  this->material_index_buffer,
+                  &this->material_index_buffer_allocation);
+    this->uploader.upload_buffer(this->material_index_buffer, 0,
+                                 this->scene.p_material_indices,
+                                 index_buffer_size);
+}
+
+void App::create_camera() {
+    TRACE_ZONE("create_camera");
+    create_buffer(this->allocator, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  sizeof(CameraUniforms), this->uniform_buffer,
+                  &this->uniform_buffer_allocation);
+    this->p_camera =
+        static_cast<CameraUniforms*>(this->uniform_buffer_allocation.p_mapped);
+    *this->p_camera = this->frame_scene();
+}
+
+auto App::frame_scene() const -> CameraUniforms {
+    float min[3] = {std::numeric_limits<float>::max(),
+                    std::numeric_limits<float>::max(),
+                    std::numeric_limits<float>::max()};
+    float max[3] = {std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest()};
+    for (uint32_t i = 0; i < this->scene.vertex_count; i++) {
+        for (uint32_t j = 0; j < 3; j++) {
+            float const position = this->scene.p_positions[3 * i + j];
+            min[j] = position < min[j] ? position : min[j];
+            max[j] = position > max[j] ? position : max[j];
+        }
+    }
+    float center[3];
+    float radius = 0;
+    for (uint32_t j = 0; j < 3; j++) {
+        center[j] = 0.5f * (min[j] + max[j]);
+        float const extent = 0.5f * (max[j] - min[j]);
+        radius = extent > radius ? extent : radius;
+    }
+
+    // A 60 degree vertical field of view, on a plane one unit ahead.
+    float const half_height = std::tan(0.5f * 60.0f * 3.14159265f / 180.0f);
+    float const half_width = half_height * static_cast<float>(this->width) /
+                             static_cast<float>(this->height);
+    float const distance = max[2] - center[2] + radius / half_height;
+
+    return {
+        .origin = {center[0], center[1], center[2] + distance, 1},
+        .lower_left = {center[0] - half_width, center[1] - half_height,
+                       center[2] + distance - 1, 1},
+        .horizontal = {2 * half_width, 0, 0, 0},
+        .vertical = {0, 2 * half_height, 0, 0},
+    };
+}
+
+void App::create_ray_trace_descriptors() {
+    TRACE_ZONE("create_ray_trace_descriptors");
+    constexpr uint32_t binding_count = 11;
+    // The trailing images and the stats buffer are for adaptive sampling,
+    // and are shared with the sample map pass.
+    constexpr uint32_t sampling_binding = 7;
+    VkDescriptorSetLayoutBinding bindings[binding_count] = {
+        {
+            .binding = 0,
+            .descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+        },
+        {
+            .binding = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+        },
+        {
+            .binding = 2,
+            .descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+        },
+    };
+    // Positions, normals, indices and meshes.
+    for (uint32_t i = 3; i < sampling_binding; i++) {
+        bindings[i] = {
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR,
+        };
+    }
+    // Accumulation, variance and sample counts.
+    for (uint32_t i = sampling_binding; i < binding_count - 1; i++) {
+        bindings[i] = {
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR |
+                          VK_SHADER_STAGE_COMPUTE_BIT,
+        };
+    }
+    bindings[binding_count - 1] = {
+        .binding = binding_count - 1,
+        .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .descriptorCount = 1,
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+    this->ray_trace_descriptor_set_layout =
+        this->descriptor_layouts.get(bindings, binding_count);
+
+    // Pools hold as many descriptors of each type as the bindings need.
+    VkDescriptorPoolSize sizes_per_set[binding_count];
+    uint32_t size_count = 0;
+    for (VkDescriptorSetLayoutBinding const& binding : bindings) {
+        VkDescriptorPoolSize* p_size = std::find_if(
+            sizes_per_set, sizes_per_set + size_count,
+            [&](VkDescriptorPoolSize const& size) {
+                return size.type == binding.descriptorType;
+            });
+        if (p_size == sizes_per_set + size_count) {
+            *p_size = {binding.descriptorType, 0};
+            size_count++;
+        }
+        p_size->descriptorCount += binding.descriptorCount;
+    }
+    this->frame_descriptor_pools.initialize(this->logical_device,
+                                            this->max_frames_in_flight,
+                                            sizes_per_set, size_count);
+
+    // Every binding is read straight out of `ray_trace_descriptors`.
+    size_t const offsets[binding_count] = {
+        offsetof(RayTraceDescriptors, tlas),
+        offsetof(RayTraceDescriptors, storage_image),
+        offsetof(RayTraceDescriptors, camera),
+        offsetof(RayTraceDescriptors, positions),
+        offsetof(RayTraceDescriptors, normals),
+        offsetof(RayTraceDescriptors, indices),
+        offsetof(RayTraceDescriptors, meshes),
+        offsetof(RayTraceDescriptors, accumulation_image),
+        offsetof(RayTraceDescriptors, variance_image),
+        offsetof(RayTraceDescriptors, sample_count_image),
+        offsetof(RayTraceDescriptors, sampling_stats),
+    };
+    VkDescriptorUpdateTemplateEntry entries[binding_count];
+    for (uint32_t i = 0; i < binding_count; i++) {
+        entries[i] = {
+            .dstBinding = i,
+            .dstArrayElement = 0,
+            .descriptorCount = 1,
+            .descriptorType = bindings[i].descriptorType,
+            .offset = offsets[i],
+            .stride = 0,
+        };
+    }
+    VkDescriptorUpdateTemplateCreateInfo update_template_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO,
+        .descriptorUpdateEntryCount = binding_count,
+        .pDescriptorUpdateEntries = entries,
+        .templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET,
+        .descriptorSetLayout = this->ray_trace_descriptor_set_layout,
+    };
+    if (vkCreateDescriptorUpdateTemplate(
+            this->logical_device, &update_template_create_info, nullptr,
+            &this->ray_trace_descriptor_template) != VK_SUCCESS) {
+        stx::panic("Failed to create a descriptor update template!");
+    }
+
+    this->ray_trace_descriptors = {
+        .tlas = this->tlas,
+        .storage_image = {VK_NULL_HANDLE, this->storage_image.view,
+                          VK_IMAGE_LAYOUT_GENERAL},
+        .camera = {this->uniform_buffer, 0, VK_WHOLE_SIZE},
+        .positions = {this->vertex_position_buffer, 0, VK_WHOLE_SIZE},
+        .normals = {this->vertex_normal_buffer, 0, VK_WHOLE_SIZE},
+        .indices = {this->index_buffer, 0, VK_WHOLE_SIZE},
+        .meshes = {this->mesh_buffer, 0, VK_WHOLE_SIZE},
+        .accumulation_image = {VK_NULL_HANDLE, this->accumulation_image.view,
+                               VK_IMAGE_LAYOUT_GENERAL},
+        .variance_image = {VK_NULL_HANDLE, this->variance_image.view,
+                           VK_IMAGE_LAYOUT_GENERAL},
+        .sample_count_image = {VK_NULL_HANDLE, this->sample_count_image.view,
+                               VK_IMAGE_LAYOUT_GENERAL},
+        .sampling_stats = {this->sampling_stats_buffer, 0, VK_WHOLE_SIZE},
+    };
+}
+
+void App::write_frame_descriptors(uint32_t frame_index) {
+    TRACE_ZONE("write_frame_descriptors");
+    this->frame_descriptor_pools.reset(frame_index);
+    this->ray_trace_descriptor_set = this->frame_descriptor_pools.allocate(
+        frame_index, this->ray_trace_descriptor_set_layout);
+    vkUpdateDescriptorSetWithTemplate(
+        this->logical_device, this->ray_trace_descriptor_set,
+        this->ray_trace_descriptor_template, &this->ray_trace_descriptors);
+}
+
+void App::create_material_descriptor_sets() {
+    TRACE_ZONE("create_material_descriptor_sets");
+    VkSamplerCreateInfo sampler_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter = VK_FILTER_LINEAR,
+        .minFilter = VK_FILTER_LINEAR,
+        .mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR,
+        .addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT,
+        .maxLod = VK_LOD_CLAMP_NONE,
+    };
+    if (vkCreateSampler(this->logical_device, &sampler_create_info, nullptr,
+                        &this->texture_sampler) != VK_SUCCESS) {
+        stx::panic("Failed to create a texture sampler!");
+    }
+
+    // Materials, material indices, UVs and texture feedback, and then the
+    // textures, which must come last to have a variable count.
+    constexpr uint32_t binding_count = 5;
+    constexpr uint32_t texture_binding = binding_count - 1;
+    uint32_t const texture_count = std::max(this->scene.texture_count, 1u);
+    VkDescriptorSetLayoutBinding bindings[binding_count];
+    VkDescriptorBindingFlags binding_flags[binding_count] = {};
+    for (uint32_t i = 0; i < texture_binding; i++) {
+        bindings[i] = {
+            .binding = i,
+            .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+            .descriptorCount = 1,
+            .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR,
+        };
+    }
+    // Update after bind has far higher limits on sampled images, and lets
+    // textures that failed to load stay unwritten.
+    bindings[texture_binding] = {
+        .binding = texture_binding,
+        .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = texture_count,
+        .stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR,
+    };
+    binding_flags[texture_binding] =
+        VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT |
+        VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT |
+        VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT;
+    this->material_descriptor_set_layout = this->descriptor_layouts.get(
+        bindings, binding_count, binding_flags,
+        VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT);
+
+    uint32_t const set_count = this->max_frames_in_flight;
+    VkDescriptorPoolSize pool_sizes[2] = {
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, texture_binding * set_count},
+        {VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, texture_count * set_count},
+    };
+    VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT,
+        .maxSets = set_count,
+        .poolSizeCount = 2,
+        .pPoolSizes = pool_sizes,
+    };
+    if (vkCreateDescriptorPool(this->logical_device,
+                               &descriptor_pool_create_info, nullptr,
+                               &this->material_descriptor_pool) !=
+        VK_SUCCESS) {
+        stx::panic("Failed to create a descriptor pool!");
+    }
+
+    this->p_material_descriptor_sets =
+        new (std::nothrow) VkDescriptorSet[set_count];
+    this->p_are_material_sets_stale = new (std::nothrow) bool[set_count];
+    VkDescriptorSetLayout* p_layouts =
+        new (std::nothrow) VkDescriptorSetLayout[set_count];
+    uint32_t* p_texture_counts = new (std::nothrow) uint32_t[set_count];
+    std::fill_n(p_layouts, set_count, this->material_descriptor_set_layout);
+    std::fill_n(p_texture_counts, set_count, texture_count);
+    VkDescriptorSetVariableDescriptorCountAllocateInfo
+        variable_count_allocate_info = {
+            .sType =
+                VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO,
+            .descriptorSetCount = set_count,
+            .pDescriptorCounts = p_texture_counts,
+        };
+    VkDescriptorSetAllocateInfo descriptor_set_allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .pNext = &variable_count_allocate_info,
+        .descriptorPool = this->material_descriptor_pool,
+        .descriptorSetCount = set_count,
+        .pSetLayouts = p_layouts,
+    };
+    if (vkAllocateDescriptorSets(this->logical_device,
+                                 &descriptor_set_allocate_info,
+                                 this->p_material_descriptor_sets) !=
+        VK_SUCCESS) {
+        stx::panic("Failed to allocate a descriptor set!");
+    }
+    delete[] p_layouts;
+    delete[] p_texture_counts;
+
+    VkDeviceSize const feedback_slot_size =
+        sizeof(uint32_t) * this->texture_feedback_stride;
+    for (uint32_t i = 0; i < set_count; i++) {
+        VkDescriptorBufferInfo const buffer_infos[texture_binding] = {
+            {this->material_buffer, 0, VK_WHOLE_SIZE},
+            {this->material_index_buffer, 0, VK_WHOLE_SIZE},
+            {this->vertex_uv_buffer, 0, VK_WHOLE_SIZE},
+            {this->texture_feedback_buffer, feedback_slot_size * i,
+             feedback_slot_size},
+        };
+        VkWriteDescriptorSet writes[texture_binding];
+        for (uint32_t j = 0; j < texture_binding; j++) {
+            writes[j] = {
+                .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+                .dstSet = this->p_material_descriptor_sets[i],
+                .dstBinding = j,
+                .descriptorCount = 1,
+                .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+                .pBufferInfo = &buffer_infos[j],
             };
-    const VkAccelerationStructureBuildRangeInfoKHR**
-        p_acceleration_structure_build_range_infos =
-            &p_acceleration_structure_build_range_info;
+        }
+        vkUpdateDescriptorSets(this->logical_device, texture_binding, writes,
+                               0, nullptr);
+        this->write_texture_descriptors(i);
+    }
+    this->texture_streamer.are_views_dirty = false;
+}
 
-    VkCommandBufferAllocateInfo buffer_allocate_info = {};
-    buffer_allocate_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    buffer_allocate_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    buffer_allocate_info.commandPool = this->cmd_pool;
-    buffer_allocate_info.commandBufferCount = 1;
+void App::write_texture_descriptors(uint32_t frame_index) {
+    TRACE_ZONE("write_texture_descriptors");
+    uint32_t const texture_count = this->scene.texture_count;
+    VkDescriptorImageInfo* p_image_infos =
+        new (std::nothrow) VkDescriptorImageInfo[texture_count];
+    VkWriteDescriptorSet* p_writes =
+        new (std::nothrow) VkWriteDescriptorSet[texture_count];
+    // Textures without an image are never sampled, so they stay unwritten.
+    uint32_t write_count = 0;
+    for (uint32_t i = 0; i < texture_count; i++) {
+        TextureStreamer::Texture const& texture =
+            this->texture_streamer.textures[i];
+        if (texture.image == VK_NULL_HANDLE) {
+            continue;
+        }
+        p_image_infos[write_count] = {
+            this->texture_sampler,
+            texture.view,
+            // Left there by the streamer, which copies out of it.
+            VK_IMAGE_LAYOUT_GENERAL,
+        };
+        p_writes[write_count] = {
+            .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet = this->p_material_descriptor_sets[frame_index],
+            .dstBinding = 4,
+            .dstArrayElement = i,
+            .descriptorCount = 1,
+            .descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo = &p_image_infos[write_count],
+        };
+        write_count++;
+    }
+    vkUpdateDescriptorSets(this->logical_device, write_count, p_writes, 0,
+                           nullptr);
+    delete[] p_image_infos;
+    delete[] p_writes;
+    this->p_are_material_sets_stale[frame_index] = false;
+}
 
-    VkCommandBuffer p_command_buffer;
-    vkAllocateCommandBuffers(this->logical_device, &buffer_allocate_info,
-                             &p_command_buffer);
+auto App::create_shader_module(char const* p_file_name) -> VkShaderModule {
+    std::string path = std::string(SHADER_BINARY_DIR) + p_file_name;
+    std::FILE* p_file = std::fopen(path.c_str(), "rb");
+    if (p_file == nullptr) {
+        stx::panic("Failed to open a shader!");
+    }
+    std::fseek(p_file, 0, SEEK_END);
+    size_t const code_size = static_cast<size_t>(std::ftell(p_file));
+    std::fseek(p_file, 0, SEEK_SET);
+    // SPIR-V is consumed as words, so the code must be four-byte aligned.
+    uint32_t* p_code = new (std::nothrow) uint32_t[(code_size + 3) / 4];
+    size_t const read_size = std::fread(p_code, 1, code_size, p_file);
+    std::fclose(p_file);
+    if (read_size != code_size) {
+        stx::panic("Failed to read a shader!");
+    }
+
+    VkShaderModuleCreateInfo shader_module_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .codeSize = code_size,
+        .pCode = p_code,
+    };
+    VkShaderModule p_shader_module;
+    if (vkCreateShaderModule(this->logical_device, &shader_module_create_info,
+                             nullptr, &p_shader_module) != VK_SUCCESS) {
+        stx::panic("Failed to create a shader module!");
+    }
+
+    delete[] p_code;
+    return p_shader_module;
+}
+
+void App::create_ray_trace_pipeline() {
+    TRACE_ZONE("create_ray_trace_pipeline");
+    // The sample map pass shares this layout, and with it the push constants.
+    VkPushConstantRange push_constant_range = {
+        .stageFlags =
+            VK_SHADER_STAGE_RAYGEN_BIT_KHR | VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset = 0,
+        .size = sizeof(SamplingPushConstants),
+    };
+    VkDescriptorSetLayout const set_layouts[2] = {
+        this->ray_trace_descriptor_set_layout,
+        this->material_descriptor_set_layout,
+    };
+    VkPipelineLayoutCreateInfo pipeline_layout_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount = 2,
+        .pSetLayouts = set_layouts,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges = &push_constant_range,
+    };
+    if (vkCreatePipelineLayout(this->logical_device,
+                               &pipeline_layout_create_info, nullptr,
+                               &this->ray_trace_pipeline_layout) !=
+        VK_SUCCESS) {
+        stx::panic("Failed to create a pipeline layout!");
+    }
+
+    // Tells the closest hit shader how the positions were encoded.
+    VkBool32 const are_positions_half =
+        this->position_format == VK_FORMAT_R16G16B16A16_SFLOAT ? VK_TRUE
+                                                               : VK_FALSE;
+    VkSpecializationMapEntry specialization_map_entry = {
+        .constantID = 0,
+        .offset = 0,
+        .size = sizeof(VkBool32),
+    };
+    VkSpecializationInfo specialization_info = {
+        .mapEntryCount = 1,
+        .pMapEntries = &specialization_map_entry,
+        .dataSize = sizeof(VkBool32),
+        .pData = &are_positions_half,
+    };
+
+    constexpr uint32_t stage_count = 3;
+    VkPipelineShaderStageCreateInfo stages[stage_count] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_RAYGEN_BIT_KHR,
+            .module = this->create_shader_module("raygen.rgen.spv"),
+            .pName = "main",
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_MISS_BIT_KHR,
+            .module = this->create_shader_module("miss.rmiss.spv"),
+            .pName = "main",
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR,
+            .module = this->create_shader_module("closest_hit.rchit.spv"),
+            .pName = "main",
+            .pSpecializationInfo = &specialization_info,
+        },
+    };
+
+    // Ray generation, miss, and one triangle hit group, in the order the
+    // shader binding table lays them out.
+    constexpr uint32_t group_count = 3;
+    VkRayTracingShaderGroupCreateInfoKHR groups[group_count] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+            .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
+            .generalShader = 0,
+            .closestHitShader = VK_SHADER_UNUSED_KHR,
+            .anyHitShader = VK_SHADER_UNUSED_KHR,
+            .intersectionShader = VK_SHADER_UNUSED_KHR,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+            .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR,
+            .generalShader = 1,
+            .closestHitShader = VK_SHADER_UNUSED_KHR,
+            .anyHitShader = VK_SHADER_UNUSED_KHR,
+            .intersectionShader = VK_SHADER_UNUSED_KHR,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR,
+            .type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR,
+            .generalShader = VK_SHADER_UNUSED_KHR,
+            .closestHitShader = 2,
+            .anyHitShader = VK_SHADER_UNUSED_KHR,
+            .intersectionShader = VK_SHADER_UNUSED_KHR,
+        },
+    };
+
+    VkRayTracingPipelineCreateInfoKHR ray_tracing_pipeline_create_info = {
+        .sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR,
+        .stageCount = stage_count,
+        .pStages = stages,
+        .groupCount = group_count,
+        .pGroups = groups,
+        .maxPipelineRayRecursionDepth = 1,
+        .layout = this->ray_trace_pipeline_layout,
+    };
+    auto const create_begin = std::chrono::steady_clock::now();
+    if (vkCreateRayTracingPipelinesKHR(
+            this->logical_device, VK_NULL_HANDLE, this->pipeline_cache.cache,
+            1, &ray_tracing_pipeline_create_info, nullptr,
+            &this->ray_trace_pipeline) != VK_SUCCESS) {
+        stx::panic("Failed to create the ray tracing pipeline!");
+    }
+    std::chrono::duration<double, std::milli> const create_time =
+        std::chrono::steady_clock::now() - create_begin;
+    std::cout << "Created the ray tracing pipeline in " << create_time.count()
+              << " ms ("
+              << (this->pipeline_cache.is_warm ? "warm" : "cold")
+              << " pipeline cache).\n";
+
+    for (uint32_t i = 0; i < stage_count; i++) {
+        vkDestroyShaderModule(this->logical_device, stages[i].module, nullptr);
+    }
+}
+
+void App::create_sample_map_pipeline() {
+    TRACE_ZONE("create_sample_map_pipeline");
+    VkComputePipelineCreateInfo compute_pipeline_create_info = {
+        .sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+        .stage =
+            {
+                .sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+                .stage = VK_SHADER_STAGE_COMPUTE_BIT,
+                .module = this->create_shader_module("sample_map.comp.spv"),
+                .pName = "main",
+            },
+        .layout = this->ray_trace_pipeline_layout,
+    };
+    if (vkCreateComputePipelines(this->logical_device,
+                                 this->pipeline_cache.cache, 1,
+                                 &compute_pipeline_create_info, nullptr,
+                                 &this->sample_map_pipeline) != VK_SUCCESS) {
+        stx::panic("Failed to create the sample map pipeline!");
+    }
+    vkDestroyShaderModule(this->logical_device,
+                          compute_pipeline_create_info.stage.module, nullptr);
+}
+
+void App::create_shader_binding_table() {
+    TRACE_ZONE("create_shader_binding_table");
+    uint32_t const handle_size =
+        this->ray_tracing_pipeline_properties.shaderGroupHandleSize;
+    VkDeviceSize const handle_alignment =
+        this->ray_tracing_pipeline_properties.shaderGroupHandleAlignment;
+    VkDeviceSize const base_alignment =
+        this->ray_tracing_pipeline_properties.shaderGroupBaseAlignment;
+    auto align = [](VkDeviceSize size, VkDeviceSize alignment) {
+        return (size + alignment - 1) & ~(alignment - 1);
+    };
+
+    // Every region starts on the base alignment, and the ray generation
+    // region's size must equal its stride.
+    VkDeviceSize const handle_stride = align(handle_size, handle_alignment);
+    VkDeviceSize const raygen_size = align(handle_stride, base_alignment);
+    VkDeviceSize const miss_offset = raygen_size;
+    VkDeviceSize const hit_offset =
+        miss_offset + align(handle_stride, base_alignment);
+    VkDeviceSize const table_size = hit_offset + handle_stride;
+
+    constexpr uint32_t group_count = 3;
+    uint8_t* p_handles = new (std::nothrow) uint8_t[group_count * handle_size];
+    if (vkGetRayTracingShaderGroupHandlesKHR(
+            this->logical_device, this->ray_trace_pipeline, 0, group_count,
+            group_count * handle_size, p_handles) != VK_SUCCESS) {
+        stx::panic("Failed to get the shader group handles!");
+    }
+    uint8_t* p_table = new (std::nothrow) uint8_t[table_size]();
+    memcpy(p_table, p_handles, handle_size);
+    memcpy(p_table + miss_offset, p_handles + handle_size, handle_size);
+    memcpy(p_table + hit_offset, p_handles + 2 * handle_size, handle_size);
+
+    // The buffer itself is only aligned to its memory requirements, so the
+    // table is placed at the first base-aligned address inside it.
+    create_buffer(this->allocator,
+                  VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR |
+                      VK_BUFFER_USAGE_TRANSFER_DST_BIT |
+                      VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                  table_size + base_alignment,
+                  this->shader_binding_table_buffer,
+                  &this->shader_binding_table_buffer_allocation);
+
+    VkBufferDeviceAddressInfo table_device_address_info = {
+        .sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO,
+        .buffer = this->shader_binding_table_buffer,
+    };
+    VkDeviceAddress const buffer_address = vkGetBufferDeviceAddressKHR(
+        this->logical_device, &table_device_address_info);
+    VkDeviceAddress const table_address = align(buffer_address, base_alignment);
+
+    this->uploader.upload_buffer(this->shader_binding_table_buffer,
+                                 table_address - buffer_address, p_table,
+                                 table_size);
+    this->uploader.flush();
+
+    delete[] p_table;
+    delete[] p_handles;
+
+    this->raygen_region = {
+        .deviceAddress = table_address,
+        .stride = raygen_size,
+        .size = raygen_size,
+    };
+    this->miss_region = {
+        .deviceAddress = table_address + miss_offset,
+        .stride = handle_stride,
+        .size = handle_stride,
+    };
+    this->hit_region = {
+        .deviceAddress = table_address + hit_offset,
+        .stride = handle_stride,
+        .size = handle_stride,
+    };
+    this->callable_region = {};
+}
+
+void App::record_trace_rays(VkCommandBuffer p_command_buffer,
+                            uint32_t stats_slot) {
+    SamplingPushConstants const push_constants = {
+        .frame_number = this->frames_traced,
+        .is_adaptive = this->is_adaptive_sampling ? 1u : 0u,
+        .uniform_sample_count = this->uniform_sample_count,
+        .max_sample_count = this->max_sample_count,
+        .min_sample_count = this->min_sample_count,
+        .error_threshold = this->error_threshold,
+        .stats_slot = stats_slot,
+        .should_reset = this->should_reset_accumulation ? 1u : 0u,
+        .render_width = this->render_width,
+        .render_height = this->render_height,
+    };
+    this->p_sampling_stats[stats_slot].was_reset =
+        push_constants.should_reset;
+    this->should_reset_accumulation = false;
+    this->frames_traced++;
+
+    // The previous frame's rays and sample map have to be done with the
+    // images before the sample map reads and rewrites them.
+    VkMemoryBarrier memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(p_command_buffer,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                             VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1,
+                         &memory_barrier, 0, nullptr, 0, nullptr);
+
+    // The map is built in uniform mode too, where it only measures how far
+    // the image is from converging.
+    vkCmdBindPipeline(p_command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+                      this->sample_map_pipeline);
+    vkCmdBindDescriptorSets(
+        p_command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+        this->ray_trace_pipeline_layout, 0, 1, &this->ray_trace_descriptor_set,
+        0, nullptr);
+    vkCmdPushConstants(p_command_buffer, this->ray_trace_pipeline_layout,
+                       VK_SHADER_STAGE_RAYGEN_BIT_KHR |
+                           VK_SHADER_STAGE_COMPUTE_BIT,
+                       0, sizeof(push_constants), &push_constants);
+    uint32_t const map_scope =
+        this->profiler.begin_scope(p_command_buffer, "sample_map");
+    vkCmdDispatch(p_command_buffer, (this->render_width + 7) / 8,
+                  (this->render_height + 7) / 8, 1);
+    this->profiler.end_scope(p_command_buffer, map_scope);
+
+    memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+    vkCmdPipelineBarrier(p_command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1,
+                         &memory_barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(p_command_buffer,
+                      VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+                      this->ray_trace_pipeline);
+    VkDescriptorSet const descriptor_sets[2] = {
+        this->ray_trace_descriptor_set,
+        this->p_material_descriptor_sets[stats_slot],
+    };
+    vkCmdBindDescriptorSets(p_command_buffer,
+                            VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR,
+                            this->ray_trace_pipeline_layout, 0, 2,
+                            descriptor_sets, 0, nullptr);
+    uint32_t const scope =
+        this->profiler.begin_scope(p_command_buffer, "trace_rays");
+    vkCmdTraceRaysKHR(p_command_buffer, &this->raygen_region,
+                      &this->miss_region, &this->hit_region,
+                      &this->callable_region, this->render_width,
+                      this->render_height, 1);
+    this->profiler.end_scope(p_command_buffer, scope);
+}
+
+void App::update_render_scale() {
+    if (!this->is_resolution_dynamic) {
+        return;
+    }
+    // Both passes that scale with the pixel count.
+    double gpu_ms = 0;
+    uint64_t sample_count = 0;
+    for (GpuProfiler::Stage const& stage : this->profiler.stages) {
+        if (stage.sample_count == 0) {
+            continue;
+        }
+        bool const is_trace = std::strcmp(stage.p_name, "trace_rays") == 0;
+        if (is_trace || std::strcmp(stage.p_name, "sample_map") == 0) {
+            gpu_ms += stage.samples_ms[(stage.sample_count - 1) %
+                                       GpuProfiler::samples_per_stage];
+        }
+        if (is_trace) {
+            sample_count = stage.sample_count;
+        }
+    }
+    // Timings arrive some frames late, so each one is only acted on once.
+    if (sample_count == this->last_scaled_sample_count || gpu_ms <= 0) {
+        return;
+    }
+    this->last_scaled_sample_count = sample_count;
+
+    // The cost follows the pixel count, so each axis scales with the square
+    // root of the time ratio. Only half the step is taken, and small errors
+    // are ignored, so that timing noise does not make the scale oscillate.
+    float const target_scale =
+        this->render_scale *
+        static_cast<float>(std::sqrt(this->frame_budget_ms / gpu_ms));
+    float const scale = std::clamp(
+        this->render_scale + 0.5f * (target_scale - this->render_scale),
+        this->min_render_scale, 1.0f);
+    if (std::abs(scale - this->render_scale) < 0.02f) {
+        return;
+    }
+    this->render_scale = scale;
+    this->render_width = std::max(
+        1u, static_cast<uint32_t>(scale * static_cast<float>(this->width)));
+    this->render_height = std::max(
+        1u, static_cast<uint32_t>(scale * static_cast<float>(this->height)));
+    this->render_scale_change_count++;
+    // Accumulated pixels no longer line up with the new ones.
+    this->should_reset_accumulation = true;
+}
+
+void App::collect_sampling_stats(uint32_t stats_slot) {
+    SamplingStats& stats = this->p_sampling_stats[stats_slot];
+    if (stats.evaluated_pixel_count == 0) {
+        return;
+    }
+    uint64_t const ray_count =
+        this->is_adaptive_sampling
+            ? stats.sample_count
+            : uint64_t{stats.evaluated_pixel_count} *
+                  this->uniform_sample_count;
+    if (stats.was_reset != 0) {
+        this->rays_since_reset = 0;
+        this->frames_since_reset = 0;
+        this->is_converged = false;
+    }
+    this->rays_traced += ray_count;
+    this->rays_since_reset += ray_count;
+    this->frames_since_reset++;
+
+    // Every pixel being below the threshold is what counts as a converged
+    // frame. Uniform sampling would have needed as many samples in every
+    // pixel as the worst pixel got.
+    if (!this->is_converged && stats.active_pixel_count == 0) {
+        this->is_converged = true;
+        std::cout << "Converged after " << this->frames_since_reset
+                  << " frames and " << this->rays_since_reset << " rays ("
+                  << static_cast<double>(this->rays_since_reset) /
+                         stats.evaluated_pixel_count
+                  << " per pixel)";
+        if (this->is_adaptive_sampling) {
+            std::cout << ", uniform sampling would need "
+                      << uint64_t{stats.evaluated_pixel_count} *
+                             stats.max_pixel_sample_count;
+        }
+        std::cout << ".\n";
+    }
+    stats = {};
+}
 
-    VkCommandBufferBeginInfo command_buffer_begin_info = {};
-    command_buffer_begin_info.sType =
-        VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    command_buffer_begin_info.flags =
-        VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+void App::print_sampling_stats() const {
+    double trace_ms = 0;
+    for (GpuProfiler::Stage const& stage : this->profiler.stages) {
+        if (std::strcmp(stage.p_name, "trace_rays") == 0) {
+            trace_ms = stage.total_ms;
+        }
+    }
+    std::cout << "Traced " << this->rays_traced << " rays with "
+              << (this->is_adaptive_sampling ? "adaptive" : "uniform")
+              << " sampling";
+    if (trace_ms > 0) {
+        std::cout << ", "
+                  << static_cast<double>(this->rays_traced) / trace_ms / 1e3
+                  << " Mrays/s";
+    }
+    std::cout << ".\n";
+}
 
+void App::create_readback_buffer() {
+    create_buffer(this->allocator, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  VkDeviceSize{4} * this->width * this->height,
+                  this->readback_buffer, &this->readback_buffer_allocation);
+}
+
+void App::record_readback(VkCommandBuffer p_command_buffer) {
+    VkMemoryBarrier memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    };
+    vkCmdPipelineBarrier(p_command_buffer,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &memory_barrier,
+                         0, nullptr, 0, nullptr);
+
+    VkBufferImageCopy buffer_image_copy = {
+        .bufferOffset = 0,
+        .bufferRowLength = 0,
+        .bufferImageHeight = 0,
+        .imageSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .imageOffset = {0, 0, 0},
+        .imageExtent = {this->render_width, this->render_height, 1},
+    };
+    uint32_t const scope =
+        this->profiler.begin_scope(p_command_buffer, "readback");
+    vkCmdCopyImageToBuffer(p_command_buffer, this->storage_image.image,
+                           VK_IMAGE_LAYOUT_GENERAL, this->readback_buffer, 1,
+                           &buffer_image_copy);
+    this->profiler.end_scope(p_command_buffer, scope);
+
+    memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_HOST_READ_BIT,
+    };
+    vkCmdPipelineBarrier(p_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &memory_barrier, 0,
+                         nullptr, 0, nullptr);
+}
+
+void App::write_frame(char const* p_file_name) {
+    TRACE_ZONE("write_frame");
+    // Frames are written at the resolution they were traced at.
+    if (!write_ppm(
+            p_file_name,
+            static_cast<uint8_t const*>(
+                this->readback_buffer_allocation.p_mapped),
+            this->render_width, this->render_height)) {
+        std::cout << "Failed to write " << p_file_name << ".\n";
+    }
+}
+
+void App::render_headless_on_cpu() {
+    for (uint32_t frame = 0; frame < this->headless_frame_count; frame++) {
+        TRACE_ZONE("headless_frame");
+        auto const frame_begin = std::chrono::steady_clock::now();
+
+        // The scene never changes, so samples accumulate over every frame.
+        this->cpu_tracer.trace_frame(frame, this->uniform_sample_count,
+                                     frame == 0);
+
+        std::array<char, 256> file_name;
+        std::snprintf(file_name.data(), file_name.size(), "%s_%04u.ppm",
+                      this->p_output_prefix, frame);
+        if (!write_ppm(file_name.data(), this->cpu_tracer.p_pixels,
+                       this->cpu_tracer.width, this->cpu_tracer.height)) {
+            std::cout << "Failed to write " << file_name.data() << ".\n";
+        }
+
+        std::chrono::duration<double, std::milli> const frame_time =
+            std::chrono::steady_clock::now() - frame_begin;
+        std::cout << "Wrote " << file_name.data() << " in "
+                  << frame_time.count() << " ms.\n";
+    }
+}
+
+void App::render_headless() {
+    if (this->is_cpu_tracing) {
+        this->render_headless_on_cpu();
+        return;
+    }
+    for (uint32_t frame = 0; frame < this->headless_frame_count; frame++) {
+        TRACE_ZONE("headless_frame");
+        auto const frame_begin = std::chrono::steady_clock::now();
+
+        if (this->is_scene_dynamic) {
+            this->animate_instances(frame / 60.0);
+        }
+        this->stream_textures(0, frame);
+        this->write_frame_descriptors(0);
+
+        VkCommandBuffer p_command_buffer =
+            this->begin_one_time_cmd_buffer(this->graphics_queue);
+        if (this->are_instances_dirty || this->does_tlas_need_rebuild) {
+            this->write_instances(0);
+            this->record_tlas_build(p_command_buffer, 0);
+            this->should_reset_accumulation = true;
+        }
+        this->record_trace_rays(p_command_buffer, 0);
+        this->record_readback(p_command_buffer);
+        this->submit_one_time_cmd_buffer(p_command_buffer,
+                                         this->graphics_queue);
+        this->profiler.resolve();
+        this->collect_sampling_stats(0);
+
+        std::array<char, 256> file_name;
+        std::snprintf(file_name.data(), file_name.size(), "%s_%04u.ppm",
+                      this->p_output_prefix, frame);
+        this->write_frame(file_name.data());
+
+        std::chrono::duration<double, std::milli> const frame_time =
+            std::chrono::steady_clock::now() - frame_begin;
+        std::cout << "Wrote " << file_name.data() << " in "
+                  << frame_time.count() << " ms.\n";
+        // Only after the frame is written, because the readback is sized
+        // to the resolution it was traced at.
+        this->update_render_scale();
+    }
+}
+
+void App::create_cmd_buffers() {
+    TRACE_ZONE("create_cmd_buffers");
+    this->frame_cmd_pools.initialize(
+        this->logical_device, this->generic_queue_index,
+        this->max_frames_in_flight, recording_thread_count);
+}
+
+void App::create_sync_objects() {
+    TRACE_ZONE("create_sync_objects");
+    this->image_available_semaphores =
+        new (std::nothrow) VkSemaphore[this->max_frames_in_flight];
+    this->in_flight_fences =
+        new (std::nothrow) VkFence[this->max_frames_in_flight];
+    this->p_input_times = new (std::nothrow)
+        std::chrono::steady_clock::time_point[this->max_frames_in_flight];
+    this->p_is_latency_pending =
+        new (std::nothrow) bool[this->max_frames_in_flight]();
+    this->p_present_ids =
+        new (std::nothrow) uint64_t[this->max_frames_in_flight]();
+    this->p_present_swapchains =
+        new (std::nothrow) VkSwapchainKHR[this->max_frames_in_flight]();
+
+    VkSemaphoreCreateInfo semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+    // Fences start signaled, so that the first wait on each frame returns.
+    VkFenceCreateInfo fence_create_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
+    };
+
+    for (uint32_t i = 0; i < this->max_frames_in_flight; i++) {
+        if (vkCreateSemaphore(this->logical_device, &semaphore_create_info,
+                              nullptr, &this->image_available_semaphores[i]) !=
+                VK_SUCCESS ||
+            vkCreateFence(this->logical_device, &fence_create_info, nullptr,
+                          &this->in_flight_fences[i]) != VK_SUCCESS) {
+            stx::panic("Failed to create frame synchronization objects!");
+        }
+    }
+    this->create_image_sync_objects();
+}
+
+void App::create_image_sync_objects() {
+    this->render_finished_semaphores =
+        new (std::nothrow) VkSemaphore[this->image_count];
+    this->images_in_flight = new (std::nothrow) VkFence[this->image_count];
+    VkSemaphoreCreateInfo semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+    };
+    // A semaphore can only be reused once the presentation that waited on it
+    // is done, which is only known when its image is acquired again.
+    for (uint32_t i = 0; i < this->image_count; i++) {
+        if (vkCreateSemaphore(this->logical_device, &semaphore_create_info,
+                              nullptr, &this->render_finished_semaphores[i]) !=
+            VK_SUCCESS) {
+            stx::panic("Failed to create frame synchronization objects!");
+        }
+        this->images_in_flight[i] = VK_NULL_HANDLE;
+    }
+    this->unacquired_image_count = this->image_count;
+}
+
+void App::record_frame(VkCommandBuffer p_command_buffer, uint32_t frame_index,
+                       uint32_t image_index) {
+    TRACE_ZONE("record_frame");
+    VkCommandBufferBeginInfo command_buffer_begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
     if (vkBeginCommandBuffer(p_command_buffer, &command_buffer_begin_info) !=
         VK_SUCCESS) {
-        stx::panic("Failed to begin tlas build command buffer!");
+        stx::panic("Failed to begin a frame's command buffer!");
     }
-    vkCmdBuildAccelerationStructuresKHR(
-        p_command_buffer, 1, &acceleration_structure_build_geometry_info,
-        p_acceleration_structure_build_range_infos);
+
+    // Every frame shares the storage image, so the previous frame's blit has
+    // to finish reading it before rays overwrite it.
+    VkMemoryBarrier memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = 0,
+        .dstAccessMask = 0,
+    };
+    vkCmdPipelineBarrier(p_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1,
+                         &memory_barrier, 0, nullptr, 0, nullptr);
+
+    this->record_trace_rays(p_command_buffer, frame_index);
+
+    VkImageSubresourceRange subresource_range = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = 1,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+    VkImageMemoryBarrier image_memory_barriers[2] = {
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .newLayout = VK_IMAGE_LAYOUT_GENERAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = this->storage_image.image,
+            .subresourceRange = subresource_range,
+        },
+        {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+            .srcAccessMask = 0,
+            .dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .oldLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+            .newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+            .image = this->swapchain_images[image_index],
+            .subresourceRange = subresource_range,
+        },
+    };
+    vkCmdPipelineBarrier(p_command_buffer,
+                         VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                             VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0,
+                         nullptr, 2, image_memory_barriers);
+
+    // A blit rather than a copy, because it converts to the swapchain's
+    // format and scales to the window.
+    VkImageBlit image_blit = {
+        .srcSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .srcOffsets = {{0, 0, 0},
+                       {static_cast<int32_t>(this->render_width),
+                        static_cast<int32_t>(this->render_height), 1}},
+        .dstSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .dstOffsets = {{0, 0, 0},
+                       {static_cast<int32_t>(this->swapchain_extent.width),
+                        static_cast<int32_t>(this->swapchain_extent.height),
+                        1}},
+    };
+    uint32_t const blit_scope =
+        this->profiler.begin_scope(p_command_buffer, "present_blit");
+    vkCmdBlitImage(p_command_buffer, this->storage_image.image,
+                   VK_IMAGE_LAYOUT_GENERAL, this->swapchain_images[image_index],
+                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &image_blit,
+                   VK_FILTER_LINEAR);
+    this->profiler.end_scope(p_command_buffer, blit_scope);
+
+    VkImageMemoryBarrier present_barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = 0,
+        .oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = this->swapchain_images[image_index],
+        .subresourceRange = subresource_range,
+    };
+    vkCmdPipelineBarrier(p_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr,
+                         0, nullptr, 1, &present_barrier);
+
     if (vkEndCommandBuffer(p_command_buffer) != VK_SUCCESS) {
-        stx::panic("Failed to end tlas build command buffer!");
+        stx::panic("Failed to end a frame's command buffer!");
     }
+}
 
-    VkSubmitInfo submit_info = {};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &p_command_buffer;
+void App::record_frame_job(uint32_t thread_index, void* p_data) {
+    FrameRecording& recording = *static_cast<FrameRecording*>(p_data);
+    App& app = *recording.p_app;
+    VkCommandBuffer p_command_buffer =
+        app.frame_cmd_pools.allocate(recording.frame_index, thread_index);
+    if (thread_index == 0) {
+        app.record_frame(p_command_buffer, recording.frame_index,
+                         recording.image_index);
+        recording.cmd_buffers[1] = p_command_buffer;
+        return;
+    }
 
-    if (vkQueueSubmit(this->compute_queue, 1, &submit_info, nullptr) !=
+    TRACE_ZONE("record_tlas_build");
+    VkCommandBufferBeginInfo command_buffer_begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(p_command_buffer, &command_buffer_begin_info) !=
         VK_SUCCESS) {
-        stx::panic("Failed to submit tlas build command queue!");
+        stx::panic("Failed to begin a frame's command buffer!");
     }
-    if (vkQueueWaitIdle(this->compute_queue) != VK_SUCCESS) {
-        stx::panic("Failed to wait on tlas build command queue!");
+    app.record_tlas_build(p_command_buffer, recording.frame_index);
+    if (vkEndCommandBuffer(p_command_buffer) != VK_SUCCESS) {
+        stx::panic("Failed to end a frame's command buffer!");
     }
+    recording.cmd_buffers[0] = p_command_buffer;
+}
 
-    vkFreeCommandBuffers(this->logical_device, this->cmd_pool, 1,
-                         &p_command_buffer);
+void App::draw_frame() {
+    TRACE_ZONE("draw_frame");
+    uint32_t const frame_index = this->current_frame;
+
+    // Only block if the GPU is still `max_frames_in_flight` frames behind.
+    // With present wait, this also waits for the frame that last used this
+    // slot to be shown, so the host runs no further ahead of the display.
+    auto const wait_begin = std::chrono::steady_clock::now();
+    {
+        TRACE_ZONE("fence_wait");
+        this->collect_latency(frame_index, UINT64_MAX);
+        vkWaitForFences(this->logical_device, 1,
+                        &this->in_flight_fences[frame_index], VK_TRUE,
+                        UINT64_MAX);
+    }
 
-    vkDestroyBuffer(this->logical_device, p_scratch_buffer, nullptr);
-    vkFreeMemory(this->logical_device, p_scratch_buffer_memory, nullptr);
-    delete p_acceleration_structure_build_range_info;
+    // Frames before the first pending one have signaled their fences.
+    uint64_t const frame = this->frames_rendered;
+    this->release_retired_swapchains(
+        frame >= this->max_frames_in_flight - 1
+            ? frame - (this->max_frames_in_flight - 1)
+            : 0,
+        false);
+
+    uint32_t image_index;
+    VkResult acquire_result;
+    {
+        TRACE_ZONE("acquire_image");
+        acquire_result = vkAcquireNextImageKHR(
+            this->logical_device, this->swapchain, UINT64_MAX,
+            this->image_available_semaphores[frame_index], VK_NULL_HANDLE,
+            &image_index);
+    }
+    // The semaphore is left unsignaled and the fence untouched, so the
+    // frame can simply start over on the new swapchain. A suboptimal
+    // swapchain still presents this frame, and is recreated after it.
+    if (acquire_result == VK_ERROR_OUT_OF_DATE_KHR) {
+        this->recreate_swapchain();
+        return;
+    }
+    if (acquire_result != VK_SUCCESS && acquire_result != VK_SUBOPTIMAL_KHR) {
+        stx::panic("Failed to acquire a swapchain image!");
+    }
+
+    // An earlier frame may still be presenting from this image.
+    if (this->images_in_flight[image_index] == VK_NULL_HANDLE) {
+        this->unacquired_image_count--;
+    } else {
+        TRACE_ZONE("fence_wait");
+        vkWaitForFences(this->logical_device, 1,
+                        &this->images_in_flight[image_index], VK_TRUE,
+                        UINT64_MAX);
+    }
+    std::chrono::duration<double, std::milli> const wait_time =
+        std::chrono::steady_clock::now() - wait_begin;
+    this->last_frame_wait_ms = wait_time.count();
+    this->total_frame_wait_ms += this->last_frame_wait_ms;
+    this->images_in_flight[image_index] = this->in_flight_fences[frame_index];
+    this->profiler.resolve();
+    this->collect_sampling_stats(frame_index);
+    this->update_render_scale();
+    this->stream_textures(frame_index, frame);
+
+    // Anything the host changes from here on can not race the GPU, because
+    // this frame's slot is no longer in use.
+    if (this->is_scene_dynamic) {
+        this->animate_instances(glfwGetTime());
+    }
+
+    // The TLAS build is recorded on a worker while this thread records the
+    // rest of the frame.
+    this->frame_cmd_pools.reset(frame_index);
+    bool const has_tlas_build =
+        this->are_instances_dirty || this->does_tlas_need_rebuild;
+    if (has_tlas_build) {
+        // Packed on every thread of the pool, before recording needs them.
+        this->write_instances(frame_index);
+        this->should_reset_accumulation = true;
+    }
+    this->write_frame_descriptors(frame_index);
+    FrameRecording recording = {
+        .p_app = this,
+        .frame_index = frame_index,
+        .image_index = image_index,
+    };
+    uint32_t const job_count = has_tlas_build ? recording_thread_count : 1;
+    if (this->thread_pool.thread_count >= job_count) {
+        this->thread_pool.run(job_count, record_frame_job, &recording);
+    } else {
+        // `run()` only goes as wide as the pool, so a pool too small for
+        // every job gets them recorded here, one after the other.
+        for (uint32_t i = 0; i < job_count; i++) {
+            record_frame_job(i, &recording);
+        }
+    }
+    // Only what was recorded is submitted.
+    bool const has_recorded_tlas_build =
+        recording.cmd_buffers[0] != VK_NULL_HANDLE;
+
+    // Tracing can start before the image is acquired, only the blit waits.
+    // Uploads and builds from other queues are only waited on up to what
+    // was submitted so far, so that streaming keeps going alongside frames.
+    VkSemaphore wait_semaphores[3] = {
+        this->image_available_semaphores[frame_index],
+        this->uploader.timeline,
+        this->build_timeline,
+    };
+    uint64_t const wait_values[3] = {
+        0,
+        this->uploader.timeline_value,
+        this->build_timeline_value,
+    };
+    VkPipelineStageFlags const wait_stages[3] = {
+        VK_PIPELINE_STAGE_TRANSFER_BIT,
+        VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+        VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR,
+    };
+    VkTimelineSemaphoreSubmitInfo timeline_semaphore_submit_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .waitSemaphoreValueCount = 3,
+        .pWaitSemaphoreValues = wait_values,
+    };
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timeline_semaphore_submit_info,
+        .waitSemaphoreCount = 3,
+        .pWaitSemaphores = wait_semaphores,
+        .pWaitDstStageMask = wait_stages,
+        // Within one submission, the TLAS build's barriers still order it
+        // before the rays.
+        .commandBufferCount = has_recorded_tlas_build ? 2u : 1u,
+        .pCommandBuffers = has_recorded_tlas_build
+                               ? &recording.cmd_buffers[0]
+                               : &recording.cmd_buffers[1],
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &this->render_finished_semaphores[image_index],
+    };
+    vkResetFences(this->logical_device, 1,
+                  &this->in_flight_fences[frame_index]);
+    {
+        TRACE_ZONE("queue_submit");
+        if (vkQueueSubmit(this->graphics_queue, 1, &submit_info,
+                          this->in_flight_fences[frame_index]) != VK_SUCCESS) {
+            stx::panic("Failed to submit a frame!");
+        }
+    }
+    this->p_input_times[frame_index] = this->input_time;
+
+    uint64_t const present_id = ++this->last_present_id;
+    VkPresentIdKHR present_id_info = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+        .pNext = nullptr,
+        .swapchainCount = 1,
+        .pPresentIds = &present_id,
+    };
+    VkPresentInfoKHR present_info = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .pNext = this->is_present_wait_enabled ? &present_id_info : nullptr,
+        .waitSemaphoreCount = 1,
+        .pWaitSemaphores = &this->render_finished_semaphores[image_index],
+        .swapchainCount = 1,
+        .pSwapchains = &this->swapchain,
+        .pImageIndices = &image_index,
+    };
+    VkResult present_result;
+    {
+        TRACE_ZONE("queue_present");
+        present_result = vkQueuePresentKHR(this->present_queue, &present_info);
+    }
+    // A present that failed is never shown, so it can not be waited on.
+    bool const is_presented = present_result == VK_SUCCESS ||
+                              present_result == VK_SUBOPTIMAL_KHR;
+    this->p_present_ids[frame_index] = present_id;
+    this->p_present_swapchains[frame_index] = this->swapchain;
+    this->p_is_latency_pending[frame_index] =
+        !this->is_present_wait_enabled || is_presented;
+    if (is_presented) {
+        this->swapchain_last_present_id = present_id;
+    }
+
+    this->current_frame = (this->current_frame + 1) % this->max_frames_in_flight;
+    this->frames_rendered++;
+
+    if (present_result == VK_ERROR_OUT_OF_DATE_KHR ||
+        present_result == VK_SUBOPTIMAL_KHR || this->resized) {
+        this->recreate_swapchain();
+    } else if (present_result != VK_SUCCESS) {
+        stx::panic("Failed to present a frame!");
+    }
+}
+
+void App::recreate_swapchain() {
+    TRACE_ZONE("recreate_swapchain");
+    // A minimized window has nothing to present to until it is restored.
+    int framebuffer_width = 0;
+    int framebuffer_height = 0;
+    glfwGetFramebufferSize(this->window, &framebuffer_width,
+                           &framebuffer_height);
+    while ((framebuffer_width == 0 || framebuffer_height == 0) &&
+           glfwWindowShouldClose(this->window) == 0) {
+        glfwWaitEvents();
+        glfwGetFramebufferSize(this->window, &framebuffer_width,
+                               &framebuffer_height);
+    }
+    if (framebuffer_width == 0 || framebuffer_height == 0) {
+        return;
+    }
+    this->resized = false;
+
+    // Frames already in flight keep presenting to the old swapchain, with
+    // its own semaphores, while the next frame acquires from the new one.
+    // The storage image stays as it is, and the blit scales it to the new
+    // extent.
+    this->retired_swapchains.push_back({
+        .swapchain = this->swapchain,
+        .p_images = this->swapchain_images,
+        .p_render_finished_semaphores = this->render_finished_semaphores,
+        .image_count = this->image_count,
+        .frame = this->frames_rendered,
+        .last_present_id = this->swapchain_last_present_id,
+    });
+    this->swapchain_last_present_id = 0;
+    delete[] this->images_in_flight;
+    this->create_swapchain();
+    this->create_image_sync_objects();
+    this->swapchain_recreation_count++;
+}
+
+void App::release_retired_swapchains(uint64_t first_pending_frame,
+                                     bool is_device_idle) {
+    for (size_t i = 0; i < this->retired_swapchains.size();) {
+        RetiredSwapchain& retired = this->retired_swapchains[i];
+        bool is_presented = is_device_idle;
+        if (!is_presented && retired.frame <= first_pending_frame) {
+            // Polled rather than waited on, since the next frame can go
+            // ahead regardless. Any result but a timeout means that the
+            // present is no longer pending.
+            is_presented =
+                this->is_present_wait_enabled
+                    ? retired.last_present_id == 0 ||
+                          vkWaitForPresentKHR(this->logical_device,
+                                              retired.swapchain,
+                                              retired.last_present_id,
+                                              0) != VK_TIMEOUT
+                    : this->unacquired_image_count == 0;
+        }
+        if (!is_presented) {
+            i++;
+            continue;
+        }
+        for (uint32_t j = 0; j < retired.image_count; j++) {
+            vkDestroySemaphore(this->logical_device,
+                               retired.p_render_finished_semaphores[j],
+                               nullptr);
+        }
+        delete[] retired.p_render_finished_semaphores;
+        delete[] retired.p_images;
+        vkDestroySwapchainKHR(this->logical_device, retired.swapchain,
+                              nullptr);
+        retired = this->retired_swapchains.back();
+        this->retired_swapchains.pop_back();
+    }
+}
+
+auto App::collect_latency(uint32_t frame_index, uint64_t timeout) -> bool {
+    if (!this->p_is_latency_pending[frame_index]) {
+        return true;
+    }
+    // A window that is hidden may never show the frame, so a present is
+    // only waited on for so long before its sample is dropped.
+    constexpr uint64_t max_present_wait = 100'000'000;
+    VkResult result;
+    if (this->is_present_wait_enabled) {
+        result = vkWaitForPresentKHR(
+            this->logical_device, this->p_present_swapchains[frame_index],
+            this->p_present_ids[frame_index],
+            std::min(timeout, max_present_wait));
+    } else {
+        result = vkWaitForFences(this->logical_device, 1,
+                                 &this->in_flight_fences[frame_index],
+                                 VK_TRUE, timeout);
+    }
+    auto const end_time = std::chrono::steady_clock::now();
+    if (result == VK_TIMEOUT &&
+        (!this->is_present_wait_enabled || timeout < max_present_wait)) {
+        return false;
+    }
+    // Presents to a retired swapchain may be out of date instead.
+    this->p_is_latency_pending[frame_index] = false;
+    if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+        return true;
+    }
+    std::chrono::duration<double, std::milli> const latency =
+        end_time - this->p_input_times[frame_index];
+    this->last_latency_ms = latency.count();
+    this->total_latency_ms += this->last_latency_ms;
+    this->max_latency_ms = std::max(this->max_latency_ms, latency.count());
+    this->latency_sample_count++;
+    return true;
+}
+
+auto App::get_latency_name() const -> char const* {
+    return this->is_present_wait_enabled ? "input-to-present"
+                                         : "input-to-GPU-completion";
+}
+
+void App::pace_frame() {
+    TRACE_ZONE("pace_frame");
+    auto now = std::chrono::steady_clock::now();
+    if (this->target_frame_rate <= 0) {
+        return;
+    }
+    auto const frame_interval =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(1.0 / this->target_frame_rate));
+    // A frame that ran more than an interval late moves the schedule,
+    // rather than letting the next ones hurry to catch up.
+    if (now > this->next_frame_time + frame_interval) {
+        this->next_frame_time = now;
+    }
+
+    // Block on the oldest frame in flight, so that its latency is measured
+    // as it finishes, and then on the clock.
+    while (now < this->next_frame_time) {
+        uint32_t oldest_frame = this->max_frames_in_flight;
+        for (uint32_t i = 0; i < this->max_frames_in_flight; i++) {
+            if (this->p_is_latency_pending[i] &&
+                (oldest_frame == this->max_frames_in_flight ||
+                 this->p_input_times[i] < this->p_input_times[oldest_frame])) {
+                oldest_frame = i;
+            }
+        }
+        if (oldest_frame == this->max_frames_in_flight) {
+            std::this_thread::sleep_until(this->next_frame_time);
+            break;
+        }
+        auto const timeout = std::chrono::duration_cast<
+            std::chrono::nanoseconds>(this->next_frame_time - now);
+        if (!this->collect_latency(oldest_frame,
+                                   static_cast<uint64_t>(timeout.count()))) {
+            break;
+        }
+        now = std::chrono::steady_clock::now();
+    }
+    this->next_frame_time += frame_interval;
 }
 
 void App::initialize() {
-    this->create_surface();
+    TRACE_ZONE("initialize");
+    {
+        TRACE_ZONE("load_scene");
+        if (this->p_scene_path == nullptr ||
+            !this->scene.load(this->p_scene_path)) {
+            this->scene.load_triangle();
+        }
+    }
+
+    if (!this->is_cpu_tracing && !this->has_ray_tracing_device()) {
+        std::cout << "No device can ray trace, so tracing on the CPU.\n";
+        this->is_cpu_tracing = true;
+    }
+    if (this->is_cpu_tracing) {
+        // There is nothing to present to without a device.
+        this->is_headless = true;
+        if (this->is_adaptive_sampling || this->scene_instance_count > 1 ||
+            this->is_scene_dynamic || this->is_resolution_dynamic) {
+            std::cout << "The CPU tracer samples uniformly at full "
+                         "resolution, and traces the scene once, as is.\n";
+        }
+        this->thread_pool.initialize(0);
+        this->cpu_tracer.initialize(this->scene, this->thread_pool,
+                                    this->width, this->height);
+        CameraUniforms const camera = this->frame_scene();
+        this->cpu_tracer.set_camera(camera.origin, camera.lower_left,
+                                    camera.horizontal, camera.vertical);
+        return;
+    }
+
+    this->initialize_device();
+    this->initialize_scene();
+    this->initialize_renderer();
+
+    this->allocator.print_stats();
+    this->uploader.print_stats();
+}
+
+void App::initialize_device() {
+    TRACE_ZONE("initialize_device");
+    this->create_instance();
+    if (!this->is_headless) {
+        this->create_surface();
+    }
     this->create_physical_device();
     this->create_logical_device();
     this->load_every_pfn();
+    this->allocator.initialize(this->logical_device, this->physical_device);
+    this->profiler.initialize(this->logical_device, this->physical_device,
+                              this->generic_queue_index);
+    this->uploader.initialize(this->logical_device, this->allocator,
+                              this->transfer_queue_index, this->transfer_queue,
+                              this->staging_ring_size);
+    // Transfer-only families may lack timestamps, which the profiler only
+    // checks on the generic family.
+    this->uploader.is_transfer_only =
+        this->transfer_queue_index != this->generic_queue_index;
+    if (!this->uploader.is_transfer_only) {
+        this->uploader.p_profiler = &this->profiler;
+    }
+    this->thread_pool.initialize(0);
 
-    this->create_swapchain();
+    if (!this->is_headless) {
+        this->create_swapchain();
+    }
     this->create_cmd_pool();
-    this->create_storage_image();
+}
+
+void App::initialize_scene() {
+    TRACE_ZONE("initialize_scene");
     this->create_vertex_buffer();
     this->create_index_buffer();
+    this->create_mesh_buffer();
+    this->create_textures();
+    this->create_material_buffer();
     this->create_blas();
     this->create_tlas();
 }
 
+void App::initialize_renderer() {
+    TRACE_ZONE("initialize_renderer");
+    this->create_storage_image();
+    this->create_camera();
+    this->create_sampling_stats_buffer();
+    this->descriptor_layouts.initialize(this->logical_device);
+    this->create_ray_trace_descriptors();
+    this->create_material_descriptor_sets();
+    this->pipeline_cache.initialize(this->logical_device,
+                                    this->physical_device,
+                                    this->p_pipeline_cache_path);
+    this->create_ray_trace_pipeline();
+    this->create_sample_map_pipeline();
+    this->create_shader_binding_table();
+    if (this->is_headless) {
+        this->create_readback_buffer();
+    } else {
+        this->create_cmd_buffers();
+        this->create_sync_objects();
+    }
+    this->is_renderer_initialized = true;
+}
+
 void App::render_loop() {
     while (glfwWindowShouldClose(this->window) == 0) {
+        this->pace_frame();
         glfwPollEvents();
+        this->input_time = std::chrono::steady_clock::now();
+        this->draw_frame();
+    }
+    // The frames still pending finished long before this, so they are left
+    // out rather than measured late.
+    vkDeviceWaitIdle(this->logical_device);
+
+    if (this->frames_rendered > 0) {
+        std::cout << "Rendered " << this->frames_rendered << " frames with "
+                  << this->max_frames_in_flight
+                  << " in flight, waiting on the GPU for "
+                  << this->total_frame_wait_ms /
+                         static_cast<double>(this->frames_rendered)
+                  << " ms per frame.\n";
+    }
+    if (this->latency_sample_count > 0) {
+        std::cout << "Presented with "
+                  << get_present_mode_name(this->present_mode) << " on "
+                  << this->image_count << " images, with "
+                  << this->total_latency_ms /
+                         static_cast<double>(this->latency_sample_count)
+                  << " ms of " << this->get_latency_name()
+                  << " latency on average and "
+                  << this->max_latency_ms << " ms at most, recreating the "
+                  << "swapchain " << this->swapchain_recreation_count
+                  << " times.\n";
+    }
+    if (this->is_resolution_dynamic) {
+        std::cout << "Changed the render scale "
+                  << this->render_scale_change_count << " times, ending at "
+                  << this->render_width << "x" << this->render_height
+                  << ".\n";
     }
 }
 
-void App::free() {
-    // vkFreeCommandBuffers(this->logical_device, this->cmd_pool,
-    //                      this->image_count, this->p_command_buffers);
-    // delete this->p_command_buffers;
+void App::free_scene() {
+    TRACE_ZONE("free_scene");
+    this->free_acceleration_structures();
 
-    // Free acceleration structure.
+    // Free mesh data.
+    destroy_buffer(this->allocator, this->vertex_position_buffer,
+                   &this->vertex_position_buffer_allocation);
+    destroy_buffer(this->allocator, this->vertex_normal_buffer,
+                   &this->vertex_normal_buffer_allocation);
+    destroy_buffer(this->allocator, this->vertex_uv_buffer,
+                   &this->vertex_uv_buffer_allocation);
+    destroy_buffer(this->allocator, this->index_buffer,
+                   &this->index_buffer_allocation);
+    destroy_buffer(this->allocator, this->mesh_buffer,
+                   &this->mesh_buffer_allocation);
+    destroy_buffer(this->allocator, this->blas_transform_buffer,
+                   &this->blas_transform_buffer_allocation);
+    delete[] this->p_blas_transforms;
+    this->p_blas_transforms = nullptr;
+    delete[] this->p_half_positions;
+    this->p_half_positions = nullptr;
+
+    this->texture_streamer.print_stats();
+    this->texture_streamer.free();
+    destroy_buffer(this->allocator, this->texture_feedback_buffer,
+                   &this->texture_feedback_buffer_allocation);
+    destroy_buffer(this->allocator, this->material_buffer,
+                   &this->material_buffer_allocation);
+    destroy_buffer(this->allocator, this->material_index_buffer,
+                   &this->material_index_buffer_allocation);
+    this->p_texture_feedback = nullptr;
+    this->scene.free();
+}
+
+void App::free_acceleration_structures() {
     vkDestroyAccelerationStructureKHR(this->logical_device, this->tlas,
                                       nullptr);
-    vkDestroyBuffer(this->logical_device, this->tlas_buffer, nullptr);
-    vkFreeMemory(this->logical_device, this->tlas_buffer_memory, nullptr);
+    this->tlas = VK_NULL_HANDLE;
+    destroy_buffer(this->allocator, this->tlas_buffer,
+                   &this->tlas_buffer_allocation);
+    destroy_buffer(this->allocator, this->instance_buffer,
+                   &this->instance_buffer_allocation);
+    this->instances.free();
+    this->tlas_updates_since_build = 0;
+    this->does_tlas_need_rebuild = true;
+    this->are_instances_dirty = false;
+    this->tlas_scratch_pool.free(this->allocator);
+
+    for (uint32_t i = 0; i < this->blas_count; i++) {
+        vkDestroyAccelerationStructureKHR(this->logical_device,
+                                          this->p_blases[i].handle, nullptr);
+        destroy_buffer(this->allocator, this->p_blases[i].buffer,
+                       &this->p_blases[i].allocation);
+    }
+    delete[] this->p_blases;
+    this->p_blases = nullptr;
+    this->blas_count = 0;
+    this->scratch_pool.free(this->allocator);
+}
 
-    vkDestroyAccelerationStructureKHR(this->logical_device, this->blas,
-                                      nullptr);
-    vkDestroyBuffer(this->logical_device, this->blas_buffer, nullptr);
-    vkFreeMemory(this->logical_device, this->blas_buffer_memory, nullptr);
+void App::free() {
+    TRACE_ZONE("free");
+    if (this->is_cpu_tracing) {
+        this->cpu_tracer.print_stats();
+        this->cpu_tracer.free();
+        this->thread_pool.free();
+        this->scene.free();
+        return;
+    }
 
-    // Free mesh data.
-    vkDestroyBuffer(this->logical_device, this->vertex_position_buffer,
-                    nullptr);
-    vkFreeMemory(this->logical_device, this->vertex_position_buffer_memory,
-                 nullptr);
-    vkDestroyBuffer(this->logical_device, this->index_buffer, nullptr);
-    vkFreeMemory(this->logical_device, this->index_buffer_memory, nullptr);
-
-    // Free swapchain.
-    vkDestroyImageView(this->logical_device, this->storage_image.view, nullptr);
-    vkDestroyImage(this->logical_device, this->storage_image.image, nullptr);
-    vkFreeMemory(this->logical_device, this->storage_image.memory, nullptr);
-    delete swapchain_images;
+    this->uploader.free();
+
+    vkDeviceWaitIdle(this->logical_device);
+    this->profiler.resolve();
+    this->profiler.print_stats();
+    if (this->is_renderer_initialized) {
+        for (uint32_t i = 0; i < this->max_frames_in_flight; i++) {
+            this->collect_sampling_stats(i);
+        }
+        this->print_sampling_stats();
+    }
+    if (this->p_profile_csv_path != nullptr &&
+        !this->profiler.write_csv(this->p_profile_csv_path)) {
+        std::cout << "Failed to write " << this->p_profile_csv_path << ".\n";
+    }
+    this->profiler.free();
+
+    if (this->is_renderer_initialized) {
+        this->free_renderer();
+    }
+    this->free_scene();
 
     // Free other things.
     vkDestroyCommandPool(this->logical_device, this->cmd_pool, nullptr);
-    vkDestroySwapchainKHR(this->logical_device, this->swapchain, nullptr);
+    vkDestroyCommandPool(this->logical_device, this->compute_cmd_pool,
+                         nullptr);
+    vkDestroySemaphore(this->logical_device, this->build_timeline, nullptr);
+    if (!this->is_headless) {
+        this->release_retired_swapchains(UINT64_MAX, true);
+        delete[] swapchain_images;
+        vkDestroySwapchainKHR(this->logical_device, this->swapchain, nullptr);
+    }
+    this->allocator.print_stats();
+    this->allocator.free();
+    this->thread_pool.free();
     vkDestroyDevice(this->logical_device, nullptr);
 
-    vkDestroySurfaceKHR(this->instance, this->surface, nullptr);
+    if (!this->is_headless) {
+        vkDestroySurfaceKHR(this->instance, this->surface, nullptr);
+    }
     vkDestroyInstance(this->instance, nullptr);
-    glfwDestroyWindow(this->window);
-    glfwTerminate();
+    if (!this->is_headless) {
+        glfwDestroyWindow(this->window);
+        glfwTerminate();
+    }
+}
+
+void App::free_renderer() {
+    this->pipeline_cache.save();
+    this->pipeline_cache.free();
+    vkDestroyPipeline(this->logical_device, this->ray_trace_pipeline, nullptr);
+    vkDestroyPipeline(this->logical_device, this->sample_map_pipeline,
+                      nullptr);
+    vkDestroyPipelineLayout(this->logical_device,
+                            this->ray_trace_pipeline_layout, nullptr);
+    this->frame_descriptor_pools.free();
+    vkDestroyDescriptorUpdateTemplate(this->logical_device,
+                                      this->ray_trace_descriptor_template,
+                                      nullptr);
+    vkDestroyDescriptorPool(this->logical_device,
+                            this->material_descriptor_pool, nullptr);
+    this->descriptor_layouts.free();
+    delete[] this->p_material_descriptor_sets;
+    this->p_material_descriptor_sets = nullptr;
+    delete[] this->p_are_material_sets_stale;
+    this->p_are_material_sets_stale = nullptr;
+    vkDestroySampler(this->logical_device, this->texture_sampler, nullptr);
+    destroy_buffer(this->allocator, this->shader_binding_table_buffer,
+                   &this->shader_binding_table_buffer_allocation);
+    destroy_buffer(this->allocator, this->uniform_buffer,
+                   &this->uniform_buffer_allocation);
+    destroy_buffer(this->allocator, this->sampling_stats_buffer,
+                   &this->sampling_stats_buffer_allocation);
+    if (this->is_headless) {
+        destroy_buffer(this->allocator, this->readback_buffer,
+                       &this->readback_buffer_allocation);
+    }
+
+    if (!this->is_headless) {
+        this->frame_cmd_pools.free();
+        for (uint32_t i = 0; i < this->max_frames_in_flight; i++) {
+            vkDestroySemaphore(this->logical_device,
+                               this->image_available_semaphores[i], nullptr);
+            vkDestroyFence(this->logical_device, this->in_flight_fences[i],
+                           nullptr);
+        }
+        for (uint32_t i = 0; i < this->image_count; i++) {
+            vkDestroySemaphore(this->logical_device,
+                               this->render_finished_semaphores[i], nullptr);
+        }
+        delete[] this->image_available_semaphores;
+        delete[] this->in_flight_fences;
+        delete[] this->render_finished_semaphores;
+        delete[] this->images_in_flight;
+        delete[] this->p_input_times;
+        this->p_input_times = nullptr;
+        delete[] this->p_is_latency_pending;
+        this->p_is_latency_pending = nullptr;
+        delete[] this->p_present_ids;
+        this->p_present_ids = nullptr;
+        delete[] this->p_present_swapchains;
+        this->p_present_swapchains = nullptr;
+    }
+
+    StorageImage* images[] = {
+        &this->storage_image,
+        &this->accumulation_image,
+        &this->variance_image,
+        &this->sample_count_image,
+    };
+    for (StorageImage* p_image : images) {
+        vkDestroyImageView(this->logical_device, p_image->view, nullptr);
+        vkDestroyImage(this->logical_device, p_image->image, nullptr);
+        this->allocator.deallocate(p_image->allocation);
+    }
 }
@@ -0,0 +1,367 @@
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include "trace.hpp"
+
+namespace {
+
+struct Bounds {
+    float min[3] = {std::numeric_limits<float>::max(),
+                    std::numeric_limits<float>::max(),
+                    std::numeric_limits<float>::max()};
+    float max[3] = {std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest(),
+                    std::numeric_limits<float>::lowest()};
+
+    void grow(float const* p_min, float const* p_max) {
+        for (uint32_t j = 0; j < 3; j++) {
+            this->min[j] = std::min(this->min[j], p_min[j]);
+            this->max[j] = std::max(this->max[j], p_max[j]);
+        }
+    }
+
+    // Half of it, which is all that SAH ratios need.
+    auto half_area() const -> float {
+        float const x = this->max[0] - this->min[0];
+        float const y = this->max[1] - this->min[1];
+        float const z = this->max[2] - this->min[2];
+        return x < 0 ? 0 : x * y + y * z + z * x;
+    }
+};
+
+// Everything that building reads, indexed by triangle in scene order.
+struct BuildInput {
+    Scene const* p_scene;
+    // Where every mesh's triangles start, with the total at the end.
+    std::vector<uint32_t> first_triangles;
+    std::vector<BvhTriangle> triangles;
+    std::vector<float> bounds;     // Min and max, six floats per triangle.
+    std::vector<float> centroids;  // Three floats per triangle.
+    uint32_t thread_count;
+};
+
+void prepare_triangle_range(uint32_t thread_index, void* p_data) {
+    TRACE_ZONE("prepare_triangle_range");
+    BuildInput& input = *static_cast<BuildInput*>(p_data);
+    Scene const& scene = *input.p_scene;
+    uint32_t const triangle_count = input.first_triangles.back();
+    uint32_t const range_size =
+        (triangle_count + input.thread_count - 1) / input.thread_count;
+    uint32_t const begin = std::min(thread_index * range_size, triangle_count);
+    uint32_t const end = std::min(begin + range_size, triangle_count);
+
+    uint32_t mesh_index = static_cast<uint32_t>(
+        std::upper_bound(input.first_triangles.begin(),
+                         input.first_triangles.end(), begin) -
+        input.first_triangles.begin() - 1);
+    for (uint32_t i = begin; i < end; i++) {
+        while (i >= input.first_triangles[mesh_index + 1]) {
+            mesh_index++;
+        }
+        Mesh const& mesh = scene.p_meshes[mesh_index];
+        uint32_t const first_index =
+            mesh.first_index + 3 * (i - input.first_triangles[mesh_index]);
+
+        float positions[3][3];
+        BvhTriangle& triangle = input.triangles[i];
+        for (uint32_t k = 0; k < 3; k++) {
+            uint32_t const vertex =
+                mesh.first_vertex + scene.p_indices[first_index + k];
+            triangle.vertices[k] = vertex;
+            // Matches the SNORM decode of the BLAS build, which clamps -32768
+            // to -1.
+            for (uint32_t j = 0; j < 3; j++) {
+                float const q = std::max(
+                    static_cast<float>(
+                        scene.p_encoded_positions[4 * vertex + j]) /
+                        32767.0f,
+                    -1.0f);
+                positions[k][j] =
+                    mesh.position_scale[j] * q + mesh.position_offset[j];
+            }
+        }
+
+        float* p_bounds = &input.bounds[6 * i];
+        for (uint32_t j = 0; j < 3; j++) {
+            triangle.v0[j] = positions[0][j];
+            triangle.edge1[j] = positions[1][j] - positions[0][j];
+            triangle.edge2[j] = positions[2][j] - positions[0][j];
+            p_bounds[j] = std::min(
+                {positions[0][j], positions[1][j], positions[2][j]});
+            p_bounds[3 + j] = std::max(
+                {positions[0][j], positions[1][j], positions[2][j]});
+            input.centroids[3 * i + j] = 0.5f * (p_bounds[j] + p_bounds[3 + j]);
+        }
+    }
+}
+
+// A range of triangles below the top of the tree, left for a worker.
+struct Subtree {
+    uint32_t node_index;
+    uint32_t begin;
+    uint32_t end;
+    uint32_t depth;
+    std::vector<BvhNode> nodes;
+};
+
+struct Builder {
+    BuildInput const* p_input;
+    // Triangles in tree order, partitioned in place while splitting.
+    uint32_t* p_references;
+    // Ranges at most this large become subtrees, when they are collected.
+    uint32_t max_top_range_size;
+    std::vector<Subtree>* p_subtrees;
+
+    void build_node(std::vector<BvhNode>& nodes, uint32_t node_index,
+                    uint32_t begin, uint32_t end, uint32_t depth) const;
+};
+
+void Builder::build_node(std::vector<BvhNode>& nodes, uint32_t node_index,
+                         uint32_t begin, uint32_t end, uint32_t depth) const {
+    Bounds bounds;
+    Bounds centroid_bounds;
+    for (uint32_t i = begin; i < end; i++) {
+        uint32_t const triangle = this->p_references[i];
+        float const* p_bounds = &this->p_input->bounds[6 * triangle];
+        float const* p_centroid = &this->p_input->centroids[3 * triangle];
+        bounds.grow(p_bounds, p_bounds + 3);
+        centroid_bounds.grow(p_centroid, p_centroid);
+    }
+    BvhNode& node = nodes[node_index];
+    std::copy_n(bounds.min, 3, node.min);
+    std::copy_n(bounds.max, 3, node.max);
+    node.first = begin;
+    node.triangle_count = static_cast<uint16_t>(end - begin);
+    node.axis = 0;
+
+    uint32_t const count = end - begin;
+    if (this->p_subtrees != nullptr && count <= this->max_top_range_size) {
+        this->p_subtrees->push_back({
+            .node_index = node_index,
+            .begin = begin,
+            .end = end,
+            .depth = depth,
+        });
+        return;
+    }
+    if (count <= 2) {
+        return;
+    }
+    if (depth >= Bvh::max_depth) {
+        if (count <= Bvh::max_leaf_triangle_count) {
+            return;
+        }
+        // Halving keeps the tree within `max_overflow_depth` more levels.
+        uint32_t const middle = begin + count / 2;
+        auto const child_index = static_cast<uint32_t>(nodes.size());
+        nodes.resize(nodes.size() + 2);
+        nodes[node_index].first = child_index;
+        nodes[node_index].triangle_count = 0;
+        this->build_node(nodes, child_index, begin, middle, depth + 1);
+        this->build_node(nodes, child_index + 1, middle, end, depth + 1);
+        return;
+    }
+
+    // Bin centroids along every axis, and sweep each for the cheapest split.
+    struct Bin {
+        Bounds bounds;
+        uint32_t count = 0;
+    };
+    float best_cost = std::numeric_limits<float>::max();
+    uint32_t best_axis = 3;
+    uint32_t best_split = 0;
+    for (uint32_t axis = 0; axis < 3; axis++) {
+        float const extent =
+            centroid_bounds.max[axis] - centroid_bounds.min[axis];
+        if (extent <= 0) {
+            continue;
+        }
+        float const scale = static_cast<float>(Bvh::bin_count) / extent;
+        Bin bins[Bvh::bin_count];
+        for (uint32_t i = begin; i < end; i++) {
+            uint32_t const triangle = this->p_references[i];
+            uint32_t const bin = std::min(
+                static_cast<uint32_t>(
+                    (this->p_input->centroids[3 * triangle + axis] -
+                     centroid_bounds.min[axis]) *
+                    scale),
+                Bvh::bin_count - 1);
+            float const* p_bounds = &this->p_input->bounds[6 * triangle];
+            bins[bin].bounds.grow(p_bounds, p_bounds + 3);
+            bins[bin].count++;
+        }
+
+        float right_costs[Bvh::bin_count];
+        Bounds right_bounds;
+        uint32_t right_count = 0;
+        for (uint32_t i = Bvh::bin_count - 1; i > 0; i--) {
+            right_bounds.grow(bins[i].bounds.min, bins[i].bounds.max);
+            right_count += bins[i].count;
+            right_costs[i] =
+                static_cast<float>(right_count) * right_bounds.half_area();
+        }
+        Bounds left_bounds;
+        uint32_t left_count = 0;
+        for (uint32_t i = 0; i < Bvh::bin_count - 1; i++) {
+            left_bounds.grow(bins[i].bounds.min, bins[i].bounds.max);
+            left_count += bins[i].count;
+            if (left_count == 0 || left_count == count) {
+                continue;
+            }
+            float const cost =
+                static_cast<float>(left_count) * left_bounds.half_area() +
+                right_costs[i + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i + 1;
+            }
+        }
+    }
+
+    // Costs leave out the parent's area, which both sides would share.
+    float const leaf_cost = (static_cast<float>(count) - Bvh::traversal_cost) *
+                            bounds.half_area();
+    if ((best_axis == 3 || best_cost >= leaf_cost) &&
+        count <= Bvh::max_leaf_size) {
+        return;
+    }
+
+    uint32_t middle;
+    if (best_axis < 3) {
+        float const scale =
+            static_cast<float>(Bvh::bin_count) /
+            (centroid_bounds.max[best_axis] - centroid_bounds.min[best_axis]);
+        float const min = centroid_bounds.min[best_axis];
+        float const* p_centroids = this->p_input->centroids.data();
+        uint32_t const* p_middle = std::partition(
+            this->p_references + begin, this->p_references + end,
+            [=](uint32_t triangle) {
+                uint32_t const bin = std::min(
+                    static_cast<uint32_t>(
+                        (p_centroids[3 * triangle + best_axis] - min) * scale),
+                    Bvh::bin_count - 1);
+                return bin < best_split;
+            });
+        middle = static_cast<uint32_t>(p_middle - this->p_references);
+    } else {
+        // Every centroid is in the same place, but the leaf would be too
+        // large.
+        middle = begin + count / 2;
+        best_axis = 0;
+    }
+
+    auto const child_index = static_cast<uint32_t>(nodes.size());
+    nodes.resize(nodes.size() + 2);
+    nodes[node_index].first = child_index;
+    nodes[node_index].triangle_count = 0;
+    nodes[node_index].axis = static_cast<uint16_t>(best_axis);
+    this->build_node(nodes, child_index, begin, middle, depth + 1);
+    this->build_node(nodes, child_index + 1, middle, end, depth + 1);
+}
+
+struct SubtreeJob {
+    Builder const* p_builder;
+    std::vector<Subtree>* p_subtrees;
+    std::atomic<uint32_t> next_subtree;
+};
+
+void build_subtrees(uint32_t /*thread_index*/, void* p_data) {
+    TRACE_ZONE("build_subtrees");
+    SubtreeJob& job = *static_cast<SubtreeJob*>(p_data);
+    auto const subtree_count = static_cast<uint32_t>(job.p_subtrees->size());
+    // Subtrees are pulled one at a time, since their sizes vary a lot.
+    for (uint32_t i = job.next_subtree.fetch_add(1); i < subtree_count;
+         i = job.next_subtree.fetch_add(1)) {
+        Subtree& subtree = (*job.p_subtrees)[i];
+        subtree.nodes.resize(1);
+        job.p_builder->build_node(subtree.nodes, 0, subtree.begin,
+                                  subtree.end, subtree.depth);
+    }
+}
+
+}  // namespace
+
+void Bvh::build(Scene const& scene, ThreadPool& thread_pool) {
+    TRACE_ZONE("build_bvh");
+    BuildInput input = {
+        .p_scene = &scene,
+        .thread_count = thread_pool.thread_count,
+    };
+    input.first_triangles.resize(scene.mesh_count + 1);
+    input.first_triangles[0] = 0;
+    for (uint32_t i = 0; i < scene.mesh_count; i++) {
+        input.first_triangles[i + 1] =
+            input.first_triangles[i] + scene.p_meshes[i].triangle_count();
+    }
+    uint32_t const triangle_count = input.first_triangles.back();
+    this->nodes.clear();
+    this->triangles.clear();
+    if (triangle_count == 0) {
+        return;
+    }
+    input.triangles.resize(triangle_count);
+    input.bounds.resize(6 * static_cast<size_t>(triangle_count));
+    input.centroids.resize(3 * static_cast<size_t>(triangle_count));
+    thread_pool.run(input.thread_count, prepare_triangle_range, &input);
+
+    std::vector<uint32_t> references(triangle_count);
+    for (uint32_t i = 0; i < triangle_count; i++) {
+        references[i] = i;
+    }
+
+    // Split the top of the tree until there are several subtrees per
+    // thread, so that the workers stay busy however unbalanced they are.
+    std::vector<Subtree> subtrees;
+    Builder builder = {
+        .p_input = &input,
+        .p_references = references.data(),
+        .max_top_range_size =
+            std::max(triangle_count / (8 * input.thread_count), 1024u),
+        .p_subtrees = &subtrees,
+    };
+    this->nodes.resize(1);
+    {
+        TRACE_ZONE("build_top");
+        builder.build_node(this->nodes, 0, 0, triangle_count, 0);
+    }
+    builder.p_subtrees = nullptr;
+    SubtreeJob job = {
+        .p_builder = &builder,
+        .p_subtrees = &subtrees,
+        .next_subtree = 0,
+    };
+    thread_pool.run(
+        std::min(input.thread_count, static_cast<uint32_t>(subtrees.size())),
+        build_subtrees, &job);
+
+    // Graft every subtree in place of the node it started from. Their other
+    // nodes are appended, and their children renumbered to match.
+    for (Subtree const& subtree : subtrees) {
+        auto const offset = static_cast<uint32_t>(this->nodes.size()) - 1;
+        for (size_t i = 0; i < subtree.nodes.size(); i++) {
+            BvhNode node = subtree.nodes[i];
+            if (!node.is_leaf()) {
+                node.first += offset;
+            }
+            if (i == 0) {
+                this->nodes[subtree.node_index] = node;
+            } else {
+                this->nodes.push_back(node);
+            }
+        }
+    }
+
+    this->triangles.resize(triangle_count);
+    for (uint32_t i = 0; i < triangle_count; i++) {
+        this->triangles[i] = input.triangles[references[i]];
+    }
+}
+
+void Bvh::free() {
+    this->nodes = {};
+    this->triangles = {};
+}
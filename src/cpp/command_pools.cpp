@@ -0,0 +1,73 @@
+#include "command_pools.hpp"
+
+#include <new>
+#include <vulkan/vulkan_core.h>
+
+void FrameCommandPools::initialize(VkDevice& logical_device,
+                                   uint32_t queue_family_index,
+                                   uint32_t frame_count,
+                                   uint32_t thread_count) {
+    this->logical_device = logical_device;
+    this->frame_count = frame_count;
+    this->thread_count = thread_count;
+    this->p_pools = new (std::nothrow) Pool[frame_count * thread_count];
+
+    VkCommandPoolCreateInfo command_pool_create_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+        .queueFamilyIndex = queue_family_index,
+    };
+    for (uint32_t i = 0; i < frame_count * thread_count; i++) {
+        if (vkCreateCommandPool(this->logical_device,
+                                &command_pool_create_info, nullptr,
+                                &this->p_pools[i].cmd_pool) != VK_SUCCESS) {
+            stx::panic("Failed to create a frame command pool!");
+        }
+    }
+}
+
+void FrameCommandPools::reset(uint32_t frame_index) {
+    for (uint32_t i = 0; i < this->thread_count; i++) {
+        Pool& pool = this->p_pools[frame_index * this->thread_count + i];
+        if (pool.used_count == 0) {
+            continue;
+        }
+        vkResetCommandPool(this->logical_device, pool.cmd_pool, 0);
+        pool.used_count = 0;
+    }
+}
+
+auto FrameCommandPools::allocate(uint32_t frame_index, uint32_t thread_index)
+    -> VkCommandBuffer {
+    Pool& pool = this->p_pools[frame_index * this->thread_count + thread_index];
+    if (pool.used_count == pool.allocated_count) {
+        if (pool.allocated_count == max_cmd_buffers_per_pool) {
+            stx::panic("Ran out of frame command buffers!");
+        }
+        VkCommandBufferAllocateInfo buffer_allocate_info = {
+            .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+            .commandPool = pool.cmd_pool,
+            .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+            .commandBufferCount = 1,
+        };
+        if (vkAllocateCommandBuffers(
+                this->logical_device, &buffer_allocate_info,
+                &pool.cmd_buffers[pool.allocated_count]) != VK_SUCCESS) {
+            stx::panic("Failed to allocate a frame command buffer!");
+        }
+        pool.allocated_count++;
+    }
+    return pool.cmd_buffers[pool.used_count++];
+}
+
+void FrameCommandPools::free() {
+    // Destroying a pool frees its command buffers along with it.
+    for (uint32_t i = 0; i < this->frame_count * this->thread_count; i++) {
+        vkDestroyCommandPool(this->logical_device, this->p_pools[i].cmd_pool,
+                             nullptr);
+    }
+    delete[] this->p_pools;
+    this->p_pools = nullptr;
+    this->frame_count = 0;
+    this->thread_count = 0;
+}
@@ -0,0 +1,437 @@
+#include "cpu_tracer.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <new>
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+#include "trace.hpp"
+
+namespace {
+
+// Eight lanes, which are one AVX register each when compiled for it, and
+// pairs of SSE registers otherwise.
+using Float8 = float __attribute__((vector_size(32)));
+using Int8 = int32_t __attribute__((vector_size(32)));
+
+constexpr uint32_t lane_count = 8;
+constexpr uint32_t packet_width = 4;
+constexpr uint32_t packet_height = 2;
+// The ray interval of the ray generation shader.
+constexpr float t_min = 0.001f;
+constexpr float t_max = 10000.0f;
+
+inline auto any(Int8 const& mask) -> bool {
+#if defined(__AVX__)
+    return _mm256_movemask_ps(reinterpret_cast<__m256>(mask)) != 0;
+#else
+    int32_t bits = 0;
+    for (uint32_t i = 0; i < lane_count; i++) {
+        bits |= mask[i];
+    }
+    return bits != 0;
+#endif
+}
+
+struct Packet {
+    Float8 origin[3];
+    Float8 direction[3];
+    Float8 inverse_direction[3];
+    Float8 t_max;
+    // Barycentrics of the closest hit, as `hitAttributeEXT` has them.
+    Float8 u;
+    Float8 v;
+    // -1 for lanes that missed.
+    Int8 triangle;
+};
+
+// Whether any lane enters the box before its closest hit so far.
+inline auto hits_box(BvhNode const& node, Packet const& packet) -> bool {
+    Float8 t_near = Float8{} + t_min;
+    Float8 t_far = packet.t_max;
+    for (uint32_t j = 0; j < 3; j++) {
+        Float8 const t0 =
+            (node.min[j] - packet.origin[j]) * packet.inverse_direction[j];
+        Float8 const t1 =
+            (node.max[j] - packet.origin[j]) * packet.inverse_direction[j];
+        Float8 const t_entry = t0 < t1 ? t0 : t1;
+        Float8 const t_exit = t0 < t1 ? t1 : t0;
+        t_near = t_entry > t_near ? t_entry : t_near;
+        t_far = t_exit < t_far ? t_exit : t_far;
+    }
+    return any(t_near <= t_far);
+}
+
+// Möller-Trumbore, keeping the closer hit per lane.
+inline void intersect_triangle(BvhTriangle const& triangle,
+                               uint32_t triangle_index, Packet& packet) {
+    Float8 const* d = packet.direction;
+    float const* e1 = triangle.edge1;
+    float const* e2 = triangle.edge2;
+    Float8 const p[3] = {
+        d[1] * e2[2] - d[2] * e2[1],
+        d[2] * e2[0] - d[0] * e2[2],
+        d[0] * e2[1] - d[1] * e2[0],
+    };
+    Float8 const det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    // Parallel lanes divide by one instead, and are masked out below.
+    Int8 const is_valid = det != 0;
+    Float8 const inverse_det = 1.0f / (is_valid ? det : Float8{} + 1.0f);
+
+    Float8 const s[3] = {
+        packet.origin[0] - triangle.v0[0],
+        packet.origin[1] - triangle.v0[1],
+        packet.origin[2] - triangle.v0[2],
+    };
+    Float8 const u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inverse_det;
+    Float8 const q[3] = {
+        s[1] * e1[2] - s[2] * e1[1],
+        s[2] * e1[0] - s[0] * e1[2],
+        s[0] * e1[1] - s[1] * e1[0],
+    };
+    Float8 const v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * inverse_det;
+    Float8 const t =
+        (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inverse_det;
+
+    Int8 const is_hit = is_valid & (u >= 0) & (v >= 0) & (u + v <= 1) &
+                        (t > t_min) & (t < packet.t_max);
+    if (!any(is_hit)) {
+        return;
+    }
+    packet.t_max = is_hit ? t : packet.t_max;
+    packet.u = is_hit ? u : packet.u;
+    packet.v = is_hit ? v : packet.v;
+    packet.triangle = is_hit ? Int8{} + static_cast<int32_t>(triangle_index)
+                             : packet.triangle;
+}
+
+void intersect_packet(Bvh const& bvh, Packet& packet) {
+    if (bvh.nodes.empty()) {
+        return;
+    }
+    // Every level leaves at most one sibling behind.
+    uint32_t stack[Bvh::max_stack_size];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        BvhNode const& node = bvh.nodes[stack[--stack_size]];
+        if (!hits_box(node, packet)) {
+            continue;
+        }
+        if (node.is_leaf()) {
+            for (uint32_t i = node.first; i < node.first + node.triangle_count;
+                 i++) {
+                intersect_triangle(bvh.triangles[i], i, packet);
+            }
+            continue;
+        }
+        // Primary rays are coherent, so the first lane decides which child
+        // is nearer for all of them.
+        uint32_t const near_child =
+            packet.direction[node.axis][0] < 0 ? 1 : 0;
+        stack[stack_size++] = node.first + (1 - near_child);
+        stack[stack_size++] = node.first + near_child;
+    }
+}
+
+// The PCG hash of the ray generation shader.
+inline auto hash(uint32_t value) -> uint32_t {
+    uint32_t const state = value * 747796405u + 2891336453u;
+    uint32_t const word =
+        ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+inline auto random(uint32_t& state) -> float {
+    state = hash(state);
+    return static_cast<float>(state) / 4294967296.0f;
+}
+
+// What the miss and closest hit shaders write into the payload.
+void shade(CpuTracer const& tracer, Packet const& packet, uint32_t lane,
+           float* p_color) {
+    float const direction[3] = {packet.direction[0][lane],
+                                packet.direction[1][lane],
+                                packet.direction[2][lane]};
+    int32_t const triangle_index = packet.triangle[lane];
+    if (triangle_index < 0) {
+        float const t = 0.5f * (direction[1] + 1.0f);
+        p_color[0] = 1.0f + t * (0.5f - 1.0f);
+        p_color[1] = 1.0f + t * (0.7f - 1.0f);
+        p_color[2] = 1.0f;
+        return;
+    }
+
+    BvhTriangle const& triangle = tracer.bvh.triangles[triangle_index];
+    float const u = packet.u[lane];
+    float const v = packet.v[lane];
+    float const weights[3] = {1.0f - u - v, u, v};
+    float normal[3] = {0, 0, 0};
+    for (uint32_t k = 0; k < 3; k++) {
+        float const* p_normal =
+            &tracer.p_scene->p_normals[3 * triangle.vertices[k]];
+        for (uint32_t j = 0; j < 3; j++) {
+            normal[j] += weights[k] * p_normal[j];
+        }
+    }
+    // OBJs without normals store zeroes, so fall back to the face normal.
+    if (normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2] <
+        1e-12f) {
+        float const* e1 = triangle.edge1;
+        float const* e2 = triangle.edge2;
+        normal[0] = e1[1] * e2[2] - e1[2] * e2[1];
+        normal[1] = e1[2] * e2[0] - e1[0] * e2[2];
+        normal[2] = e1[0] * e2[1] - e1[1] * e2[0];
+    }
+    float const length = std::sqrt(normal[0] * normal[0] +
+                                   normal[1] * normal[1] +
+                                   normal[2] * normal[2]);
+    float sign = length > 0 ? 1.0f / length : 0.0f;
+    if (normal[0] * direction[0] + normal[1] * direction[1] +
+            normal[2] * direction[2] >
+        0) {
+        sign = -sign;
+    }
+
+    float const light_length = std::sqrt(0.4f * 0.4f + 1.0f + 0.6f * 0.6f);
+    float const diffuse = std::max(
+        sign * (0.4f * normal[0] + normal[1] + 0.6f * normal[2]) /
+            light_length,
+        0.0f);
+    float const color = 0.8f * (0.15f + 0.85f * diffuse);
+    p_color[0] = color;
+    p_color[1] = color;
+    p_color[2] = color;
+}
+
+// Each thread starts on its own run of tiles, which keeps neighbouring
+// tiles on the same core, and then steals from the others' runs.
+struct alignas(64) TileRun {
+    std::atomic<uint32_t> next;
+    uint32_t end;
+};
+
+struct TraceJob {
+    CpuTracer* p_tracer;
+    uint32_t frame_number;
+    uint32_t sample_count;
+    bool should_reset;
+    uint32_t tiles_per_row;
+    TileRun* p_runs;
+    uint32_t thread_count;
+};
+
+void trace_tile(TraceJob const& job, uint32_t tile) {
+    CpuTracer& tracer = *job.p_tracer;
+    uint32_t const width = tracer.width;
+    uint32_t const height = tracer.height;
+    uint32_t const tile_x = (tile % job.tiles_per_row) * CpuTracer::tile_size;
+    uint32_t const tile_y = (tile / job.tiles_per_row) * CpuTracer::tile_size;
+    uint32_t const frame_hash = hash(job.frame_number);
+
+    for (uint32_t block_y = tile_y;
+         block_y < std::min(tile_y + CpuTracer::tile_size, height);
+         block_y += packet_height) {
+        for (uint32_t block_x = tile_x;
+             block_x < std::min(tile_x + CpuTracer::tile_size, width);
+             block_x += packet_width) {
+            // Lanes past the edge of the image repeat its last pixel, and
+            // are not written.
+            uint32_t xs[lane_count];
+            uint32_t ys[lane_count];
+            bool is_inside[lane_count];
+            uint32_t states[lane_count];
+            float accumulations[lane_count][4];
+            for (uint32_t lane = 0; lane < lane_count; lane++) {
+                uint32_t const x = block_x + lane % packet_width;
+                uint32_t const y = block_y + lane / packet_width;
+                is_inside[lane] = x < width && y < height;
+                xs[lane] = std::min(x, width - 1);
+                ys[lane] = std::min(y, height - 1);
+                uint32_t const pixel = ys[lane] * width + xs[lane];
+                states[lane] = hash(pixel) ^ frame_hash;
+                for (uint32_t c = 0; c < 4; c++) {
+                    accumulations[lane][c] =
+                        job.should_reset
+                            ? 0.0f
+                            : tracer.p_accumulation[4 * pixel + c];
+                }
+            }
+
+            for (uint32_t sample = 0; sample < job.sample_count; sample++) {
+                Packet packet;
+                for (uint32_t lane = 0; lane < lane_count; lane++) {
+                    float const jitter_x = random(states[lane]);
+                    float const jitter_y = random(states[lane]);
+                    float const u =
+                        (static_cast<float>(xs[lane]) + jitter_x) /
+                        static_cast<float>(width);
+                    float const v =
+                        (static_cast<float>(ys[lane]) + jitter_y) /
+                        static_cast<float>(height);
+                    // Image rows go down, while the camera's vertical axis
+                    // goes up.
+                    float direction[3];
+                    for (uint32_t j = 0; j < 3; j++) {
+                        direction[j] = tracer.lower_left[j] +
+                                       u * tracer.horizontal[j] +
+                                       (1.0f - v) * tracer.vertical[j] -
+                                       tracer.origin[j];
+                    }
+                    float const inverse_length =
+                        1.0f / std::sqrt(direction[0] * direction[0] +
+                                         direction[1] * direction[1] +
+                                         direction[2] * direction[2]);
+                    for (uint32_t j = 0; j < 3; j++) {
+                        float const d = direction[j] * inverse_length;
+                        packet.origin[j][lane] = tracer.origin[j];
+                        packet.direction[j][lane] = d;
+                        // Keeps slabs finite along axis-aligned rays.
+                        packet.inverse_direction[j][lane] =
+                            1.0f / (std::fabs(d) > 1e-20f
+                                        ? d
+                                        : std::copysign(1e-20f, d));
+                    }
+                }
+                packet.t_max = Float8{} + t_max;
+                packet.u = Float8{};
+                packet.v = Float8{};
+                packet.triangle = Int8{} - 1;
+                intersect_packet(tracer.bvh, packet);
+
+                for (uint32_t lane = 0; lane < lane_count; lane++) {
+                    float color[3];
+                    shade(tracer, packet, lane, color);
+                    float* p_accumulation = accumulations[lane];
+                    p_accumulation[3] += 1.0f;
+                    for (uint32_t c = 0; c < 3; c++) {
+                        p_accumulation[c] += (color[c] - p_accumulation[c]) /
+                                             p_accumulation[3];
+                    }
+                }
+            }
+
+            for (uint32_t lane = 0; lane < lane_count; lane++) {
+                if (!is_inside[lane]) {
+                    continue;
+                }
+                uint32_t const pixel = ys[lane] * width + xs[lane];
+                for (uint32_t c = 0; c < 4; c++) {
+                    tracer.p_accumulation[4 * pixel + c] =
+                        accumulations[lane][c];
+                }
+                // Stored the way an RGBA8 UNORM image is.
+                for (uint32_t c = 0; c < 3; c++) {
+                    tracer.p_pixels[4 * pixel + c] = static_cast<uint8_t>(
+                        std::clamp(accumulations[lane][c], 0.0f, 1.0f) *
+                            255.0f +
+                        0.5f);
+                }
+                tracer.p_pixels[4 * pixel + 3] = 255;
+            }
+        }
+    }
+}
+
+void trace_tiles(uint32_t thread_index, void* p_data) {
+    TRACE_ZONE("trace_tiles");
+    TraceJob const& job = *static_cast<TraceJob*>(p_data);
+    for (uint32_t i = 0; i < job.thread_count; i++) {
+        TileRun& run = job.p_runs[(thread_index + i) % job.thread_count];
+        for (uint32_t tile = run.next.fetch_add(1); tile < run.end;
+             tile = run.next.fetch_add(1)) {
+            trace_tile(job, tile);
+        }
+    }
+}
+
+}  // namespace
+
+void CpuTracer::initialize(Scene const& scene, ThreadPool& thread_pool,
+                           uint32_t width, uint32_t height) {
+    TRACE_ZONE("initialize_cpu_tracer");
+    this->p_scene = &scene;
+    this->p_thread_pool = &thread_pool;
+    this->width = width;
+    this->height = height;
+    this->p_accumulation = new (std::nothrow) float[4 * width * height];
+    this->p_pixels = new (std::nothrow) uint8_t[4 * width * height];
+
+    auto const build_begin = std::chrono::steady_clock::now();
+    this->bvh.build(scene, thread_pool);
+    std::chrono::duration<double, std::milli> const build_time =
+        std::chrono::steady_clock::now() - build_begin;
+    std::cout << "Built a BVH of " << this->bvh.nodes.size()
+              << " nodes over " << this->bvh.triangles.size()
+              << " triangles on " << thread_pool.thread_count
+              << " threads in " << build_time.count() << " ms.\n";
+}
+
+void CpuTracer::set_camera(float const* p_origin, float const* p_lower_left,
+                           float const* p_horizontal,
+                           float const* p_vertical) {
+    std::copy_n(p_origin, 3, this->origin);
+    std::copy_n(p_lower_left, 3, this->lower_left);
+    std::copy_n(p_horizontal, 3, this->horizontal);
+    std::copy_n(p_vertical, 3, this->vertical);
+}
+
+void CpuTracer::trace_frame(uint32_t frame_number, uint32_t sample_count,
+                            bool should_reset) {
+    TRACE_ZONE("trace_frame");
+    auto const trace_begin = std::chrono::steady_clock::now();
+
+    uint32_t const tiles_per_row =
+        (this->width + CpuTracer::tile_size - 1) / CpuTracer::tile_size;
+    uint32_t const tile_count =
+        tiles_per_row *
+        ((this->height + CpuTracer::tile_size - 1) / CpuTracer::tile_size);
+    uint32_t const thread_count =
+        std::min(this->p_thread_pool->thread_count, tile_count);
+    TileRun* p_runs = new (std::nothrow) TileRun[thread_count];
+    for (uint32_t i = 0; i < thread_count; i++) {
+        p_runs[i].next = i * tile_count / thread_count;
+        p_runs[i].end = (i + 1) * tile_count / thread_count;
+    }
+    TraceJob job = {
+        .p_tracer = this,
+        .frame_number = frame_number,
+        .sample_count = sample_count,
+        .should_reset = should_reset,
+        .tiles_per_row = tiles_per_row,
+        .p_runs = p_runs,
+        .thread_count = thread_count,
+    };
+    this->p_thread_pool->run(thread_count, trace_tiles, &job);
+    delete[] p_runs;
+
+    std::chrono::duration<double, std::milli> const trace_time =
+        std::chrono::steady_clock::now() - trace_begin;
+    this->trace_ms += trace_time.count();
+    this->rays_traced += static_cast<uint64_t>(this->width) * this->height *
+                         sample_count;
+}
+
+void CpuTracer::print_stats() const {
+    std::cout << "Traced " << this->rays_traced << " rays on the CPU";
+    if (this->trace_ms > 0) {
+        std::cout << ", "
+                  << static_cast<double>(this->rays_traced) / this->trace_ms /
+                         1e3
+                  << " Mrays/s";
+    }
+    std::cout << ".\n";
+}
+
+void CpuTracer::free() {
+    this->bvh.free();
+    delete[] this->p_accumulation;
+    delete[] this->p_pixels;
+    this->p_accumulation = nullptr;
+    this->p_pixels = nullptr;
+}
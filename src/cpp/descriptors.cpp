@@ -0,0 +1,202 @@
+#include "descriptors.hpp"
+
+#include <algorithm>
+#include <new>
+#include <vulkan/vulkan_core.h>
+
+#include "trace.hpp"
+
+void DescriptorLayoutCache::initialize(VkDevice& logical_device) {
+    this->logical_device = logical_device;
+}
+
+auto DescriptorLayoutCache::get(VkDescriptorSetLayoutBinding const* p_bindings,
+                                uint32_t binding_count,
+                                VkDescriptorBindingFlags const* p_binding_flags,
+                                VkDescriptorSetLayoutCreateFlags flags)
+    -> VkDescriptorSetLayout {
+    Layout key = {.flags = flags};
+    key.bindings.resize(binding_count);
+    key.binding_flags.resize(binding_count);
+    // Sort the bindings, and their flags along with them, so that the order
+    // they were listed in does not matter.
+    std::vector<uint32_t> order(binding_count);
+    for (uint32_t i = 0; i < binding_count; i++) {
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return p_bindings[a].binding < p_bindings[b].binding;
+    });
+    for (uint32_t i = 0; i < binding_count; i++) {
+        key.bindings[i] = p_bindings[order[i]];
+        key.binding_flags[i] =
+            p_binding_flags != nullptr ? p_binding_flags[order[i]] : 0;
+        if (key.bindings[i].pImmutableSamplers != nullptr) {
+            stx::panic("Cached layouts can not have immutable samplers!");
+        }
+    }
+
+    uint64_t hash = flags;
+    for (uint32_t i = 0; i < binding_count; i++) {
+        VkDescriptorSetLayoutBinding const& binding = key.bindings[i];
+        uint64_t const words[5] = {
+            binding.binding,
+            static_cast<uint64_t>(binding.descriptorType),
+            binding.descriptorCount,
+            binding.stageFlags,
+            key.binding_flags[i],
+        };
+        for (uint64_t word : words) {
+            hash = hash * 0x9E3779B97F4A7C15ull ^ word;
+        }
+    }
+    key.hash = hash;
+
+    for (Layout const& layout : this->layouts) {
+        if (layout.hash != key.hash || layout.flags != key.flags ||
+            layout.bindings.size() != key.bindings.size() ||
+            layout.binding_flags != key.binding_flags) {
+            continue;
+        }
+        bool const are_bindings_equal = std::equal(
+            layout.bindings.begin(), layout.bindings.end(),
+            key.bindings.begin(),
+            [](VkDescriptorSetLayoutBinding const& a,
+               VkDescriptorSetLayoutBinding const& b) {
+                return a.binding == b.binding &&
+                       a.descriptorType == b.descriptorType &&
+                       a.descriptorCount == b.descriptorCount &&
+                       a.stageFlags == b.stageFlags;
+            });
+        if (are_bindings_equal) {
+            return layout.layout;
+        }
+    }
+
+    TRACE_ZONE("create_descriptor_set_layout");
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_create_info = {
+        .sType =
+            VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO,
+        .bindingCount = binding_count,
+        .pBindingFlags = key.binding_flags.data(),
+    };
+    VkDescriptorSetLayoutCreateInfo descriptor_set_layout_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .pNext =
+            p_binding_flags != nullptr ? &binding_flags_create_info : nullptr,
+        .flags = flags,
+        .bindingCount = binding_count,
+        .pBindings = key.bindings.data(),
+    };
+    if (vkCreateDescriptorSetLayout(this->logical_device,
+                                    &descriptor_set_layout_create_info, nullptr,
+                                    &key.layout) != VK_SUCCESS) {
+        stx::panic("Failed to create a descriptor set layout!");
+    }
+    this->layouts.push_back(std::move(key));
+    return this->layouts.back().layout;
+}
+
+void DescriptorLayoutCache::free() {
+    for (Layout const& layout : this->layouts) {
+        vkDestroyDescriptorSetLayout(this->logical_device, layout.layout,
+                                     nullptr);
+    }
+    this->layouts = {};
+}
+
+void FrameDescriptorPools::initialize(
+    VkDevice& logical_device, uint32_t frame_count,
+    VkDescriptorPoolSize const* p_sizes_per_set, uint32_t size_count) {
+    this->logical_device = logical_device;
+    this->frame_count = frame_count;
+    this->sizes_per_set.assign(p_sizes_per_set, p_sizes_per_set + size_count);
+    this->p_frames = new (std::nothrow) Frame[frame_count];
+}
+
+void FrameDescriptorPools::reset(uint32_t frame_index) {
+    Frame& frame = this->p_frames[frame_index];
+    if (frame.current_pool == 0 && frame.current_pool_set_count == 0) {
+        return;
+    }
+    for (uint32_t i = 0; i <= frame.current_pool; i++) {
+        vkResetDescriptorPool(this->logical_device, frame.pools[i], 0);
+    }
+    frame.current_pool = 0;
+    frame.current_pool_set_count = 0;
+}
+
+auto FrameDescriptorPools::allocate(uint32_t frame_index,
+                                    VkDescriptorSetLayout layout)
+    -> VkDescriptorSet {
+    Frame& frame = this->p_frames[frame_index];
+    while (true) {
+        if (frame.current_pool == frame.pools.size()) {
+            uint32_t const doubling_count = std::min(frame.current_pool, 7u);
+            uint32_t const set_count = std::min(
+                first_pool_set_count << doubling_count, max_pool_set_count);
+            frame.pools.push_back(this->create_pool(set_count));
+        }
+
+        VkDescriptorSetAllocateInfo descriptor_set_allocate_info = {
+            .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool = frame.pools[frame.current_pool],
+            .descriptorSetCount = 1,
+            .pSetLayouts = &layout,
+        };
+        VkDescriptorSet descriptor_set;
+        VkResult const result =
+            vkAllocateDescriptorSets(this->logical_device,
+                                     &descriptor_set_allocate_info,
+                                     &descriptor_set);
+        if (result == VK_SUCCESS) {
+            frame.current_pool_set_count++;
+            return descriptor_set;
+        }
+        // Only running out is worth another pool, and only if this one had
+        // room for anything at all.
+        if ((result != VK_ERROR_OUT_OF_POOL_MEMORY &&
+             result != VK_ERROR_FRAGMENTED_POOL) ||
+            frame.current_pool_set_count == 0) {
+            stx::panic("Failed to allocate a descriptor set!");
+        }
+        frame.current_pool++;
+        frame.current_pool_set_count = 0;
+    }
+}
+
+auto FrameDescriptorPools::create_pool(uint32_t set_count)
+    -> VkDescriptorPool {
+    TRACE_ZONE("create_descriptor_pool");
+    std::vector<VkDescriptorPoolSize> pool_sizes = this->sizes_per_set;
+    for (VkDescriptorPoolSize& pool_size : pool_sizes) {
+        pool_size.descriptorCount *= set_count;
+    }
+    VkDescriptorPoolCreateInfo descriptor_pool_create_info = {
+        .sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+        .maxSets = set_count,
+        .poolSizeCount = static_cast<uint32_t>(pool_sizes.size()),
+        .pPoolSizes = pool_sizes.data(),
+    };
+    VkDescriptorPool pool;
+    if (vkCreateDescriptorPool(this->logical_device,
+                               &descriptor_pool_create_info, nullptr,
+                               &pool) != VK_SUCCESS) {
+        stx::panic("Failed to create a descriptor pool!");
+    }
+    this->pool_count++;
+    return pool;
+}
+
+void FrameDescriptorPools::free() {
+    // Destroying a pool frees its sets along with it.
+    for (uint32_t i = 0; i < this->frame_count; i++) {
+        for (VkDescriptorPool pool : this->p_frames[i].pools) {
+            vkDestroyDescriptorPool(this->logical_device, pool, nullptr);
+        }
+    }
+    delete[] this->p_frames;
+    this->p_frames = nullptr;
+    this->frame_count = 0;
+    this->pool_count = 0;
+}
@@ -0,0 +1,183 @@
+#include "instance_table.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+namespace {
+
+// The vectorized path writes the last 16 bytes of an instance in one store.
+static_assert(sizeof(VkAccelerationStructureInstanceKHR) ==
+              sizeof(VkTransformMatrixKHR) + 16);
+
+template <typename T>
+void grow(T*& p_array, uint32_t count, uint32_t capacity) {
+    T* p_new_array = new (std::nothrow) T[capacity];
+    if (p_array != nullptr) {
+        std::copy_n(p_array, count, p_new_array);
+        delete[] p_array;
+    }
+    p_array = p_new_array;
+}
+
+}  // namespace
+
+void InstanceTable::reserve(uint32_t capacity) {
+    if (capacity <= this->capacity) {
+        return;
+    }
+    for (float*& p_element : this->p_transforms) {
+        grow(p_element, this->count, capacity);
+    }
+    grow(this->p_custom_indices, this->count, capacity);
+    grow(this->p_sbt_offsets, this->count, capacity);
+    grow(this->p_masks, this->count, capacity);
+    grow(this->p_flags, this->count, capacity);
+    grow(this->p_blas_addresses, this->count, capacity);
+    this->capacity = capacity;
+}
+
+auto InstanceTable::add(VkTransformMatrixKHR const& transform,
+                        uint32_t custom_index, uint8_t mask,
+                        uint32_t sbt_offset, uint8_t flags,
+                        uint64_t blas_address) -> uint32_t {
+    uint32_t const index = this->count++;
+    this->set_transform(index, transform);
+    this->p_custom_indices[index] = custom_index & 0xFFFFFF;
+    this->p_sbt_offsets[index] = sbt_offset & 0xFFFFFF;
+    this->p_masks[index] = mask;
+    this->p_flags[index] = flags;
+    this->p_blas_addresses[index] = blas_address;
+    return index;
+}
+
+void InstanceTable::remove(uint32_t index) {
+    uint32_t const last = --this->count;
+    for (float* p_element : this->p_transforms) {
+        p_element[index] = p_element[last];
+    }
+    this->p_custom_indices[index] = this->p_custom_indices[last];
+    this->p_sbt_offsets[index] = this->p_sbt_offsets[last];
+    this->p_masks[index] = this->p_masks[last];
+    this->p_flags[index] = this->p_flags[last];
+    this->p_blas_addresses[index] = this->p_blas_addresses[last];
+}
+
+auto InstanceTable::get_transform(uint32_t index) const
+    -> VkTransformMatrixKHR {
+    VkTransformMatrixKHR transform;
+    for (uint32_t i = 0; i < 12; i++) {
+        transform.matrix[i / 4][i % 4] = this->p_transforms[i][index];
+    }
+    return transform;
+}
+
+void InstanceTable::set_transform(uint32_t index,
+                                  VkTransformMatrixKHR const& transform) {
+    for (uint32_t i = 0; i < 12; i++) {
+        this->p_transforms[i][index] = transform.matrix[i / 4][i % 4];
+    }
+}
+
+void InstanceTable::write(
+    uint32_t begin, uint32_t end,
+    VkAccelerationStructureInstanceKHR* p_instances) const {
+    uint32_t i = begin;
+#if defined(__SSE2__)
+    __m128i const low_24_bits = _mm_set1_epi32(0xFFFFFF);
+    __m128i const zero = _mm_setzero_si128();
+    for (; i + 4 <= end; i += 4) {
+        // Each row of four instances' matrices is a 4x4 transpose away from
+        // the table's layout.
+        __m128 rows[3][4];
+        for (uint32_t row = 0; row < 3; row++) {
+            for (uint32_t column = 0; column < 4; column++) {
+                rows[row][column] =
+                    _mm_loadu_ps(this->p_transforms[4 * row + column] + i);
+            }
+            _MM_TRANSPOSE4_PS(rows[row][0], rows[row][1], rows[row][2],
+                              rows[row][3]);
+        }
+
+        // Widen four bytes at a time, and pack them above the 24-bit fields.
+        int32_t masks;
+        int32_t flags;
+        std::memcpy(&masks, this->p_masks + i, sizeof(masks));
+        std::memcpy(&flags, this->p_flags + i, sizeof(flags));
+        __m128i const wide_masks = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(masks), zero), zero);
+        __m128i const wide_flags = _mm_unpacklo_epi16(
+            _mm_unpacklo_epi8(_mm_cvtsi32_si128(flags), zero), zero);
+        __m128i const custom_words = _mm_or_si128(
+            _mm_and_si128(
+                _mm_loadu_si128(reinterpret_cast<__m128i const*>(
+                    this->p_custom_indices + i)),
+                low_24_bits),
+            _mm_slli_epi32(wide_masks, 24));
+        __m128i const sbt_words = _mm_or_si128(
+            _mm_and_si128(_mm_loadu_si128(reinterpret_cast<__m128i const*>(
+                              this->p_sbt_offsets + i)),
+                          low_24_bits),
+            _mm_slli_epi32(wide_flags, 24));
+        __m128i const words_01 = _mm_unpacklo_epi32(custom_words, sbt_words);
+        __m128i const words_23 = _mm_unpackhi_epi32(custom_words, sbt_words);
+        __m128i const addresses_01 = _mm_loadu_si128(
+            reinterpret_cast<__m128i const*>(this->p_blas_addresses + i));
+        __m128i const addresses_23 = _mm_loadu_si128(
+            reinterpret_cast<__m128i const*>(this->p_blas_addresses + i + 2));
+        __m128i const tails[4] = {
+            _mm_unpacklo_epi64(words_01, addresses_01),
+            _mm_unpackhi_epi64(words_01, addresses_01),
+            _mm_unpacklo_epi64(words_23, addresses_23),
+            _mm_unpackhi_epi64(words_23, addresses_23),
+        };
+
+        // Whole instances in order, so that write-combining sees full lines.
+        for (uint32_t j = 0; j < 4; j++) {
+            VkAccelerationStructureInstanceKHR* p_instance =
+                p_instances + (i + j - begin);
+            for (uint32_t row = 0; row < 3; row++) {
+                _mm_storeu_ps(p_instance->transform.matrix[row], rows[row][j]);
+            }
+            _mm_storeu_si128(
+                reinterpret_cast<__m128i*>(
+                    reinterpret_cast<char*>(p_instance) +
+                    sizeof(VkTransformMatrixKHR)),
+                tails[j]);
+        }
+    }
+#endif
+    for (; i < end; i++) {
+        VkAccelerationStructureInstanceKHR& instance = p_instances[i - begin];
+        instance.transform = this->get_transform(i);
+        instance.instanceCustomIndex = this->p_custom_indices[i];
+        instance.mask = this->p_masks[i];
+        instance.instanceShaderBindingTableRecordOffset =
+            this->p_sbt_offsets[i];
+        instance.flags = this->p_flags[i];
+        instance.accelerationStructureReference = this->p_blas_addresses[i];
+    }
+}
+
+void InstanceTable::free() {
+    for (float*& p_element : this->p_transforms) {
+        delete[] p_element;
+        p_element = nullptr;
+    }
+    delete[] this->p_custom_indices;
+    delete[] this->p_sbt_offsets;
+    delete[] this->p_masks;
+    delete[] this->p_flags;
+    delete[] this->p_blas_addresses;
+    this->p_custom_indices = nullptr;
+    this->p_sbt_offsets = nullptr;
+    this->p_masks = nullptr;
+    this->p_flags = nullptr;
+    this->p_blas_addresses = nullptr;
+    this->count = 0;
+    this->capacity = 0;
+}
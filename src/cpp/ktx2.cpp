@@ -0,0 +1,180 @@
+#include "ktx2.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+struct Ktx2Header {
+    uint8_t identifier[12];
+    uint32_t vk_format;
+    uint32_t type_size;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_depth;
+    uint32_t layer_count;
+    uint32_t face_count;
+    uint32_t level_count;
+    uint32_t supercompression_scheme;
+    uint32_t dfd_offset;
+    uint32_t dfd_size;
+    uint32_t kvd_offset;
+    uint32_t kvd_size;
+    uint64_t sgd_offset;
+    uint64_t sgd_size;
+};
+
+struct Ktx2LevelIndex {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t uncompressed_size;
+};
+
+constexpr uint8_t expected_identifier[12] = {
+    0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n',
+};
+
+// Zero for anything that is not block compressed.
+auto get_block_size(VkFormat format) -> uint32_t {
+    switch (format) {
+        case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+        case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+        case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+        case VK_FORMAT_BC4_UNORM_BLOCK:
+        case VK_FORMAT_BC4_SNORM_BLOCK:
+            return 8;
+        case VK_FORMAT_BC2_UNORM_BLOCK:
+        case VK_FORMAT_BC2_SRGB_BLOCK:
+        case VK_FORMAT_BC3_UNORM_BLOCK:
+        case VK_FORMAT_BC3_SRGB_BLOCK:
+        case VK_FORMAT_BC5_UNORM_BLOCK:
+        case VK_FORMAT_BC5_SNORM_BLOCK:
+        case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+        case VK_FORMAT_BC7_UNORM_BLOCK:
+        case VK_FORMAT_BC7_SRGB_BLOCK:
+            return 16;
+        default:
+            return 0;
+    }
+}
+
+}  // namespace
+
+auto Ktx2File::load(char const* p_path) -> bool {
+    int file = open(p_path, O_RDONLY);
+    if (file < 0) {
+        std::cout << "Failed to open " << p_path << ".\n";
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0 ||
+        static_cast<size_t>(file_stat.st_size) < sizeof(Ktx2Header)) {
+        close(file);
+        std::cout << p_path << " is not a KTX2 file.\n";
+        return false;
+    }
+    size_t const file_size = static_cast<size_t>(file_stat.st_size);
+    void* p_file = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (p_file == MAP_FAILED) {
+        return false;
+    }
+
+    auto const* p_header = static_cast<Ktx2Header const*>(p_file);
+    uint32_t const level_count =
+        p_header->level_count > 0 ? p_header->level_count : 1;
+    auto const format = static_cast<VkFormat>(p_header->vk_format);
+    bool is_valid =
+        memcmp(p_header->identifier, expected_identifier,
+               sizeof(expected_identifier)) == 0 &&
+        sizeof(Ktx2Header) + level_count * sizeof(Ktx2LevelIndex) <=
+            file_size &&
+        level_count <= max_level_count;
+    if (!is_valid) {
+        munmap(p_file, file_size);
+        std::cout << p_path << " is not a KTX2 file.\n";
+        return false;
+    }
+    // Arrays, cube maps, volumes and supercompressed data all have a layout
+    // that levels can not be copied out of as is. Nor can an image have more
+    // levels than its extent's full mip chain.
+    uint32_t const chain_level_count = static_cast<uint32_t>(std::bit_width(
+        std::max(p_header->pixel_width, p_header->pixel_height)));
+    is_valid = get_block_size(format) != 0 && p_header->pixel_width > 0 &&
+               p_header->pixel_height > 0 && p_header->pixel_depth == 0 &&
+               p_header->layer_count == 0 && p_header->face_count == 1 &&
+               p_header->supercompression_scheme == 0 &&
+               level_count <= chain_level_count;
+
+    // Levels are only kept once every one of them is known to lie within
+    // the file, which is checked without letting `offset + size` wrap.
+    auto const* p_level_index = reinterpret_cast<Ktx2LevelIndex const*>(
+        static_cast<char const*>(p_file) + sizeof(Ktx2Header));
+    Level levels[max_level_count];
+    for (uint32_t i = 0; i < level_count && is_valid; i++) {
+        uint32_t const level_width = std::max(p_header->pixel_width >> i, 1u);
+        uint32_t const level_height =
+            std::max(p_header->pixel_height >> i, 1u);
+        uint64_t const block_count = uint64_t{(level_width + 3) / 4} *
+                                     ((level_height + 3) / 4);
+        uint64_t const offset = p_level_index[i].offset;
+        uint64_t const size = p_level_index[i].size;
+        is_valid = offset <= file_size && size <= file_size - offset &&
+                   size >= block_count * get_block_size(format);
+        levels[i] = {
+            .offset = offset,
+            .size = size,
+        };
+    }
+    if (!is_valid) {
+        munmap(p_file, file_size);
+        std::cout << p_path
+                  << " is not a single 2D BCn texture without "
+                     "supercompression.\n";
+        return false;
+    }
+
+    this->free();
+    this->p_mapping = p_file;
+    this->mapping_size = file_size;
+    this->format = format;
+    this->width = p_header->pixel_width;
+    this->height = p_header->pixel_height;
+    this->level_count = level_count;
+    for (uint32_t i = 0; i < level_count; i++) {
+        this->levels[i] = levels[i];
+    }
+    this->block_size = get_block_size(format);
+    return true;
+}
+
+auto Ktx2File::level_width(uint32_t level) const -> uint32_t {
+    uint32_t const width = this->width >> level;
+    return width > 0 ? width : 1;
+}
+
+auto Ktx2File::level_height(uint32_t level) const -> uint32_t {
+    uint32_t const height = this->height >> level;
+    return height > 0 ? height : 1;
+}
+
+auto Ktx2File::level_data(uint32_t level) const -> void const* {
+    return static_cast<char const*>(this->p_mapping) +
+           this->levels[level].offset;
+}
+
+void Ktx2File::free() {
+    if (this->p_mapping != nullptr) {
+        munmap(this->p_mapping, this->mapping_size);
+        this->p_mapping = nullptr;
+        this->mapping_size = 0;
+    }
+}
@@ -1,6 +1,8 @@
 #include "memory.hpp"
 
 #include <cstring>
+#include <iostream>
+#include <utility>
 #include <vulkan/vulkan_core.h>
 
 auto find_memory_type(uint32_t memory_type_index,
@@ -19,84 +21,259 @@ auto find_memory_type(uint32_t memory_type_index,
     stx::panic("Failed to find a memory type!");
 }
 
-void create_buffer(VkDevice& logical_device, VkPhysicalDevice& physical_device,
-                   VkBufferUsageFlags usage_flags,
+auto align_up(VkDeviceSize value, VkDeviceSize alignment) -> VkDeviceSize {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+void DeviceAllocator::initialize(VkDevice& logical_device,
+                                 VkPhysicalDevice& physical_device) {
+    this->logical_device = logical_device;
+    this->physical_device = physical_device;
+}
+
+auto DeviceAllocator::create_block(uint32_t memory_type_index,
+                                   VkDeviceSize size, bool is_linear)
+    -> uint32_t {
+    // Every buffer in this app may need a device address, so linear blocks
+    // are always allocated with that capability.
+    VkMemoryAllocateFlagsInfo memory_allocate_flags_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO,
+        .pNext = nullptr,
+        .flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT,
+        .deviceMask = 0,
+    };
+    VkMemoryAllocateInfo memory_alloc_info = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .pNext = is_linear ? &memory_allocate_flags_info : nullptr,
+        .allocationSize = size,
+        .memoryTypeIndex = memory_type_index,
+    };
+
+    MemoryBlock block = {
+        .size = size,
+        .used = 0,
+        .memory_type_index = memory_type_index,
+        .is_linear = is_linear,
+        .is_dedicated = size > this->block_size,
+    };
+    if (vkAllocateMemory(this->logical_device, &memory_alloc_info, nullptr,
+                         &block.memory) != VK_SUCCESS) {
+        stx::panic("Failed to allocate a device memory block!");
+    }
+
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    vkGetPhysicalDeviceMemoryProperties(this->physical_device,
+                                        &memory_properties);
+    if (memory_properties.memoryTypes[memory_type_index].propertyFlags &
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        // A `VkDeviceMemory` can only be mapped once, so host-visible blocks
+        // stay mapped for their entire lifetime.
+        if (vkMapMemory(this->logical_device, block.memory, 0, VK_WHOLE_SIZE,
+                        0, &block.p_mapped) != VK_SUCCESS) {
+            stx::panic("Failed to map a device memory block!");
+        }
+    }
+    block.free_ranges.push_back({.offset = 0, .size = size});
+
+    // Reuse the slot of a block that was released earlier, so that
+    // `Allocation::block_index` stays stable.
+    for (uint32_t i = 0; i < this->blocks.size(); i++) {
+        if (this->blocks[i].memory == VK_NULL_HANDLE) {
+            this->blocks[i] = std::move(block);
+            return i;
+        }
+    }
+    this->blocks.push_back(std::move(block));
+    return static_cast<uint32_t>(this->blocks.size() - 1);
+}
+
+auto DeviceAllocator::try_allocate_from(
+    uint32_t block_index, VkMemoryRequirements const& memory_requirements,
+    Allocation& allocation) -> bool {
+    MemoryBlock& block = this->blocks[block_index];
+    std::vector<MemoryBlock::FreeRange>& free_ranges = block.free_ranges;
+
+    // First fit, splitting off any alignment padding as its own free range.
+    for (size_t i = 0; i < free_ranges.size(); i++) {
+        MemoryBlock::FreeRange range = free_ranges[i];
+        VkDeviceSize aligned_offset =
+            align_up(range.offset, memory_requirements.alignment);
+        VkDeviceSize padding = aligned_offset - range.offset;
+        if (padding + memory_requirements.size > range.size) {
+            continue;
+        }
+
+        VkDeviceSize tail_offset = aligned_offset + memory_requirements.size;
+        VkDeviceSize tail_size = range.offset + range.size - tail_offset;
+        free_ranges.erase(free_ranges.begin() + static_cast<ptrdiff_t>(i));
+        if (tail_size > 0) {
+            free_ranges.insert(free_ranges.begin() + static_cast<ptrdiff_t>(i),
+                               {.offset = tail_offset, .size = tail_size});
+        }
+        if (padding > 0) {
+            free_ranges.insert(free_ranges.begin() + static_cast<ptrdiff_t>(i),
+                               {.offset = range.offset, .size = padding});
+        }
+
+        block.used += memory_requirements.size;
+        allocation = {
+            .memory = block.memory,
+            .offset = aligned_offset,
+            .size = memory_requirements.size,
+            .block_index = block_index,
+            .p_mapped = block.p_mapped != nullptr
+                            ? static_cast<char*>(block.p_mapped) +
+                                  aligned_offset
+                            : nullptr,
+        };
+        return true;
+    }
+    return false;
+}
+
+auto DeviceAllocator::allocate(VkMemoryRequirements const& memory_requirements,
+                               VkMemoryPropertyFlags memory_property_flags,
+                               bool is_linear) -> Allocation {
+    uint32_t memory_type_index =
+        find_memory_type(memory_requirements.memoryTypeBits,
+                         memory_property_flags, this->physical_device);
+
+    // Linear and optimally tiled resources are only ever placed in blocks
+    // of their own kind, which is all that keeps neighbours from violating
+    // `bufferImageGranularity`, since offsets are only aligned to each
+    // resource's own requirement. Any block shared between the two would
+    // need the granularity applied between them.
+    Allocation allocation;
+    for (uint32_t i = 0; i < this->blocks.size(); i++) {
+        MemoryBlock const& block = this->blocks[i];
+        if (block.memory == VK_NULL_HANDLE || block.is_dedicated ||
+            block.memory_type_index != memory_type_index ||
+            block.is_linear != is_linear) {
+            continue;
+        }
+        if (try_allocate_from(i, memory_requirements, allocation)) {
+            return allocation;
+        }
+    }
+
+    VkDeviceSize new_block_size =
+        memory_requirements.size > this->block_size ? memory_requirements.size
+                                                    : this->block_size;
+    uint32_t block_index =
+        create_block(memory_type_index, new_block_size, is_linear);
+    if (!try_allocate_from(block_index, memory_requirements, allocation)) {
+        stx::panic("Failed to sub-allocate from a fresh memory block!");
+    }
+    return allocation;
+}
+
+void DeviceAllocator::deallocate(Allocation& allocation) {
+    if (allocation.memory == VK_NULL_HANDLE) {
+        return;
+    }
+    MemoryBlock& block = this->blocks[allocation.block_index];
+    std::vector<MemoryBlock::FreeRange>& free_ranges = block.free_ranges;
+    block.used -= allocation.size;
+
+    // Insert in offset order, then merge with the neighbours on either side.
+    size_t i = 0;
+    while (i < free_ranges.size() &&
+           free_ranges[i].offset < allocation.offset) {
+        i++;
+    }
+    free_ranges.insert(free_ranges.begin() + static_cast<ptrdiff_t>(i),
+                       {.offset = allocation.offset, .size = allocation.size});
+    if (i + 1 < free_ranges.size() &&
+        free_ranges[i].offset + free_ranges[i].size ==
+            free_ranges[i + 1].offset) {
+        free_ranges[i].size += free_ranges[i + 1].size;
+        free_ranges.erase(free_ranges.begin() + static_cast<ptrdiff_t>(i + 1));
+    }
+    if (i > 0 && free_ranges[i - 1].offset + free_ranges[i - 1].size ==
+                     free_ranges[i].offset) {
+        free_ranges[i - 1].size += free_ranges[i].size;
+        free_ranges.erase(free_ranges.begin() + static_cast<ptrdiff_t>(i));
+    }
+
+    if (block.is_dedicated && block.used == 0) {
+        vkFreeMemory(this->logical_device, block.memory, nullptr);
+        block = MemoryBlock{};
+    }
+    allocation = Allocation{};
+}
+
+auto DeviceAllocator::bytes_allocated() const -> VkDeviceSize {
+    VkDeviceSize total = 0;
+    for (MemoryBlock const& block : this->blocks) {
+        total += block.size;
+    }
+    return total;
+}
+
+auto DeviceAllocator::bytes_used() const -> VkDeviceSize {
+    VkDeviceSize total = 0;
+    for (MemoryBlock const& block : this->blocks) {
+        total += block.used;
+    }
+    return total;
+}
+
+void DeviceAllocator::print_stats() const {
+    uint32_t block_count = 0;
+    for (MemoryBlock const& block : this->blocks) {
+        if (block.memory != VK_NULL_HANDLE) {
+            block_count++;
+        }
+    }
+    std::cout << "Device memory: " << this->bytes_used() << " bytes used of "
+              << this->bytes_allocated() << " bytes allocated in "
+              << block_count << " blocks.\n";
+}
+
+void DeviceAllocator::free() {
+    for (MemoryBlock& block : this->blocks) {
+        if (block.memory != VK_NULL_HANDLE) {
+            vkFreeMemory(this->logical_device, block.memory, nullptr);
+        }
+    }
+    this->blocks.clear();
+}
+
+void create_buffer(DeviceAllocator& allocator, VkBufferUsageFlags usage_flags,
                    VkMemoryPropertyFlags memory_property_flags,
                    VkDeviceSize size, VkBuffer& p_buffer,
-                   VkDeviceMemory* p_buffer_memory) {
+                   Allocation* p_buffer_allocation) {
     VkBufferCreateInfo buffer_create_info = {
         .sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
         .size = size,
         .usage = usage_flags,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+        .sharingMode = allocator.queue_family_count > 1
+                           ? VK_SHARING_MODE_CONCURRENT
+                           : VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = allocator.queue_family_count,
+        .pQueueFamilyIndices = allocator.queue_family_indices,
     };
-    if (vkCreateBuffer(logical_device, &buffer_create_info, nullptr,
+    if (vkCreateBuffer(allocator.logical_device, &buffer_create_info, nullptr,
                        &p_buffer) != VK_SUCCESS) {
         stx::panic("Failed to create buffer!");
     }
-    // Create the memory backing up the buffer handle
+    // Sub-allocate the memory backing up the buffer handle
     VkMemoryRequirements memory_requirements;
-    vkGetBufferMemoryRequirements(logical_device, p_buffer,
+    vkGetBufferMemoryRequirements(allocator.logical_device, p_buffer,
                                   &memory_requirements);
 
-    VkMemoryAllocateInfo memory_alloc_info = {
-        .sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize = memory_requirements.size,
-        .memoryTypeIndex =
-            find_memory_type(memory_requirements.memoryTypeBits,
-                             memory_property_flags, physical_device),
-    };
-    if (vkAllocateMemory(logical_device, &memory_alloc_info, nullptr,
-                         p_buffer_memory) != VK_SUCCESS) {
-        stx::panic("Failed to allocate buffer memory!");
-    }
-    if (vkBindBufferMemory(logical_device, p_buffer, *p_buffer_memory, 0) !=
-        VK_SUCCESS) {
+    *p_buffer_allocation =
+        allocator.allocate(memory_requirements, memory_property_flags, true);
+    if (vkBindBufferMemory(allocator.logical_device, p_buffer,
+                           p_buffer_allocation->memory,
+                           p_buffer_allocation->offset) != VK_SUCCESS) {
         stx::panic("Failed to bind buffer memory!");
     }
 }
 
-void copy_buffer(VkDevice& logical_device, VkCommandPool& cmd_pool,
-                 VkBuffer p_src_buffer, VkBuffer p_dst_buffer,
-                 VkDeviceSize size, VkQueue& queue) {
-    // Submit a copy command to a one-time use buffer, and block until it
-    // completes.
-    VkCommandBufferAllocateInfo buffer_allocate_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .commandPool = cmd_pool,
-        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandBufferCount = 1,
-    };
-    VkCommandBuffer p_cmd_buffer;
-    if (vkAllocateCommandBuffers(logical_device, &buffer_allocate_info,
-                                 &p_cmd_buffer) != VK_SUCCESS) {
-        stx::panic("Failed to allocate a command buffer for copy operation!");
-    }
-    VkCommandBufferBeginInfo command_buffer_begin_info = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    };
-    if (vkBeginCommandBuffer(p_cmd_buffer, &command_buffer_begin_info) !=
-        VK_SUCCESS) {
-        stx::panic("Failed to begin a command buffer for copy operation!");
-    }
-    VkBufferCopy buffer_copy = {
-        .size = size,
-    };
-    vkCmdCopyBuffer(p_cmd_buffer, p_src_buffer, p_dst_buffer, 1, &buffer_copy);
-    if (vkEndCommandBuffer(p_cmd_buffer) != VK_SUCCESS) {
-        stx::panic("Failed to end the command buffer for copy operation!");
-    }
-    VkSubmitInfo submit_info = {
-        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers = &p_cmd_buffer,
-    };
-    if (vkQueueSubmit(queue, 1, &submit_info, nullptr) != VK_SUCCESS) {
-        stx::panic("Failed to submit a command queue for copy operation!");
-    }
-    if (vkQueueWaitIdle(queue) != VK_SUCCESS) {
-        stx::panic("Failed to wait on the command queue for copy operation!");
-    }
-    vkFreeCommandBuffers(logical_device, cmd_pool, 1, &p_cmd_buffer);
+void destroy_buffer(DeviceAllocator& allocator, VkBuffer& p_buffer,
+                    Allocation* p_buffer_allocation) {
+    vkDestroyBuffer(allocator.logical_device, p_buffer, nullptr);
+    p_buffer = VK_NULL_HANDLE;
+    allocator.deallocate(*p_buffer_allocation);
 }
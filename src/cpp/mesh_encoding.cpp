@@ -0,0 +1,245 @@
+#include "mesh_encoding.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+
+// The bit patterns of every attribute of a vertex, so that `-0.0` and `0.0`
+// stay apart and NaNs compare equal to themselves.
+struct VertexKey {
+    uint32_t bits[8];
+
+    auto operator==(VertexKey const& other) const -> bool = default;
+};
+
+struct VertexKeyHash {
+    auto operator()(VertexKey const& key) const -> size_t {
+        size_t hash = 0;
+        for (uint32_t bits : key.bits) {
+            hash = hash * 0x9E3779B97F4A7C15ull ^ bits;
+        }
+        return hash;
+    }
+};
+
+// The vertex Tipsify fans around next. Prefers the candidate that entered the
+// cache longest ago while staying in it for all of its remaining triangles.
+auto next_vertex(std::vector<uint32_t> const& candidates,
+                 std::vector<uint32_t> const& cache_times,
+                 std::vector<uint32_t> const& live_counts,
+                 std::vector<uint32_t>& dead_ends, uint32_t time,
+                 uint32_t& cursor, uint32_t vertex_count) -> uint32_t {
+    uint32_t best_vertex = unused_vertex;
+    int64_t best_priority = -1;
+    for (uint32_t vertex : candidates) {
+        if (live_counts[vertex] == 0) {
+            continue;
+        }
+        int64_t priority = 0;
+        if (time - cache_times[vertex] + 2 * live_counts[vertex] <=
+            vertex_cache_size) {
+            priority = time - cache_times[vertex];
+        }
+        if (priority > best_priority) {
+            best_priority = priority;
+            best_vertex = vertex;
+        }
+    }
+    if (best_vertex != unused_vertex) {
+        return best_vertex;
+    }
+
+    // Every candidate is done, so fall back to a recently used vertex, and
+    // then to the next one in input order.
+    while (!dead_ends.empty()) {
+        uint32_t const vertex = dead_ends.back();
+        dead_ends.pop_back();
+        if (live_counts[vertex] > 0) {
+            return vertex;
+        }
+    }
+    for (; cursor < vertex_count; cursor++) {
+        if (live_counts[cursor] > 0) {
+            return cursor;
+        }
+    }
+    return unused_vertex;
+}
+
+}  // namespace
+
+auto deduplicate_vertices(float const* p_positions, float const* p_normals,
+                          float const* p_uvs, uint32_t vertex_count,
+                          uint32_t* p_remap) -> uint32_t {
+    std::unordered_map<VertexKey, uint32_t, VertexKeyHash> vertex_map;
+    vertex_map.reserve(vertex_count);
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        VertexKey key;
+        std::memcpy(&key.bits[0], p_positions + 3 * i, 3 * sizeof(float));
+        std::memcpy(&key.bits[3], p_normals + 3 * i, 3 * sizeof(float));
+        std::memcpy(&key.bits[6], p_uvs + 2 * i, 2 * sizeof(float));
+        auto [it, is_new] = vertex_map.try_emplace(
+            key, static_cast<uint32_t>(vertex_map.size()));
+        p_remap[i] = it->second;
+    }
+    return static_cast<uint32_t>(vertex_map.size());
+}
+
+void optimize_vertex_cache(uint32_t* p_indices, uint32_t index_count,
+                           uint32_t vertex_count, uint32_t* p_triangle_order) {
+    uint32_t const triangle_count = index_count / 3;
+    if (triangle_count == 0 || vertex_count == 0) {
+        return;
+    }
+
+    // The triangles around every vertex, in compressed rows.
+    std::vector<uint32_t> live_counts(vertex_count, 0);
+    for (uint32_t i = 0; i < 3 * triangle_count; i++) {
+        live_counts[p_indices[i]]++;
+    }
+    std::vector<uint32_t> adjacency_offsets(vertex_count + 1, 0);
+    for (uint32_t vertex = 0; vertex < vertex_count; vertex++) {
+        adjacency_offsets[vertex + 1] =
+            adjacency_offsets[vertex] + live_counts[vertex];
+    }
+    std::vector<uint32_t> adjacency(adjacency_offsets[vertex_count]);
+    std::vector<uint32_t> fill(adjacency_offsets.begin(),
+                               adjacency_offsets.end() - 1);
+    for (uint32_t triangle = 0; triangle < triangle_count; triangle++) {
+        for (uint32_t corner = 0; corner < 3; corner++) {
+            adjacency[fill[p_indices[3 * triangle + corner]]++] = triangle;
+        }
+    }
+
+    // Times start past the cache size, so that no vertex begins cached.
+    std::vector<uint32_t> cache_times(vertex_count, 0);
+    uint32_t time = vertex_cache_size + 1;
+    std::vector<bool> is_emitted(triangle_count, false);
+    std::vector<uint32_t> dead_ends;
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> ordered_indices;
+    ordered_indices.reserve(3 * triangle_count);
+
+    uint32_t cursor = 0;
+    uint32_t fan_vertex = p_indices[0];
+    while (fan_vertex != unused_vertex) {
+        candidates.clear();
+        for (uint32_t i = adjacency_offsets[fan_vertex];
+             i < adjacency_offsets[fan_vertex + 1]; i++) {
+            uint32_t const triangle = adjacency[i];
+            if (is_emitted[triangle]) {
+                continue;
+            }
+            for (uint32_t corner = 0; corner < 3; corner++) {
+                uint32_t const vertex = p_indices[3 * triangle + corner];
+                ordered_indices.push_back(vertex);
+                dead_ends.push_back(vertex);
+                candidates.push_back(vertex);
+                live_counts[vertex]--;
+                if (time - cache_times[vertex] > vertex_cache_size) {
+                    cache_times[vertex] = time;
+                    time++;
+                }
+            }
+            is_emitted[triangle] = true;
+            if (p_triangle_order != nullptr) {
+                *p_triangle_order++ = triangle;
+            }
+        }
+        fan_vertex = next_vertex(candidates, cache_times, live_counts,
+                                 dead_ends, time, cursor, vertex_count);
+    }
+
+    std::copy(ordered_indices.begin(), ordered_indices.end(), p_indices);
+}
+
+auto reorder_vertices_for_fetch(uint32_t* p_indices, uint32_t index_count,
+                                uint32_t vertex_count, uint32_t* p_remap)
+    -> uint32_t {
+    std::fill(p_remap, p_remap + vertex_count, unused_vertex);
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < index_count; i++) {
+        uint32_t& remapped = p_remap[p_indices[i]];
+        if (remapped == unused_vertex) {
+            remapped = next++;
+        }
+        p_indices[i] = remapped;
+    }
+    return next;
+}
+
+void quantize_positions(float const* p_positions, uint32_t vertex_count,
+                        int16_t* p_quantized, float* p_scale,
+                        float* p_offset) {
+    // Non-finite components, which a malformed OBJ can contain, are left out
+    // of the bounds. They would otherwise reach `std::lround()` as NaN.
+    for (uint32_t axis = 0; axis < 3; axis++) {
+        float min = std::numeric_limits<float>::infinity();
+        float max = -std::numeric_limits<float>::infinity();
+        for (uint32_t i = 0; i < vertex_count; i++) {
+            float const position = p_positions[3 * i + axis];
+            if (std::isfinite(position)) {
+                min = std::min(min, position);
+                max = std::max(max, position);
+            }
+        }
+        if (min > max) {
+            min = max = 0;
+        }
+        p_offset[axis] = 0.5f * (min + max);
+        // Flat axes still need a scale that can be divided by.
+        p_scale[axis] = max > min ? 0.5f * (max - min) : 1.0f;
+    }
+
+    for (uint32_t i = 0; i < vertex_count; i++) {
+        for (uint32_t axis = 0; axis < 3; axis++) {
+            float const position = p_positions[3 * i + axis];
+            // Non-finite components quantize to the center of the bounds.
+            float const normalized =
+                std::isfinite(position)
+                    ? (position - p_offset[axis]) / p_scale[axis]
+                    : 0.0f;
+            p_quantized[4 * i + axis] = static_cast<int16_t>(
+                std::lround(std::clamp(normalized, -1.0f, 1.0f) * 32767.0f));
+        }
+        // Builds ignore the fourth component, which only pads the stride.
+        p_quantized[4 * i + 3] = 0;
+    }
+}
+
+auto float_to_half(float value) -> uint16_t {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint32_t const sign = (bits >> 16) & 0x8000;
+    int32_t const exponent = static_cast<int32_t>((bits >> 23) & 0xFF) - 112;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (exponent <= 0) {
+        // Too small to be normal, so shift the implicit bit into a subnormal.
+        if (exponent < -10) {
+            return static_cast<uint16_t>(sign);
+        }
+        mantissa |= 0x800000;
+        uint32_t const shift = static_cast<uint32_t>(14 - exponent);
+        uint32_t half = mantissa >> shift;
+        if (((mantissa >> (shift - 1)) & 1) != 0) {
+            half++;
+        }
+        return static_cast<uint16_t>(sign | half);
+    }
+    if (exponent >= 31) {
+        return static_cast<uint16_t>(sign | 0x7C00);
+    }
+    uint32_t half = sign | static_cast<uint32_t>(exponent) << 10 |
+                    mantissa >> 13;
+    // A carry out of the mantissa correctly bumps the exponent.
+    if ((mantissa & 0x1000) != 0) {
+        half++;
+    }
+    return static_cast<uint16_t>(half);
+}
@@ -0,0 +1,152 @@
+#include "pipeline_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vulkan/vulkan_core.h>
+
+namespace {
+
+// Returns the driver's cache data, if `p_path` holds a cache that was written
+// for `expected_header`'s device and driver. Otherwise, this returns null and
+// `data_size` is 0.
+auto read_cache_data(char const* p_path,
+                     PipelineCacheHeader const& expected_header,
+                     size_t& data_size) -> uint8_t* {
+    data_size = 0;
+    std::FILE* p_file = std::fopen(p_path, "rb");
+    if (p_file == nullptr) {
+        return nullptr;
+    }
+
+    // The header's size is checked against the file's, so that a truncated
+    // or corrupt file can not ask for an arbitrarily large allocation.
+    long file_size = -1;
+    if (std::fseek(p_file, 0, SEEK_END) == 0) {
+        file_size = std::ftell(p_file);
+    }
+    if (file_size < static_cast<long>(sizeof(PipelineCacheHeader)) ||
+        std::fseek(p_file, 0, SEEK_SET) != 0) {
+        std::fclose(p_file);
+        return nullptr;
+    }
+    uint64_t const max_data_size =
+        static_cast<uint64_t>(file_size) - sizeof(PipelineCacheHeader);
+
+    PipelineCacheHeader header;
+    uint8_t* p_data = nullptr;
+    if (std::fread(&header, sizeof(header), 1, p_file) == 1 &&
+        memcmp(header.magic, expected_header.magic, sizeof(header.magic)) ==
+            0 &&
+        header.version == expected_header.version &&
+        header.vendor_id == expected_header.vendor_id &&
+        header.device_id == expected_header.device_id &&
+        header.driver_version == expected_header.driver_version &&
+        memcmp(header.pipeline_cache_uuid, expected_header.pipeline_cache_uuid,
+               VK_UUID_SIZE) == 0 &&
+        header.data_size > 0 && header.data_size <= max_data_size) {
+        size_t const size = static_cast<size_t>(header.data_size);
+        p_data = new (std::nothrow) uint8_t[size];
+        if (p_data != nullptr &&
+            std::fread(p_data, 1, size, p_file) != size) {
+            delete[] p_data;
+            p_data = nullptr;
+        }
+        // Only a fully read cache has a size, so that the driver is never
+        // given a size without data.
+        if (p_data != nullptr) {
+            data_size = size;
+        }
+    }
+
+    std::fclose(p_file);
+    return p_data;
+}
+
+}  // namespace
+
+void PipelineCache::initialize(VkDevice& logical_device,
+                               VkPhysicalDevice& physical_device,
+                               char const* p_path) {
+    this->logical_device = logical_device;
+    this->p_path = p_path;
+
+    VkPhysicalDeviceProperties physical_device_properties;
+    vkGetPhysicalDeviceProperties(physical_device,
+                                  &physical_device_properties);
+    this->expected_header = {
+        .magic = {},
+        .version = PipelineCacheHeader::current_version,
+        .vendor_id = physical_device_properties.vendorID,
+        .device_id = physical_device_properties.deviceID,
+        .driver_version = physical_device_properties.driverVersion,
+        .pipeline_cache_uuid = {},
+        .data_size = 0,
+    };
+    memcpy(this->expected_header.magic, PipelineCacheHeader::expected_magic,
+           sizeof(this->expected_header.magic));
+    memcpy(this->expected_header.pipeline_cache_uuid,
+           physical_device_properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+    size_t data_size = 0;
+    uint8_t* p_data =
+        read_cache_data(this->p_path, this->expected_header, data_size);
+    this->is_warm = p_data != nullptr;
+
+    VkPipelineCacheCreateInfo pipeline_cache_create_info = {
+        .sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0,
+        .initialDataSize = data_size,
+        .pInitialData = p_data,
+    };
+    if (vkCreatePipelineCache(this->logical_device,
+                              &pipeline_cache_create_info, nullptr,
+                              &this->cache) != VK_SUCCESS) {
+        stx::panic("Failed to create the pipeline cache!");
+    }
+
+    delete[] p_data;
+}
+
+void PipelineCache::save() {
+    size_t data_size = 0;
+    if (vkGetPipelineCacheData(this->logical_device, this->cache, &data_size,
+                               nullptr) != VK_SUCCESS ||
+        data_size == 0) {
+        return;
+    }
+    uint8_t* p_data = new (std::nothrow) uint8_t[data_size];
+    if (vkGetPipelineCacheData(this->logical_device, this->cache, &data_size,
+                               p_data) != VK_SUCCESS) {
+        delete[] p_data;
+        return;
+    }
+
+    PipelineCacheHeader header = this->expected_header;
+    header.data_size = data_size;
+
+    // Written to a temporary file first, so that a crash can not leave a
+    // truncated cache behind.
+    std::string temporary_path = std::string(this->p_path) + ".tmp";
+    std::FILE* p_file = std::fopen(temporary_path.c_str(), "wb");
+    bool is_written = p_file != nullptr;
+    if (is_written) {
+        is_written = std::fwrite(&header, sizeof(header), 1, p_file) == 1 &&
+                     std::fwrite(p_data, 1, data_size, p_file) == data_size;
+        is_written = std::fclose(p_file) == 0 && is_written;
+    }
+    if (!is_written ||
+        std::rename(temporary_path.c_str(), this->p_path) != 0) {
+        std::remove(temporary_path.c_str());
+        std::cout << "Failed to write " << this->p_path << ".\n";
+    }
+
+    delete[] p_data;
+}
+
+void PipelineCache::free() {
+    vkDestroyPipelineCache(this->logical_device, this->cache, nullptr);
+}
@@ -0,0 +1,27 @@
+#include "ppm.hpp"
+
+#include <cstdio>
+#include <new>
+
+auto write_ppm(char const* p_file_name, uint8_t const* p_pixels,
+               uint32_t width, uint32_t height) -> bool {
+    std::FILE* p_file = std::fopen(p_file_name, "wb");
+    if (p_file == nullptr) {
+        return false;
+    }
+
+    std::fprintf(p_file, "P6\n%u %u\n255\n", width, height);
+    uint8_t* p_row = new (std::nothrow) uint8_t[3 * width];
+    for (uint32_t y = 0; y < height; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint8_t const* p_pixel = p_pixels + 4 * (y * width + x);
+            p_row[3 * x] = p_pixel[0];
+            p_row[3 * x + 1] = p_pixel[1];
+            p_row[3 * x + 2] = p_pixel[2];
+        }
+        std::fwrite(p_row, 3, width, p_file);
+    }
+    delete[] p_row;
+
+    return std::fclose(p_file) == 0;
+}
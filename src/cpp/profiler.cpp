@@ -0,0 +1,225 @@
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vulkan/vulkan_core.h>
+
+void GpuProfiler::initialize(VkDevice& logical_device,
+                             VkPhysicalDevice& physical_device,
+                             uint32_t queue_family_index) {
+    this->logical_device = logical_device;
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(physical_device,
+                                             &queue_family_count, nullptr);
+    VkQueueFamilyProperties* p_queue_families =
+        new (std::nothrow) VkQueueFamilyProperties[queue_family_count];
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        physical_device, &queue_family_count, p_queue_families);
+    uint32_t const valid_bits =
+        p_queue_families[queue_family_index].timestampValidBits;
+    delete[] p_queue_families;
+
+    if (valid_bits == 0) {
+        std::cout << "Timestamps are not supported, GPU profiling is off.\n";
+        return;
+    }
+    VkPhysicalDeviceHostQueryResetFeatures host_query_reset_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_HOST_QUERY_RESET_FEATURES,
+        .pNext = nullptr,
+    };
+    VkPhysicalDeviceFeatures2 physical_device_features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
+        .pNext = &host_query_reset_features,
+    };
+    vkGetPhysicalDeviceFeatures2(physical_device, &physical_device_features);
+    if (host_query_reset_features.hostQueryReset != VK_TRUE) {
+        std::cout << "Queries can not be reset on the host, GPU profiling is "
+                     "off.\n";
+        return;
+    }
+    this->timestamp_mask =
+        valid_bits >= 64 ? ~0ull : (1ull << valid_bits) - 1;
+
+    VkPhysicalDeviceProperties physical_device_properties;
+    vkGetPhysicalDeviceProperties(physical_device,
+                                  &physical_device_properties);
+    this->ns_per_tick = physical_device_properties.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo query_pool_create_info = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2 * max_scopes_in_flight,
+    };
+    if (vkCreateQueryPool(this->logical_device, &query_pool_create_info,
+                          nullptr, &this->query_pool) != VK_SUCCESS) {
+        stx::panic("Failed to create the profiler's query pool!");
+    }
+    // Queries start out undefined, and must be reset before their first use
+    // and before they are read.
+    vkResetQueryPool(this->logical_device, this->query_pool, 0,
+                     2 * max_scopes_in_flight);
+    this->is_enabled = true;
+}
+
+auto GpuProfiler::find_stage(char const* p_name) -> uint32_t {
+    for (uint32_t i = 0; i < this->stages.size(); i++) {
+        if (strcmp(this->stages[i].p_name, p_name) == 0) {
+            return i;
+        }
+    }
+    this->stages.push_back({.p_name = p_name});
+    return static_cast<uint32_t>(this->stages.size() - 1);
+}
+
+auto GpuProfiler::begin_scope(VkCommandBuffer p_command_buffer,
+                              char const* p_name) -> uint32_t {
+    if (!this->is_enabled) {
+        return no_scope;
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->next_scope - this->resolved_scope == max_scopes_in_flight) {
+        this->resolve_locked();
+        // Rather than stall, this scope goes unmeasured.
+        if (this->next_scope - this->resolved_scope == max_scopes_in_flight) {
+            this->dropped_scope_count++;
+            return no_scope;
+        }
+    }
+
+    uint32_t const scope =
+        static_cast<uint32_t>(this->next_scope++ % max_scopes_in_flight);
+    this->scope_stages[scope] = this->find_stage(p_name);
+
+    vkCmdWriteTimestamp(p_command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT,
+                        this->query_pool, 2 * scope);
+    return scope;
+}
+
+void GpuProfiler::end_scope(VkCommandBuffer p_command_buffer, uint32_t scope) {
+    if (scope == no_scope) {
+        return;
+    }
+    vkCmdWriteTimestamp(p_command_buffer,
+                        VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, this->query_pool,
+                        2 * scope + 1);
+}
+
+void GpuProfiler::resolve() {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->resolve_locked();
+}
+
+void GpuProfiler::resolve_locked() {
+    while (this->resolved_scope < this->next_scope) {
+        uint32_t const scope =
+            static_cast<uint32_t>(this->resolved_scope % max_scopes_in_flight);
+
+        // Each query is followed by its availability.
+        uint64_t results[4];
+        VkResult result = vkGetQueryPoolResults(
+            this->logical_device, this->query_pool, 2 * scope, 2,
+            sizeof(results), results, 2 * sizeof(uint64_t),
+            VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+        if (result != VK_SUCCESS || results[1] == 0 || results[3] == 0) {
+            return;
+        }
+
+        uint64_t const ticks = (results[2] - results[0]) & this->timestamp_mask;
+        double const sample_ms =
+            static_cast<double>(ticks) * this->ns_per_tick / 1e6;
+        Stage& stage = this->stages[this->scope_stages[scope]];
+        stage.samples_ms[stage.sample_count % samples_per_stage] = sample_ms;
+        stage.sample_count++;
+        stage.total_ms += sample_ms;
+        stage.max_ms = std::max(stage.max_ms, sample_ms);
+
+        // Reset on the host once read, so that the scope reusing the slot
+        // can never be resolved from this one's results.
+        vkResetQueryPool(this->logical_device, this->query_pool, 2 * scope,
+                         2);
+        this->resolved_scope++;
+    }
+}
+
+auto GpuProfiler::get_statistics(Stage const& stage) const -> Statistics {
+    // Percentiles only cover the recent window, while the average and the
+    // maximum cover every sample.
+    uint32_t const window_size = static_cast<uint32_t>(
+        std::min<uint64_t>(stage.sample_count, samples_per_stage));
+    double window[samples_per_stage];
+    std::copy(stage.samples_ms, stage.samples_ms + window_size, window);
+    std::sort(window, window + window_size);
+    auto percentile = [&](double fraction) {
+        if (window_size == 0) {
+            return 0.0;
+        }
+        return window[static_cast<uint32_t>(fraction * (window_size - 1))];
+    };
+
+    return {
+        .sample_count = stage.sample_count,
+        .average_ms = stage.sample_count > 0
+                          ? stage.total_ms /
+                                static_cast<double>(stage.sample_count)
+                          : 0.0,
+        .p50_ms = percentile(0.50),
+        .p95_ms = percentile(0.95),
+        .p99_ms = percentile(0.99),
+        .max_ms = stage.max_ms,
+    };
+}
+
+auto GpuProfiler::get_last_sample_ms(char const* p_name) const -> double {
+    for (Stage const& stage : this->stages) {
+        if (strcmp(stage.p_name, p_name) == 0 && stage.sample_count > 0) {
+            return stage.samples_ms[(stage.sample_count - 1) %
+                                    samples_per_stage];
+        }
+    }
+    return 0;
+}
+
+void GpuProfiler::print_stats() const {
+    if (!this->is_enabled) {
+        return;
+    }
+    std::cout << "GPU stage timings in ms (count, average, p50, p95, p99, "
+                 "max):\n";
+    for (Stage const& stage : this->stages) {
+        Statistics statistics = this->get_statistics(stage);
+        std::printf("  %-16s %8llu %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                    stage.p_name,
+                    static_cast<unsigned long long>(statistics.sample_count),
+                    statistics.average_ms, statistics.p50_ms,
+                    statistics.p95_ms, statistics.p99_ms, statistics.max_ms);
+    }
+    if (this->dropped_scope_count > 0) {
+        std::cout << "  " << this->dropped_scope_count
+                  << " scopes were dropped while the query pool was full.\n";
+    }
+}
+
+auto GpuProfiler::write_csv(char const* p_path) const -> bool {
+    std::FILE* p_file = std::fopen(p_path, "w");
+    if (p_file == nullptr) {
+        return false;
+    }
+    std::fprintf(p_file, "stage,count,average_ms,p50_ms,p95_ms,p99_ms,max_ms\n");
+    for (Stage const& stage : this->stages) {
+        Statistics statistics = this->get_statistics(stage);
+        std::fprintf(p_file, "%s,%llu,%f,%f,%f,%f,%f\n", stage.p_name,
+                     static_cast<unsigned long long>(statistics.sample_count),
+                     statistics.average_ms, statistics.p50_ms,
+                     statistics.p95_ms, statistics.p99_ms, statistics.max_ms);
+    }
+    return std::fclose(p_file) == 0;
+}
+
+void GpuProfiler::free() {
+    if (this->is_enabled) {
+        vkDestroyQueryPool(this->logical_device, this->query_pool, nullptr);
+    }
+}
@@ -0,0 +1,781 @@
+#include "scene.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tiny_obj_loader.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "memory.hpp"
+#include "mesh_encoding.hpp"
+
+namespace {
+
+// OBJ files index positions, normals and UVs separately, so a vertex is
+// unique per combination of the three.
+struct ObjVertexKey {
+    int position_index;
+    int normal_index;
+    int uv_index;
+
+    auto operator==(ObjVertexKey const& other) const -> bool = default;
+};
+
+struct ObjVertexKeyHash {
+    auto operator()(ObjVertexKey const& key) const -> size_t {
+        size_t hash = static_cast<uint32_t>(key.position_index);
+        hash = hash * 0x9E3779B97F4A7C15ull ^
+               static_cast<uint32_t>(key.normal_index);
+        hash = hash * 0x9E3779B97F4A7C15ull ^
+               static_cast<uint32_t>(key.uv_index);
+        return hash;
+    }
+};
+
+// Clamped to [0, 1] and rounded, with the first channel in the low byte.
+auto pack_unorm4x8(float r, float g, float b, float a) -> uint32_t {
+    uint32_t packed = 0;
+    float const channels[4] = {r, g, b, a};
+    for (uint32_t i = 0; i < 4; i++) {
+        float const channel = std::clamp(channels[i], 0.0f, 1.0f);
+        packed |= static_cast<uint32_t>(channel * 255.0f + 0.5f) << (8 * i);
+    }
+    return packed;
+}
+
+auto get_file_stamp(char const* p_path) -> SourceFileStamp {
+    struct stat file_stat;
+    if (stat(p_path, &file_stat) != 0) {
+        return {
+            .size = SourceFileStamp::missing_size,
+            .mtime_ns = 0,
+        };
+    }
+    return {
+        .size = static_cast<uint64_t>(file_stat.st_size),
+        .mtime_ns =
+            static_cast<int64_t>(file_stat.st_mtim.tv_sec) * 1'000'000'000 +
+            file_stat.st_mtim.tv_nsec,
+    };
+}
+
+// Whether every blob the header points at is aligned and lies within the
+// file, so that a truncated or corrupt cache is reparsed rather than read
+// out of bounds.
+auto are_cache_blobs_in_bounds(SceneCacheHeader const& header,
+                               uint64_t file_size) -> bool {
+    struct Blob {
+        uint64_t offset;
+        uint64_t size;
+    };
+    // Counts are 32-bit, so none of these sizes can overflow.
+    Blob const blobs[] = {
+        {header.positions_offset, sizeof(float) * 3 * header.vertex_count},
+        {header.normals_offset, sizeof(float) * 3 * header.vertex_count},
+        {header.uvs_offset, sizeof(float) * 2 * header.vertex_count},
+        {header.indices_offset, sizeof(uint32_t) * header.index_count},
+        {header.meshes_offset, sizeof(Mesh) * header.mesh_count},
+        {header.encoded_positions_offset,
+         sizeof(int16_t) * 4 * header.vertex_count},
+        {header.encoded_indices_offset,
+         sizeof(uint32_t) * header.encoded_index_word_count},
+        {header.texture_names_offset, header.texture_names_size},
+        {header.materials_offset, sizeof(Material) * header.material_count},
+        {header.material_indices_offset,
+         sizeof(uint32_t) * (header.index_count / 3)},
+        {header.material_library_names_offset,
+         header.material_library_names_size},
+        {header.material_library_stamps_offset,
+         sizeof(SourceFileStamp) * header.material_library_count},
+    };
+    for (Blob const& blob : blobs) {
+        if (blob.offset % SceneCacheHeader::blob_alignment != 0 ||
+            blob.offset < sizeof(SceneCacheHeader) ||
+            blob.offset > file_size || blob.size > file_size - blob.offset) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Whether a mesh's ranges lie within the scene's vertex, index and encoded
+// index streams.
+auto is_cached_mesh_in_bounds(Mesh const& mesh,
+                              SceneCacheHeader const& header) -> bool {
+    uint64_t const index_word_count = mesh.is_index_16_bit != 0
+                                          ? (uint64_t{mesh.index_count} + 1) / 2
+                                          : mesh.index_count;
+    return uint64_t{mesh.first_vertex} + mesh.vertex_count <=
+               header.vertex_count &&
+           uint64_t{mesh.first_index} + mesh.index_count <=
+               header.index_count &&
+           mesh.index_word_offset + index_word_count <=
+               header.encoded_index_word_count;
+}
+
+// Whether every index of a mesh, both plain and encoded, names one of its
+// own vertices. The mesh must already be in bounds.
+auto are_cached_indices_in_bounds(Mesh const& mesh, uint32_t const* p_indices,
+                                  uint32_t const* p_encoded_indices) -> bool {
+    for (uint32_t i = 0; i < mesh.index_count; i++) {
+        if (p_indices[mesh.first_index + i] >= mesh.vertex_count) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < mesh.index_count; i++) {
+        uint32_t const index =
+            mesh.is_index_16_bit != 0
+                ? (p_encoded_indices[mesh.index_word_offset + i / 2] >>
+                   (16 * (i % 2))) &
+                      0xFFFF
+                : p_encoded_indices[mesh.index_word_offset + i];
+        if (index >= mesh.vertex_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto write_all(int file, void const* p_data, size_t size) -> bool {
+    char const* p_bytes = static_cast<char const*>(p_data);
+    while (size > 0) {
+        ssize_t written = ::write(file, p_bytes, size);
+        if (written <= 0) {
+            return false;
+        }
+        p_bytes += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+}  // namespace
+
+void Scene::point_at_storage() {
+    this->p_positions = this->position_storage.data();
+    this->p_normals = this->normal_storage.data();
+    this->p_uvs = this->uv_storage.data();
+    this->p_indices = this->index_storage.data();
+    this->p_meshes = this->mesh_storage.data();
+    this->p_encoded_positions = this->encoded_position_storage.data();
+    this->p_encoded_indices = this->encoded_index_storage.data();
+    this->vertex_count =
+        static_cast<uint32_t>(this->position_storage.size() / 3);
+    this->index_count = static_cast<uint32_t>(this->index_storage.size());
+    this->mesh_count = static_cast<uint32_t>(this->mesh_storage.size());
+    this->encoded_index_word_count =
+        static_cast<uint32_t>(this->encoded_index_storage.size());
+    this->p_texture_names = this->texture_name_storage.data();
+    this->texture_count = this->texture_name_count;
+    this->texture_names_size =
+        static_cast<uint32_t>(this->texture_name_storage.size());
+    this->p_materials = this->material_storage.data();
+    this->material_count =
+        static_cast<uint32_t>(this->material_storage.size());
+    this->p_material_indices = this->material_index_storage.data();
+}
+
+void Scene::encode_meshes() {
+    std::vector<float> positions;
+    std::vector<float> normals;
+    std::vector<float> uvs;
+    std::vector<uint32_t> indices;
+    std::vector<uint32_t> material_indices;
+    positions.reserve(this->position_storage.size());
+    normals.reserve(this->normal_storage.size());
+    uvs.reserve(this->uv_storage.size());
+    indices.reserve(this->index_storage.size());
+    material_indices.reserve(this->material_index_storage.size());
+    this->encoded_position_storage.clear();
+    this->encoded_index_storage.clear();
+
+    std::vector<uint32_t> unique_remap;
+    std::vector<uint32_t> fetch_remap;
+    std::vector<uint32_t> mesh_indices;
+    std::vector<uint32_t> triangle_order;
+    for (Mesh& mesh : this->mesh_storage) {
+        uint32_t const old_first_vertex = mesh.first_vertex;
+        unique_remap.resize(mesh.vertex_count);
+        uint32_t const unique_count = deduplicate_vertices(
+            &this->position_storage[3 * old_first_vertex],
+            &this->normal_storage[3 * old_first_vertex],
+            &this->uv_storage[2 * old_first_vertex], mesh.vertex_count,
+            unique_remap.data());
+
+        mesh_indices.assign(
+            this->index_storage.begin() + mesh.first_index,
+            this->index_storage.begin() + mesh.first_index + mesh.index_count);
+        for (uint32_t& index : mesh_indices) {
+            index = unique_remap[index];
+        }
+        triangle_order.resize(mesh.triangle_count());
+        optimize_vertex_cache(mesh_indices.data(), mesh.index_count,
+                              unique_count, triangle_order.data());
+        // Materials follow their triangles.
+        for (uint32_t triangle : triangle_order) {
+            material_indices.push_back(
+                this->material_index_storage[mesh.first_index / 3 + triangle]);
+        }
+        fetch_remap.resize(unique_count);
+        uint32_t const vertex_count = reorder_vertices_for_fetch(
+            mesh_indices.data(), mesh.index_count, unique_count,
+            fetch_remap.data());
+
+        // Duplicates of a vertex all land on the same slot, with the same
+        // attributes.
+        uint32_t const first_vertex =
+            static_cast<uint32_t>(positions.size() / 3);
+        positions.resize(positions.size() + 3 * vertex_count);
+        normals.resize(normals.size() + 3 * vertex_count);
+        uvs.resize(uvs.size() + 2 * vertex_count);
+        for (uint32_t i = 0; i < mesh.vertex_count; i++) {
+            uint32_t const vertex = fetch_remap[unique_remap[i]];
+            if (vertex == unused_vertex) {
+                continue;
+            }
+            uint32_t const source = old_first_vertex + i;
+            uint32_t const target = first_vertex + vertex;
+            std::copy_n(&this->position_storage[3 * source], 3,
+                        &positions[3 * target]);
+            std::copy_n(&this->normal_storage[3 * source], 3,
+                        &normals[3 * target]);
+            std::copy_n(&this->uv_storage[2 * source], 2, &uvs[2 * target]);
+        }
+        mesh.first_vertex = first_vertex;
+        mesh.vertex_count = vertex_count;
+        mesh.first_index = static_cast<uint32_t>(indices.size());
+        indices.insert(indices.end(), mesh_indices.begin(),
+                       mesh_indices.end());
+
+        size_t const encoded_begin = this->encoded_position_storage.size();
+        this->encoded_position_storage.resize(encoded_begin +
+                                              4 * size_t{vertex_count});
+        quantize_positions(&positions[3 * first_vertex], vertex_count,
+                           &this->encoded_position_storage[encoded_begin],
+                           mesh.position_scale, mesh.position_offset);
+
+        mesh.index_word_offset =
+            static_cast<uint32_t>(this->encoded_index_storage.size());
+        mesh.is_index_16_bit = vertex_count <= 65535 ? 1 : 0;
+        if (mesh.is_index_16_bit == 0) {
+            this->encoded_index_storage.insert(
+                this->encoded_index_storage.end(), mesh_indices.begin(),
+                mesh_indices.end());
+            continue;
+        }
+        // An odd count leaves the top half of the last word unused.
+        for (uint32_t i = 0; i < mesh.index_count; i += 2) {
+            uint32_t word = mesh_indices[i];
+            if (i + 1 < mesh.index_count) {
+                word |= mesh_indices[i + 1] << 16;
+            }
+            this->encoded_index_storage.push_back(word);
+        }
+    }
+
+    this->position_storage = std::move(positions);
+    this->normal_storage = std::move(normals);
+    this->uv_storage = std::move(uvs);
+    this->index_storage = std::move(indices);
+    this->material_index_storage = std::move(material_indices);
+}
+
+auto Scene::load_obj(char const* p_path) -> bool {
+    tinyobj::ObjReaderConfig reader_config;
+    reader_config.triangulate = true;
+    reader_config.vertex_color = false;
+
+    tinyobj::ObjReader reader;
+    if (!reader.ParseFromFile(p_path, reader_config)) {
+        std::cout << "Failed to load " << p_path << ": " << reader.Error();
+        return false;
+    }
+    if (!reader.Warning().empty()) {
+        std::cout << reader.Warning();
+    }
+
+    // Textures are only ever loaded as the KTX2 files next to the images
+    // that the materials name.
+    std::unordered_map<std::string, uint32_t> texture_indices;
+    this->material_storage = {Material{}};
+    for (tinyobj::material_t const& material : reader.GetMaterials()) {
+        Material& packed = this->material_storage.emplace_back();
+        packed.diffuse =
+            pack_unorm4x8(static_cast<float>(material.diffuse[0]),
+                          static_cast<float>(material.diffuse[1]),
+                          static_cast<float>(material.diffuse[2]), 1.0f);
+        if (material.diffuse_texname.empty()) {
+            continue;
+        }
+        std::string name = material.diffuse_texname;
+        size_t const extension = name.find_last_of('.');
+        size_t const separator = name.find_last_of("/\\");
+        if (extension != std::string::npos &&
+            (separator == std::string::npos || extension > separator)) {
+            name.resize(extension);
+        }
+        name += ".ktx2";
+        auto [it, is_new] =
+            texture_indices.try_emplace(name, this->texture_name_count);
+        if (is_new) {
+            this->texture_name_storage.insert(
+                this->texture_name_storage.end(), name.begin(), name.end());
+            this->texture_name_storage.push_back('\0');
+            this->texture_name_count++;
+        }
+        packed.texture_index = it->second;
+    }
+
+    tinyobj::attrib_t const& attrib = reader.GetAttrib();
+    std::unordered_map<ObjVertexKey, uint32_t, ObjVertexKeyHash> vertex_map;
+
+    for (tinyobj::shape_t const& shape : reader.GetShapes()) {
+        if (shape.mesh.indices.empty()) {
+            continue;
+        }
+        Mesh mesh = {
+            .first_vertex =
+                static_cast<uint32_t>(this->position_storage.size() / 3),
+            .vertex_count = 0,
+            .first_index = static_cast<uint32_t>(this->index_storage.size()),
+            .index_count = static_cast<uint32_t>(shape.mesh.indices.size()),
+        };
+
+        // Vertices are only shared within a mesh, so that each mesh's range
+        // can be handed to a build on its own.
+        vertex_map.clear();
+        for (tinyobj::index_t const& index : shape.mesh.indices) {
+            ObjVertexKey key = {
+                .position_index = index.vertex_index,
+                .normal_index = index.normal_index,
+                .uv_index = index.texcoord_index,
+            };
+            auto [it, is_new] = vertex_map.try_emplace(key, mesh.vertex_count);
+            if (is_new) {
+                mesh.vertex_count++;
+                for (int i = 0; i < 3; i++) {
+                    this->position_storage.push_back(
+                        attrib.vertices[3 * index.vertex_index + i]);
+                    this->normal_storage.push_back(
+                        index.normal_index >= 0
+                            ? attrib.normals[3 * index.normal_index + i]
+                            : 0.0f);
+                }
+                for (int i = 0; i < 2; i++) {
+                    this->uv_storage.push_back(
+                        index.texcoord_index >= 0
+                            ? attrib.texcoords[2 * index.texcoord_index + i]
+                            : 0.0f);
+                }
+            }
+            this->index_storage.push_back(it->second);
+        }
+        // Triangulated, so there is one material per triangle, and -1 for
+        // faces without one.
+        for (int material_id : shape.mesh.material_ids) {
+            this->material_index_storage.push_back(
+                static_cast<uint32_t>(material_id + 1));
+        }
+        this->mesh_storage.push_back(mesh);
+    }
+
+    this->encode_meshes();
+    this->point_at_storage();
+    std::cout << "Loaded " << p_path << ": " << this->mesh_count
+              << " meshes, " << this->vertex_count << " vertices, "
+              << this->index_count / 3 << " triangles, "
+              << this->material_count << " materials, "
+              << this->texture_count << " textures.\n";
+    return this->mesh_count > 0;
+}
+
+auto Scene::load(char const* p_path) -> bool {
+    SourceFileStamp const source_stamp = get_file_stamp(p_path);
+    if (source_stamp.size == SourceFileStamp::missing_size) {
+        std::cout << "Failed to find " << p_path << ".\n";
+        return false;
+    }
+
+    std::string const path = p_path;
+    size_t const separator = path.find_last_of('/');
+    this->directory =
+        separator == std::string::npos ? "" : path.substr(0, separator + 1);
+
+    std::string cache_path = path + ".cache";
+    if (this->map_cache(cache_path.c_str(), source_stamp)) {
+        std::cout << "Mapped " << cache_path << ": " << this->mesh_count
+                  << " meshes, " << this->vertex_count << " vertices, "
+                  << this->index_count / 3 << " triangles, "
+                  << this->material_count << " materials, "
+                  << this->texture_count << " textures.\n";
+        return true;
+    }
+
+    if (!this->load_obj(p_path)) {
+        return false;
+    }
+    this->stamp_material_libraries(p_path);
+    if (!this->write_cache(cache_path.c_str(), source_stamp)) {
+        std::cout << "Failed to write " << cache_path << ".\n";
+    }
+    return true;
+}
+
+void Scene::stamp_material_libraries(char const* p_path) {
+    this->material_library_name_storage = {};
+    this->material_library_stamps = {};
+    std::FILE* p_file = std::fopen(p_path, "r");
+    if (p_file == nullptr) {
+        return;
+    }
+    // Any line may name libraries, as tinyobjloader reads them, with
+    // several to a line separated by whitespace.
+    char* p_line = nullptr;
+    size_t line_capacity = 0;
+    while (getline(&p_line, &line_capacity, p_file) > 0) {
+        char const* p_token = p_line + std::strspn(p_line, " \t");
+        if (std::strncmp(p_token, "mtllib", 6) != 0 ||
+            std::strchr(" \t", p_token[6]) == nullptr || p_token[6] == '\0') {
+            continue;
+        }
+        p_token += 6;
+        while (true) {
+            p_token += std::strspn(p_token, " \t\r\n");
+            size_t const length = std::strcspn(p_token, " \t\r\n");
+            if (length == 0) {
+                break;
+            }
+            std::string const name(p_token, length);
+            this->material_library_name_storage.insert(
+                this->material_library_name_storage.end(), name.begin(),
+                name.end());
+            this->material_library_name_storage.push_back('\0');
+            this->material_library_stamps.push_back(
+                get_file_stamp((this->directory + name).c_str()));
+            p_token += length;
+        }
+    }
+    std::free(p_line);
+    std::fclose(p_file);
+}
+
+auto Scene::map_cache(char const* p_cache_path, SourceFileStamp source_stamp)
+    -> bool {
+    int file = open(p_cache_path, O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat cache_stat;
+    if (fstat(file, &cache_stat) != 0 ||
+        static_cast<size_t>(cache_stat.st_size) < sizeof(SceneCacheHeader)) {
+        close(file);
+        return false;
+    }
+    size_t file_size = static_cast<size_t>(cache_stat.st_size);
+    void* p_file = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file, 0);
+    // The mapping keeps the file alive on its own.
+    close(file);
+    if (p_file == MAP_FAILED) {
+        return false;
+    }
+
+    auto const* p_header = static_cast<SceneCacheHeader const*>(p_file);
+    if (memcmp(p_header->magic, SceneCacheHeader::expected_magic,
+               sizeof(p_header->magic)) != 0 ||
+        p_header->version != SceneCacheHeader::current_version ||
+        p_header->source_size != source_stamp.size ||
+        p_header->source_mtime_ns != source_stamp.mtime_ns ||
+        p_header->file_size != file_size ||
+        !are_cache_blobs_in_bounds(*p_header, file_size)) {
+        munmap(p_file, file_size);
+        return false;
+    }
+    char const* p_bytes = static_cast<char const*>(p_file);
+    auto const* p_meshes =
+        reinterpret_cast<Mesh const*>(p_bytes + p_header->meshes_offset);
+    auto const* p_indices =
+        reinterpret_cast<uint32_t const*>(p_bytes + p_header->indices_offset);
+    auto const* p_encoded_indices = reinterpret_cast<uint32_t const*>(
+        p_bytes + p_header->encoded_indices_offset);
+    bool is_valid = true;
+    for (uint32_t i = 0; i < p_header->mesh_count && is_valid; i++) {
+        is_valid = is_cached_mesh_in_bounds(p_meshes[i], *p_header) &&
+                   are_cached_indices_in_bounds(p_meshes[i], p_indices,
+                                                p_encoded_indices);
+    }
+    // Materials and their textures are indexed by the GPU as well.
+    auto const* p_materials = reinterpret_cast<Material const*>(
+        p_bytes + p_header->materials_offset);
+    for (uint32_t i = 0; i < p_header->material_count && is_valid; i++) {
+        is_valid = p_materials[i].texture_index == Material::no_texture ||
+                   p_materials[i].texture_index < p_header->texture_count;
+    }
+    auto const* p_material_indices = reinterpret_cast<uint32_t const*>(
+        p_bytes + p_header->material_indices_offset);
+    for (uint32_t i = 0; i < p_header->index_count / 3 && is_valid; i++) {
+        is_valid = p_material_indices[i] < p_header->material_count;
+    }
+    // Texture names are read as one C string per texture.
+    char const* p_names = p_bytes + p_header->texture_names_offset;
+    is_valid = is_valid &&
+               std::count(p_names, p_names + p_header->texture_names_size,
+                          '\0') >= p_header->texture_count;
+    // Library names are read the same way, and each must be unchanged.
+    char const* p_library_name =
+        p_bytes + p_header->material_library_names_offset;
+    is_valid =
+        is_valid &&
+        std::count(p_library_name,
+                   p_library_name + p_header->material_library_names_size,
+                   '\0') >= p_header->material_library_count;
+    auto const* p_library_stamps = reinterpret_cast<SourceFileStamp const*>(
+        p_bytes + p_header->material_library_stamps_offset);
+    for (uint32_t i = 0; i < p_header->material_library_count && is_valid;
+         i++) {
+        is_valid = get_file_stamp((this->directory + p_library_name).c_str()) ==
+                   p_library_stamps[i];
+        p_library_name += std::strlen(p_library_name) + 1;
+    }
+    if (!is_valid) {
+        munmap(p_file, file_size);
+        return false;
+    }
+
+    // Every blob is about to be streamed into the staging ring front to back.
+    madvise(p_file, file_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+
+    this->p_mapping = p_file;
+    this->mapping_size = file_size;
+    this->p_positions =
+        reinterpret_cast<float const*>(p_bytes + p_header->positions_offset);
+    this->p_normals =
+        reinterpret_cast<float const*>(p_bytes + p_header->normals_offset);
+    this->p_uvs =
+        reinterpret_cast<float const*>(p_bytes + p_header->uvs_offset);
+    this->p_indices =
+        reinterpret_cast<uint32_t const*>(p_bytes + p_header->indices_offset);
+    this->p_meshes =
+        reinterpret_cast<Mesh const*>(p_bytes + p_header->meshes_offset);
+    this->p_encoded_positions = reinterpret_cast<int16_t const*>(
+        p_bytes + p_header->encoded_positions_offset);
+    this->p_encoded_indices = reinterpret_cast<uint32_t const*>(
+        p_bytes + p_header->encoded_indices_offset);
+    this->vertex_count = p_header->vertex_count;
+    this->index_count = p_header->index_count;
+    this->mesh_count = p_header->mesh_count;
+    this->encoded_index_word_count = p_header->encoded_index_word_count;
+    this->p_texture_names = p_bytes + p_header->texture_names_offset;
+    this->texture_count = p_header->texture_count;
+    this->texture_names_size = p_header->texture_names_size;
+    this->p_materials = reinterpret_cast<Material const*>(
+        p_bytes + p_header->materials_offset);
+    this->material_count = p_header->material_count;
+    this->p_material_indices = reinterpret_cast<uint32_t const*>(
+        p_bytes + p_header->material_indices_offset);
+    return true;
+}
+
+auto Scene::write_cache(char const* p_cache_path,
+                        SourceFileStamp source_stamp) const -> bool {
+    struct Blob {
+        void const* p_data;
+        uint64_t size;
+    };
+    Blob const blobs[] = {
+        {this->p_positions, sizeof(float) * 3 * this->vertex_count},
+        {this->p_normals, sizeof(float) * 3 * this->vertex_count},
+        {this->p_uvs, sizeof(float) * 2 * this->vertex_count},
+        {this->p_indices, sizeof(uint32_t) * this->index_count},
+        {this->p_meshes, sizeof(Mesh) * this->mesh_count},
+        {this->p_encoded_positions, sizeof(int16_t) * 4 * this->vertex_count},
+        {this->p_encoded_indices,
+         sizeof(uint32_t) * this->encoded_index_word_count},
+        {this->p_texture_names, this->texture_names_size},
+        {this->p_materials, sizeof(Material) * this->material_count},
+        {this->p_material_indices, sizeof(uint32_t) * (this->index_count / 3)},
+        {this->material_library_name_storage.data(),
+         this->material_library_name_storage.size()},
+        {this->material_library_stamps.data(),
+         sizeof(SourceFileStamp) * this->material_library_stamps.size()},
+    };
+    uint64_t blob_offsets[std::size(blobs)];
+    uint64_t offset = sizeof(SceneCacheHeader);
+    for (size_t i = 0; i < std::size(blobs); i++) {
+        offset = align_up(offset, SceneCacheHeader::blob_alignment);
+        blob_offsets[i] = offset;
+        offset += blobs[i].size;
+    }
+
+    SceneCacheHeader header = {
+        .magic = {'R', 'T', 'S', 'C'},
+        .version = SceneCacheHeader::current_version,
+        .source_size = source_stamp.size,
+        .source_mtime_ns = source_stamp.mtime_ns,
+        .vertex_count = this->vertex_count,
+        .index_count = this->index_count,
+        .mesh_count = this->mesh_count,
+        .encoded_index_word_count = this->encoded_index_word_count,
+        .texture_count = this->texture_count,
+        .texture_names_size = this->texture_names_size,
+        .material_count = this->material_count,
+        .material_library_count =
+            static_cast<uint32_t>(this->material_library_stamps.size()),
+        .material_library_names_size = static_cast<uint32_t>(
+            this->material_library_name_storage.size()),
+        .positions_offset = blob_offsets[0],
+        .normals_offset = blob_offsets[1],
+        .uvs_offset = blob_offsets[2],
+        .indices_offset = blob_offsets[3],
+        .meshes_offset = blob_offsets[4],
+        .encoded_positions_offset = blob_offsets[5],
+        .encoded_indices_offset = blob_offsets[6],
+        .texture_names_offset = blob_offsets[7],
+        .materials_offset = blob_offsets[8],
+        .material_indices_offset = blob_offsets[9],
+        .material_library_names_offset = blob_offsets[10],
+        .material_library_stamps_offset = blob_offsets[11],
+        .file_size = offset,
+    };
+
+    // Write next to the cache and rename over it, so that a crash never
+    // leaves behind a truncated cache with a valid header.
+    std::string temporary_path = std::string(p_cache_path) + ".tmp";
+    int file = open(temporary_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) {
+        return false;
+    }
+    bool is_written = write_all(file, &header, sizeof(header));
+    uint64_t written_size = sizeof(header);
+    char const padding[SceneCacheHeader::blob_alignment] = {};
+    for (size_t i = 0; i < std::size(blobs) && is_written; i++) {
+        is_written = write_all(file, padding, blob_offsets[i] - written_size) &&
+                     write_all(file, blobs[i].p_data, blobs[i].size);
+        written_size = blob_offsets[i] + blobs[i].size;
+    }
+    is_written = close(file) == 0 && is_written;
+
+    if (!is_written ||
+        std::rename(temporary_path.c_str(), p_cache_path) != 0) {
+        unlink(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void Scene::load_triangle() {
+    this->position_storage = {
+        1.0f,  1.0f,  0.0f,  //
+        -1.0f, 1.0f,  0.0f,  //
+        0.0f,  -1.0f, 0.0f,  //
+    };
+    this->normal_storage = {
+        0.0f, 0.0f, 1.0f,  //
+        0.0f, 0.0f, 1.0f,  //
+        0.0f, 0.0f, 1.0f,  //
+    };
+    this->uv_storage = {
+        1.0f, 1.0f,  //
+        0.0f, 1.0f,  //
+        0.5f, 0.0f,  //
+    };
+    this->index_storage = {0, 1, 2};
+    this->material_storage = {Material{}};
+    this->material_index_storage = {0};
+    this->mesh_storage = {
+        {
+            .first_vertex = 0,
+            .vertex_count = 3,
+            .first_index = 0,
+            .index_count = 3,
+        },
+    };
+    this->encode_meshes();
+    this->point_at_storage();
+}
+
+void Scene::load_grid(uint32_t triangle_count, uint32_t mesh_count) {
+    this->free();
+
+    uint32_t const quad_count = (triangle_count / mesh_count + 1) / 2;
+    uint32_t const columns = static_cast<uint32_t>(
+        std::ceil(std::sqrt(static_cast<double>(quad_count))));
+    uint32_t const rows = (quad_count + columns - 1) / columns;
+    float const spacing = 1.0f / static_cast<float>(columns);
+
+    for (uint32_t mesh = 0; mesh < mesh_count; mesh++) {
+        uint32_t const first_vertex =
+            static_cast<uint32_t>(this->position_storage.size() / 3);
+        uint32_t const first_index =
+            static_cast<uint32_t>(this->index_storage.size());
+
+        for (uint32_t y = 0; y <= rows; y++) {
+            for (uint32_t x = 0; x <= columns; x++) {
+                float const u = static_cast<float>(x) * spacing;
+                float const v = static_cast<float>(y) * spacing;
+                // Ripples give the builders something other than a plane.
+                float const height =
+                    0.05f * std::sin(20.0f * u) * std::cos(20.0f * v);
+                this->position_storage.insert(
+                    this->position_storage.end(),
+                    {1.1f * static_cast<float>(mesh) + u, height, -v});
+                this->normal_storage.insert(this->normal_storage.end(),
+                                            {0.0f, 1.0f, 0.0f});
+                this->uv_storage.insert(this->uv_storage.end(), {u, v});
+            }
+        }
+
+        // Only emit `quad_count` quads, so the last row may be partial.
+        for (uint32_t quad = 0; quad < quad_count; quad++) {
+            uint32_t const x = quad % columns;
+            uint32_t const y = quad / columns;
+            uint32_t const corner = y * (columns + 1) + x;
+            this->index_storage.insert(
+                this->index_storage.end(),
+                {corner, corner + 1, corner + columns + 1,  //
+                 corner + 1, corner + columns + 2, corner + columns + 1});
+        }
+
+        this->mesh_storage.push_back({
+            .first_vertex = first_vertex,
+            .vertex_count = (rows + 1) * (columns + 1),
+            .first_index = first_index,
+            .index_count =
+                static_cast<uint32_t>(this->index_storage.size()) - first_index,
+        });
+    }
+    this->material_storage = {Material{}};
+    this->material_index_storage.assign(this->index_storage.size() / 3, 0);
+    this->encode_meshes();
+    this->point_at_storage();
+}
+
+void Scene::free() {
+    if (this->p_mapping != nullptr) {
+        munmap(this->p_mapping, this->mapping_size);
+        this->p_mapping = nullptr;
+        this->mapping_size = 0;
+    }
+    this->position_storage = {};
+    this->normal_storage = {};
+    this->uv_storage = {};
+    this->index_storage = {};
+    this->mesh_storage = {};
+    this->encoded_position_storage = {};
+    this->encoded_index_storage = {};
+    this->texture_name_storage = {};
+    this->texture_name_count = 0;
+    this->material_storage = {};
+    this->material_index_storage = {};
+    this->material_library_name_storage = {};
+    this->material_library_stamps = {};
+    this->point_at_storage();
+}
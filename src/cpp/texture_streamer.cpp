@@ -0,0 +1,316 @@
+#include "texture_streamer.hpp"
+
+#include <algorithm>
+#include <iostream>
+
+#include "trace.hpp"
+
+void TextureStreamer::initialize(VkDevice& logical_device,
+                                 DeviceAllocator& allocator,
+                                 UploadManager& uploader) {
+    this->logical_device = logical_device;
+    this->p_allocator = &allocator;
+    this->p_uploader = &uploader;
+}
+
+auto TextureStreamer::add(char const* p_path) -> uint32_t {
+    TRACE_ZONE("add_texture");
+    auto const texture_index = static_cast<uint32_t>(this->textures.size());
+    Texture& texture = this->textures.emplace_back();
+    if (!texture.file.load(p_path)) {
+        return texture_index;
+    }
+    // Every file is block compressed, which the device must both support
+    // and have been created with.
+    VkFormatProperties format_properties;
+    vkGetPhysicalDeviceFormatProperties(this->p_allocator->physical_device,
+                                        texture.file.format,
+                                        &format_properties);
+    if (!this->is_block_compression_enabled ||
+        (format_properties.optimalTilingFeatures &
+         VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) == 0) {
+        std::cout << "The device can not sample " << p_path
+                  << ", so its materials are left untextured.\n";
+        texture.file.free();
+        return texture_index;
+    }
+    VkFormatFeatureFlags const copy_features =
+        VK_FORMAT_FEATURE_TRANSFER_SRC_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT;
+    texture.can_copy_levels =
+        (format_properties.optimalTilingFeatures & copy_features) ==
+        copy_features;
+
+    texture.coarse_level = texture.file.level_count - 1;
+    for (uint32_t i = 0; i < texture.file.level_count; i++) {
+        if (texture.file.level_width(i) <= this->coarse_level_size &&
+            texture.file.level_height(i) <= this->coarse_level_size) {
+            texture.coarse_level = i;
+            break;
+        }
+    }
+    texture.requested_level = texture.coarse_level;
+    this->make_resident(texture, texture.coarse_level, 0);
+    return texture_index;
+}
+
+void TextureStreamer::request(uint32_t texture_index, uint32_t level,
+                              uint64_t frame) {
+    if (texture_index >= this->textures.size()) {
+        return;
+    }
+    Texture& texture = this->textures[texture_index];
+    if (texture.image == VK_NULL_HANDLE) {
+        return;
+    }
+    level = std::min(level, texture.coarse_level);
+    // A new frame's requests replace the old ones, while requests from the
+    // same frame keep the finest level.
+    if (frame != texture.last_requested_frame) {
+        texture.requested_level = level;
+        texture.last_requested_frame = frame;
+    } else {
+        texture.requested_level = std::min(texture.requested_level, level);
+    }
+}
+
+void TextureStreamer::update(uint64_t frame, uint64_t first_pending_frame) {
+    TRACE_ZONE("stream_textures");
+    for (size_t i = 0; i < this->retired_images.size();) {
+        if (this->retired_images[i].frame <= first_pending_frame) {
+            this->retired_size -= this->retired_images[i].allocation.size;
+            this->release(this->retired_images[i]);
+            this->retired_images[i] = this->retired_images.back();
+            this->retired_images.pop_back();
+        } else {
+            i++;
+        }
+    }
+
+    // The most recently requested textures stream first.
+    std::vector<uint32_t> candidates;
+    for (uint32_t i = 0; i < this->textures.size(); i++) {
+        Texture const& texture = this->textures[i];
+        if (texture.image != VK_NULL_HANDLE &&
+            texture.requested_level < texture.resident_level) {
+            candidates.push_back(i);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(),
+              [this](uint32_t a, uint32_t b) {
+                  return this->textures[a].last_requested_frame >
+                         this->textures[b].last_requested_frame;
+              });
+
+    VkDeviceSize bytes_uploaded = 0;
+    for (uint32_t candidate : candidates) {
+        Texture& texture = this->textures[candidate];
+        uint32_t const level = texture.resident_level - 1;
+        VkDeviceSize const level_size = texture.file.levels[level].size;
+        // Only the new level is read from the file when the rest can be
+        // copied on the GPU.
+        VkDeviceSize upload_size = level_size;
+        if (!texture.can_copy_levels) {
+            for (uint32_t i = texture.resident_level;
+                 i < texture.file.level_count; i++) {
+                upload_size += texture.file.levels[i].size;
+            }
+        }
+        if (bytes_uploaded > 0 &&
+            bytes_uploaded + upload_size > this->max_bytes_per_update) {
+            break;
+        }
+
+        // The grown image is made while the old one still exists, so both
+        // must fit at once.
+        VkDeviceSize const needed_size = texture.resident_size + level_size;
+
+        // Evict whole levels from the least recently requested textures,
+        // but never from one that was requested as recently as this one,
+        // which would only thrash.
+        while (this->resident_size + needed_size > this->memory_budget) {
+            Texture* p_victim = nullptr;
+            for (Texture& other : this->textures) {
+                if (other.resident_level == other.coarse_level ||
+                    other.last_requested_frame >=
+                        texture.last_requested_frame) {
+                    continue;
+                }
+                if (p_victim == nullptr || other.last_requested_frame <
+                                               p_victim->last_requested_frame) {
+                    p_victim = &other;
+                }
+            }
+            if (p_victim == nullptr) {
+                return;
+            }
+            VkDeviceSize freed_size = 0;
+            uint32_t victim_level = p_victim->resident_level;
+            while (victim_level < p_victim->coarse_level &&
+                   this->resident_size - freed_size + needed_size >
+                       this->memory_budget) {
+                freed_size += p_victim->file.levels[victim_level].size;
+                victim_level++;
+            }
+            this->levels_evicted += victim_level - p_victim->resident_level;
+            bytes_uploaded += this->make_resident(*p_victim, victim_level,
+                                                  frame);
+        }
+        // Evicted images are only freed once no frame reads them, so the
+        // level waits until they are.
+        if (this->resident_size + this->retired_size + needed_size >
+            this->memory_budget) {
+            return;
+        }
+
+        bytes_uploaded += this->make_resident(texture, level, frame);
+        this->levels_streamed++;
+    }
+}
+
+auto TextureStreamer::make_resident(Texture& texture, uint32_t level,
+                                    uint64_t frame) -> VkDeviceSize {
+    TRACE_ZONE("make_resident");
+    Ktx2File const& file = texture.file;
+    VkImageCreateInfo image_create_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType = VK_IMAGE_TYPE_2D,
+        .format = file.format,
+        .extent =
+            {
+                .width = file.level_width(level),
+                .height = file.level_height(level),
+                .depth = 1,
+            },
+        .mipLevels = file.level_count - level,
+        .arrayLayers = 1,
+        .samples = VK_SAMPLE_COUNT_1_BIT,
+        .tiling = VK_IMAGE_TILING_OPTIMAL,
+        // Copied out of when it is replaced, if the format allows it.
+        .usage = (texture.can_copy_levels ? VK_IMAGE_USAGE_TRANSFER_SRC_BIT
+                                          : VkImageUsageFlags{0}) |
+                 VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        // Shared like buffers are, so that the transfer queue's uploads need
+        // no ownership transfer.
+        .sharingMode = this->p_allocator->queue_family_count > 1
+                           ? VK_SHARING_MODE_CONCURRENT
+                           : VK_SHARING_MODE_EXCLUSIVE,
+        .queueFamilyIndexCount = this->p_allocator->queue_family_count,
+        .pQueueFamilyIndices = this->p_allocator->queue_family_indices,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+    };
+    VkImage image;
+    if (vkCreateImage(this->logical_device, &image_create_info, nullptr,
+                      &image) != VK_SUCCESS) {
+        stx::panic("Failed to create a texture image!");
+    }
+    VkMemoryRequirements memory_requirements;
+    vkGetImageMemoryRequirements(this->logical_device, image,
+                                 &memory_requirements);
+    Allocation allocation = this->p_allocator->allocate(
+        memory_requirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+    if (vkBindImageMemory(this->logical_device, image, allocation.memory,
+                          allocation.offset) != VK_SUCCESS) {
+        stx::panic("Failed to bind texture memory!");
+    }
+
+    VkImageViewCreateInfo image_view_create_info = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = image,
+        .viewType = VK_IMAGE_VIEW_TYPE_2D,
+        .format = file.format,
+        .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = file.level_count - level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+    };
+    VkImageView view;
+    if (vkCreateImageView(this->logical_device, &image_view_create_info,
+                          nullptr, &view) != VK_SUCCESS) {
+        stx::panic("Failed to create a texture view!");
+    }
+
+    // Levels the old image already has are copied over if the format
+    // allows it, and only the rest are read from the file.
+    bool const has_image = texture.image != VK_NULL_HANDLE;
+    VkDeviceSize bytes_uploaded = 0;
+    for (uint32_t i = level; i < file.level_count; i++) {
+        if (has_image && texture.can_copy_levels &&
+            i >= texture.resident_level) {
+            this->p_uploader->copy_image_level(
+                texture.image, i - texture.resident_level, image, i - level,
+                file.level_width(i), file.level_height(i));
+            continue;
+        }
+        this->p_uploader->upload_image_level(
+            image, i - level, file.level_width(i), file.level_height(i),
+            file.block_size, file.level_data(i));
+        bytes_uploaded += file.levels[i].size;
+    }
+    this->bytes_streamed += bytes_uploaded;
+
+    if (has_image) {
+        // Frame `frame` no longer samples the old image, but it is the
+        // first frame to wait on the copies out of it.
+        this->retired_images.push_back({
+            .image = texture.image,
+            .view = texture.view,
+            .allocation = texture.allocation,
+            .frame = frame + 1,
+        });
+        this->retired_size += texture.allocation.size;
+    }
+    this->resident_size =
+        this->resident_size - texture.resident_size + allocation.size;
+    texture.image = image;
+    texture.view = view;
+    texture.allocation = allocation;
+    texture.resident_level = level;
+    texture.resident_size = allocation.size;
+    this->are_views_dirty = true;
+    return bytes_uploaded;
+}
+
+void TextureStreamer::release(RetiredImage& retired_image) {
+    vkDestroyImageView(this->logical_device, retired_image.view, nullptr);
+    vkDestroyImage(this->logical_device, retired_image.image, nullptr);
+    this->p_allocator->deallocate(retired_image.allocation);
+}
+
+void TextureStreamer::print_stats() const {
+    uint32_t resident_count = 0;
+    for (Texture const& texture : this->textures) {
+        resident_count += texture.image != VK_NULL_HANDLE ? 1 : 0;
+    }
+    std::cout << "Textures: " << resident_count << " of "
+              << this->textures.size() << " loaded, "
+              << this->resident_size / (1024 * 1024) << " of "
+              << this->memory_budget / (1024 * 1024) << " MiB resident, "
+              << this->levels_streamed << " levels streamed in and "
+              << this->levels_evicted << " evicted, " << this->bytes_streamed
+              << " bytes uploaded.\n";
+}
+
+void TextureStreamer::free() {
+    for (RetiredImage& retired_image : this->retired_images) {
+        this->release(retired_image);
+    }
+    this->retired_images.clear();
+    for (Texture& texture : this->textures) {
+        if (texture.image != VK_NULL_HANDLE) {
+            RetiredImage retired_image = {
+                .image = texture.image,
+                .view = texture.view,
+                .allocation = texture.allocation,
+            };
+            this->release(retired_image);
+        }
+        texture.file.free();
+    }
+    this->textures.clear();
+    this->resident_size = 0;
+    this->retired_size = 0;
+}
@@ -0,0 +1,84 @@
+#include "thread_pool.hpp"
+
+#include <new>
+
+void ThreadPool::initialize(uint32_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::thread::hardware_concurrency();
+    }
+    this->thread_count = thread_count > 0 ? thread_count : 1;
+    this->p_workers =
+        new (std::nothrow) std::thread[this->thread_count - 1];
+    for (uint32_t i = 1; i < this->thread_count; i++) {
+        this->p_workers[i - 1] = std::thread(&ThreadPool::work, this, i);
+    }
+}
+
+void ThreadPool::run(uint32_t thread_count, Function p_function,
+                     void* p_data) {
+    if (thread_count == 0 || thread_count > this->thread_count) {
+        thread_count = this->thread_count;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->p_function = p_function;
+        this->p_data = p_data;
+        this->active_thread_count = thread_count;
+        this->remaining_thread_count = thread_count - 1;
+        this->generation++;
+    }
+    if (thread_count > 1) {
+        this->work_ready.notify_all();
+    }
+
+    p_function(0, p_data);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->work_done.wait(
+        lock, [this] { return this->remaining_thread_count == 0; });
+}
+
+void ThreadPool::work(uint32_t thread_index) {
+    uint64_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (true) {
+        this->work_ready.wait(lock, [this, seen_generation] {
+            return this->should_exit || this->generation != seen_generation;
+        });
+        if (this->should_exit) {
+            return;
+        }
+        seen_generation = this->generation;
+        if (thread_index >= this->active_thread_count) {
+            continue;
+        }
+
+        Function p_function = this->p_function;
+        void* p_data = this->p_data;
+        lock.unlock();
+        p_function(thread_index, p_data);
+        lock.lock();
+
+        if (--this->remaining_thread_count == 0) {
+            this->work_done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::free() {
+    if (this->p_workers == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->should_exit = true;
+    }
+    this->work_ready.notify_all();
+    for (uint32_t i = 1; i < this->thread_count; i++) {
+        this->p_workers[i - 1].join();
+    }
+    delete[] this->p_workers;
+    this->p_workers = nullptr;
+    this->thread_count = 1;
+    this->should_exit = false;
+}
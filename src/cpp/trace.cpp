@@ -0,0 +1,93 @@
+#include "trace.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace trace {
+
+namespace {
+
+// Buffers are only registered once per thread, and never freed, so that
+// events outlive their threads until they are written.
+std::mutex buffers_mutex;
+std::vector<ThreadBuffer*> buffers;
+thread_local ThreadBuffer* p_thread_buffer = nullptr;
+
+auto get_thread_buffer() -> ThreadBuffer* {
+    if (p_thread_buffer == nullptr) {
+        p_thread_buffer = new (std::nothrow) ThreadBuffer;
+        std::lock_guard<std::mutex> lock(buffers_mutex);
+        p_thread_buffer->thread_index = static_cast<uint32_t>(buffers.size());
+        buffers.push_back(p_thread_buffer);
+    }
+    return p_thread_buffer;
+}
+
+auto const start_time = std::chrono::steady_clock::now();
+
+}  // namespace
+
+auto now_ns() -> uint64_t {
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start_time)
+            .count());
+}
+
+void record(char const* p_name, uint64_t begin_ns, uint64_t end_ns) {
+    ThreadBuffer* p_buffer = get_thread_buffer();
+    uint32_t const event_index =
+        p_buffer->event_count.load(std::memory_order_relaxed);
+    if (event_index == ThreadBuffer::capacity) {
+        p_buffer->dropped_event_count++;
+        return;
+    }
+    p_buffer->events[event_index] = {
+        .p_name = p_name,
+        .begin_ns = begin_ns,
+        .end_ns = end_ns,
+    };
+    p_buffer->event_count.store(event_index + 1, std::memory_order_release);
+}
+
+auto write_chrome_json(char const* p_path) -> bool {
+    std::FILE* p_file = std::fopen(p_path, "w");
+    if (p_file == nullptr) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(buffers_mutex);
+    std::fprintf(p_file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool is_first = true;
+    uint32_t dropped_event_count = 0;
+    for (ThreadBuffer const* p_buffer : buffers) {
+        uint32_t const event_count =
+            p_buffer->event_count.load(std::memory_order_acquire);
+        for (uint32_t i = 0; i < event_count; i++) {
+            Event const& event = p_buffer->events[i];
+            // Complete events, with timestamps in microseconds.
+            std::fprintf(p_file,
+                         "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,"
+                         "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                         is_first ? "" : ",\n", event.p_name,
+                         p_buffer->thread_index,
+                         static_cast<double>(event.begin_ns) / 1e3,
+                         static_cast<double>(event.end_ns - event.begin_ns) /
+                             1e3);
+            is_first = false;
+        }
+        dropped_event_count += p_buffer->dropped_event_count;
+    }
+    std::fprintf(p_file, "\n]}\n");
+
+    if (dropped_event_count > 0) {
+        std::printf("Dropped %u trace events from full buffers.\n",
+                    dropped_event_count);
+    }
+    return std::fclose(p_file) == 0;
+}
+
+}  // namespace trace
@@ -0,0 +1,477 @@
+#include "upload.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <vulkan/vulkan_core.h>
+
+#include "trace.hpp"
+
+void UploadManager::initialize(VkDevice& logical_device,
+                               DeviceAllocator& allocator,
+                               uint32_t queue_family_index, VkQueue& queue,
+                               VkDeviceSize ring_size) {
+    this->logical_device = logical_device;
+    this->p_allocator = &allocator;
+    this->queue = queue;
+    this->ring_size = ring_size;
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(allocator.physical_device,
+                                             &queue_family_count, nullptr);
+    VkQueueFamilyProperties* p_queue_families =
+        new (std::nothrow) VkQueueFamilyProperties[queue_family_count];
+    vkGetPhysicalDeviceQueueFamilyProperties(
+        allocator.physical_device, &queue_family_count, p_queue_families);
+    this->image_transfer_granularity =
+        p_queue_families[queue_family_index].minImageTransferGranularity;
+    delete[] p_queue_families;
+
+    VkCommandPoolCreateInfo command_pool_create_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT |
+                 VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+        .queueFamilyIndex = queue_family_index,
+    };
+    if (vkCreateCommandPool(this->logical_device, &command_pool_create_info,
+                            nullptr, &this->cmd_pool) != VK_SUCCESS) {
+        stx::panic("Failed to create the upload command pool!");
+    }
+
+    VkCommandBufferAllocateInfo buffer_allocate_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .commandPool = this->cmd_pool,
+        .level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandBufferCount = 1,
+    };
+    VkSemaphoreTypeCreateInfo semaphore_type_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+    VkSemaphoreCreateInfo semaphore_create_info = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &semaphore_type_create_info,
+    };
+    if (vkCreateSemaphore(this->logical_device, &semaphore_create_info,
+                          nullptr, &this->timeline) != VK_SUCCESS) {
+        stx::panic("Failed to create the upload timeline semaphore!");
+    }
+
+    VkFenceCreateInfo fence_create_info = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+    };
+    for (Batch& batch : this->batches) {
+        if (vkAllocateCommandBuffers(this->logical_device,
+                                     &buffer_allocate_info,
+                                     &batch.cmd_buffer) != VK_SUCCESS) {
+            stx::panic("Failed to allocate an upload command buffer!");
+        }
+        if (vkCreateFence(this->logical_device, &fence_create_info, nullptr,
+                          &batch.fence) != VK_SUCCESS) {
+            stx::panic("Failed to create an upload fence!");
+        }
+    }
+
+    create_buffer(allocator, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                  this->ring_size, this->ring_buffer, &this->ring_allocation);
+}
+
+void UploadManager::begin_batch(VkDeviceSize ring_begin) {
+    Batch& batch = this->batches[this->current_batch];
+    if (batch.is_pending) {
+        this->retire(this->current_batch, true);
+    }
+
+    VkCommandBufferBeginInfo command_buffer_begin_info = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+    if (vkBeginCommandBuffer(batch.cmd_buffer, &command_buffer_begin_info) !=
+        VK_SUCCESS) {
+        stx::panic("Failed to begin an upload command buffer!");
+    }
+    batch.copy_count = 0;
+    this->batch_begin = ring_begin;
+    this->is_recording = true;
+    if (this->p_profiler != nullptr) {
+        this->batch_scope =
+            this->p_profiler->begin_scope(batch.cmd_buffer, "upload");
+    }
+}
+
+void UploadManager::retire(uint32_t batch_index, bool should_wait) {
+    Batch& batch = this->batches[batch_index];
+    if (should_wait) {
+        TRACE_ZONE("upload_wait");
+        if (vkWaitForFences(this->logical_device, 1, &batch.fence, VK_TRUE,
+                            UINT64_MAX) != VK_SUCCESS) {
+            stx::panic("Failed to wait on an upload fence!");
+        }
+    } else if (vkGetFenceStatus(this->logical_device, batch.fence) !=
+               VK_SUCCESS) {
+        return;
+    }
+    vkResetFences(this->logical_device, 1, &batch.fence);
+    // Batches retire in submission order, so everything before this batch's
+    // end is free again.
+    this->tail = batch.ring_end;
+    batch.is_pending = false;
+}
+
+auto UploadManager::reserve(VkDeviceSize size, VkDeviceSize alignment)
+    -> VkDeviceSize {
+    VkDeviceSize start = align_up(this->head, alignment);
+    VkDeviceSize position = start % this->ring_size;
+    if (position + size > this->ring_size) {
+        // Skip the end of the ring rather than splitting a copy across it.
+        start += this->ring_size - position;
+        position = 0;
+    }
+
+    while (start + size - this->tail > this->ring_size) {
+        // The oldest pending batch is the first one after the current slot.
+        bool has_retired = false;
+        for (uint32_t i = 0; i < max_batches_in_flight; i++) {
+            uint32_t batch_index =
+                (this->current_batch + i) % max_batches_in_flight;
+            if (this->batches[batch_index].is_pending) {
+                this->retire(batch_index, true);
+                has_retired = true;
+                break;
+            }
+        }
+        if (!has_retired) {
+            // Only the batch being recorded is holding ring space.
+            this->flush();
+        }
+    }
+
+    this->head = start + size;
+    return position;
+}
+
+void UploadManager::upload_buffer(VkBuffer dst_buffer, VkDeviceSize dst_offset,
+                                  void const* p_data, VkDeviceSize size) {
+    // No single copy may hold more than half of the ring, so that one can
+    // always fit after the older batches retire.
+    VkDeviceSize const max_copy_size = this->ring_size / 2;
+    VkDeviceSize const flush_threshold =
+        this->ring_size / max_batches_in_flight;
+    char const* p_bytes = static_cast<char const*>(p_data);
+
+    while (size > 0) {
+        VkDeviceSize copy_size = size < max_copy_size ? size : max_copy_size;
+        VkDeviceSize ring_offset = this->reserve(copy_size, 16);
+        if (!this->is_recording) {
+            // The copy just reserved is the batch's first.
+            this->begin_batch(this->head - copy_size);
+        }
+
+        memcpy(static_cast<char*>(this->ring_allocation.p_mapped) +
+                   ring_offset,
+               p_bytes, copy_size);
+        VkBufferCopy buffer_copy = {
+            .srcOffset = ring_offset,
+            .dstOffset = dst_offset,
+            .size = copy_size,
+        };
+        Batch& batch = this->batches[this->current_batch];
+        vkCmdCopyBuffer(batch.cmd_buffer, this->ring_buffer, dst_buffer, 1,
+                        &buffer_copy);
+        batch.copy_count++;
+
+        p_bytes += copy_size;
+        dst_offset += copy_size;
+        size -= copy_size;
+        this->bytes_uploaded += copy_size;
+
+        // Hand big batches to the GPU early, so their ring space can be
+        // recycled while later copies are still being recorded.
+        if (this->head - this->batch_begin >= flush_threshold) {
+            this->flush();
+        }
+    }
+}
+
+void UploadManager::record_image_barrier(VkImage image, uint32_t mip_level,
+                                         VkImageLayout old_layout,
+                                         VkImageLayout new_layout) {
+    bool const is_to_transfer =
+        new_layout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    // Transfer-only queues can not name the ray tracing stage, and rely on
+    // the timeline semaphore instead.
+    VkPipelineStageFlags dst_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkAccessFlags dst_access = VK_ACCESS_TRANSFER_WRITE_BIT;
+    if (!is_to_transfer) {
+        dst_stage = this->is_transfer_only
+                        ? VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT
+                        : VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR;
+        dst_access = this->is_transfer_only ? VkAccessFlags{0}
+                                            : VK_ACCESS_SHADER_READ_BIT;
+    }
+    VkImageMemoryBarrier image_memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .srcAccessMask = is_to_transfer ? VkAccessFlags{0}
+                                        : VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = dst_access,
+        .oldLayout = old_layout,
+        .newLayout = new_layout,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .image = image,
+        .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = mip_level,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+    };
+    vkCmdPipelineBarrier(this->batches[this->current_batch].cmd_buffer,
+                         is_to_transfer ? VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT
+                                        : VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         dst_stage, 0, 0, nullptr, 0, nullptr, 1,
+                         &image_memory_barrier);
+}
+
+void UploadManager::upload_image_level(VkImage dst_image, uint32_t mip_level,
+                                       uint32_t width, uint32_t height,
+                                       uint32_t block_size,
+                                       void const* p_data) {
+    uint32_t const block_row_count = (height + 3) / 4;
+    VkDeviceSize const row_size = VkDeviceSize{(width + 3) / 4} * block_size;
+    // Runs start on a multiple of the queue's granularity, which is counted
+    // in blocks for compressed formats. A zero granularity only allows
+    // whole levels.
+    uint32_t const row_granularity = this->image_transfer_granularity.height;
+    VkDeviceSize max_rows_per_copy = block_row_count;
+    if (row_granularity != 0) {
+        max_rows_per_copy = this->ring_size / 2 / row_size / row_granularity *
+                            row_granularity;
+        max_rows_per_copy = std::max<VkDeviceSize>(max_rows_per_copy,
+                                                   row_granularity);
+    }
+    if (std::min<VkDeviceSize>(max_rows_per_copy, block_row_count) *
+            row_size >
+        this->ring_size / 2) {
+        stx::panic("An image level can not be split to fit the staging "
+                   "ring!");
+    }
+    VkDeviceSize const flush_threshold =
+        this->ring_size / max_batches_in_flight;
+    char const* p_bytes = static_cast<char const*>(p_data);
+
+    for (uint32_t row = 0; row < block_row_count;) {
+        auto const row_count = static_cast<uint32_t>(std::min<VkDeviceSize>(
+            max_rows_per_copy, block_row_count - row));
+        VkDeviceSize const copy_size = row_count * row_size;
+        VkDeviceSize const ring_offset = this->reserve(copy_size, 16);
+        if (!this->is_recording) {
+            this->begin_batch(this->head - copy_size);
+        }
+        if (row == 0) {
+            this->record_image_barrier(dst_image, mip_level,
+                                       VK_IMAGE_LAYOUT_UNDEFINED,
+                                       VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        }
+
+        memcpy(static_cast<char*>(this->ring_allocation.p_mapped) +
+                   ring_offset,
+               p_bytes, copy_size);
+        // Only the last run may end on a partial block row.
+        VkBufferImageCopy buffer_image_copy = {
+            .bufferOffset = ring_offset,
+            .bufferRowLength = 0,
+            .bufferImageHeight = 0,
+            .imageSubresource =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel = mip_level,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1,
+                },
+            .imageOffset = {0, static_cast<int32_t>(4 * row), 0},
+            .imageExtent = {width, std::min(4 * row_count, height - 4 * row),
+                            1},
+        };
+        Batch& batch = this->batches[this->current_batch];
+        vkCmdCopyBufferToImage(batch.cmd_buffer, this->ring_buffer, dst_image,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                               &buffer_image_copy);
+        batch.copy_count++;
+
+        p_bytes += copy_size;
+        row += row_count;
+        this->bytes_uploaded += copy_size;
+        if (row < block_row_count &&
+            this->head - this->batch_begin >= flush_threshold) {
+            this->flush();
+        }
+    }
+
+    this->record_image_barrier(dst_image, mip_level,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               VK_IMAGE_LAYOUT_GENERAL);
+    if (this->head - this->batch_begin >= flush_threshold) {
+        this->flush();
+    }
+}
+
+void UploadManager::copy_image_level(VkImage src_image,
+                                     uint32_t src_mip_level,
+                                     VkImage dst_image,
+                                     uint32_t dst_mip_level, uint32_t width,
+                                     uint32_t height) {
+    if (!this->is_recording) {
+        this->begin_batch(this->head);
+    }
+    VkCommandBuffer p_command_buffer =
+        this->batches[this->current_batch].cmd_buffer;
+    // The source level was written by an earlier upload on this queue,
+    // whose last barrier only made it visible to shaders.
+    VkMemoryBarrier memory_barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+        .dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT,
+    };
+    vkCmdPipelineBarrier(p_command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1,
+                         &memory_barrier, 0, nullptr, 0, nullptr);
+    this->record_image_barrier(dst_image, dst_mip_level,
+                               VK_IMAGE_LAYOUT_UNDEFINED,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+    VkImageCopy image_copy = {
+        .srcSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = src_mip_level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .srcOffset = {0, 0, 0},
+        .dstSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = dst_mip_level,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .dstOffset = {0, 0, 0},
+        .extent = {width, height, 1},
+    };
+    vkCmdCopyImage(p_command_buffer, src_image, VK_IMAGE_LAYOUT_GENERAL,
+                   dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                   &image_copy);
+    this->batches[this->current_batch].copy_count++;
+
+    this->record_image_barrier(dst_image, dst_mip_level,
+                               VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                               VK_IMAGE_LAYOUT_GENERAL);
+}
+
+void UploadManager::flush() {
+    if (!this->is_recording) {
+        return;
+    }
+    Batch& batch = this->batches[this->current_batch];
+
+    // Make the copies visible to anything submitted to this queue later.
+    if (!this->is_transfer_only) {
+        VkMemoryBarrier memory_barrier = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+            .srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT,
+            .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR |
+                             VK_ACCESS_SHADER_READ_BIT |
+                             VK_ACCESS_TRANSFER_READ_BIT,
+        };
+        vkCmdPipelineBarrier(
+            batch.cmd_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR |
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR |
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0, 1, &memory_barrier, 0, nullptr, 0, nullptr);
+    }
+    if (this->p_profiler != nullptr) {
+        this->p_profiler->end_scope(batch.cmd_buffer, this->batch_scope);
+    }
+
+    if (vkEndCommandBuffer(batch.cmd_buffer) != VK_SUCCESS) {
+        stx::panic("Failed to end an upload command buffer!");
+    }
+    uint64_t const signal_value = this->timeline_value + 1;
+    VkTimelineSemaphoreSubmitInfo timeline_semaphore_submit_info = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = 1,
+        .pSignalSemaphoreValues = &signal_value,
+    };
+    VkSubmitInfo submit_info = {
+        .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &timeline_semaphore_submit_info,
+        .commandBufferCount = 1,
+        .pCommandBuffers = &batch.cmd_buffer,
+        .signalSemaphoreCount = 1,
+        .pSignalSemaphores = &this->timeline,
+    };
+    {
+        TRACE_ZONE("upload_submit");
+        if (vkQueueSubmit(this->queue, 1, &submit_info, batch.fence) !=
+            VK_SUCCESS) {
+            stx::panic("Failed to submit an upload batch!");
+        }
+    }
+
+    batch.ring_end = this->head;
+    batch.is_pending = true;
+    this->timeline_value = signal_value;
+    this->submit_count++;
+    this->current_batch = (this->current_batch + 1) % max_batches_in_flight;
+    this->is_recording = false;
+}
+
+void UploadManager::poll() {
+    for (uint32_t i = 0; i < max_batches_in_flight; i++) {
+        uint32_t batch_index =
+            (this->current_batch + i) % max_batches_in_flight;
+        Batch& batch = this->batches[batch_index];
+        if (!batch.is_pending) {
+            continue;
+        }
+        this->retire(batch_index, false);
+        if (batch.is_pending) {
+            // Retire strictly in order, to keep `tail` monotonic.
+            return;
+        }
+    }
+}
+
+void UploadManager::wait_idle() {
+    this->flush();
+    for (uint32_t i = 0; i < max_batches_in_flight; i++) {
+        uint32_t batch_index =
+            (this->current_batch + i) % max_batches_in_flight;
+        if (this->batches[batch_index].is_pending) {
+            this->retire(batch_index, true);
+        }
+    }
+}
+
+void UploadManager::print_stats() const {
+    std::cout << "Uploads: " << this->bytes_uploaded << " bytes in "
+              << this->submit_count << " submits.\n";
+}
+
+void UploadManager::free() {
+    this->wait_idle();
+    for (Batch& batch : this->batches) {
+        vkDestroyFence(this->logical_device, batch.fence, nullptr);
+    }
+    vkDestroySemaphore(this->logical_device, this->timeline, nullptr);
+    vkDestroyCommandPool(this->logical_device, this->cmd_pool, nullptr);
+    destroy_buffer(*this->p_allocator, this->ring_buffer,
+                   &this->ring_allocation);
+}
@@ -3,15 +3,29 @@
 #include <stx/panic.h>
 #include <vulkan/vulkan.h>
 
+#include "memory.hpp"
+
 struct AccelerationStructure {
-    VkAccelerationStructureKHR handle;
+    VkAccelerationStructureKHR handle = VK_NULL_HANDLE;
     uint64_t device_address = 0;
-    VkDeviceMemory memory;
-    VkBuffer buffer;
+    VkBuffer buffer = VK_NULL_HANDLE;
+    Allocation allocation;
+    VkDeviceSize size = 0;
+};
+
+// One persistent device buffer that build scratch memory is carved out of.
+// It only ever grows, to the largest amount a single batch has needed.
+struct ScratchPool {
+    VkBuffer buffer = VK_NULL_HANDLE;
+    Allocation allocation;
+    VkDeviceAddress device_address = 0;
+    VkDeviceSize size = 0;
+    // `minAccelerationStructureScratchOffsetAlignment`.
+    VkDeviceSize alignment = 1;
 
-    void create_buffer(VkDevice* p_logical_device,
-                       VkPhysicalDevice* p_physical_device, VkDeviceSize size,
-                       VkBufferUsageFlags usage_flags,
-                       VkMemoryPropertyFlags property_flags, VkBuffer* p_buffer,
-                       VkDeviceMemory* p_buffer_memory);
+    void reserve(DeviceAllocator& allocator,
+                 PFN_vkGetBufferDeviceAddressKHR vkGetBufferDeviceAddressKHR,
+                 VkDeviceSize size);
+    auto aligned_size(VkDeviceSize scratch_size) const -> VkDeviceSize;
+    void free(DeviceAllocator& allocator);
 };
@@ -1,9 +1,24 @@
 #pragma once
 #include <GLFW/glfw3.h>
+#include <chrono>
 #include <stx/panic.h>
+#include <vector>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
+#include "acceleration_structure.hpp"
+#include "command_pools.hpp"
+#include "cpu_tracer.hpp"
+#include "descriptors.hpp"
+#include "instance_table.hpp"
+#include "memory.hpp"
+#include "pipeline_cache.hpp"
+#include "profiler.hpp"
+#include "scene.hpp"
+#include "texture_streamer.hpp"
+#include "thread_pool.hpp"
+#include "upload.hpp"
+
 struct App {
     // Basic things.
     VkInstance instance;
@@ -12,63 +27,258 @@ struct App {
     VkDevice logical_device;
     VkFormat depth_format;
     VkCommandPool cmd_pool;
+    // One-time command buffers for `compute_queue`.
+    VkCommandPool compute_cmd_pool;
+    DeviceAllocator allocator;
+    UploadManager uploader;
+    GpuProfiler profiler;
+    // GPU stage timings are also written here at exit, when set.
+    char const* p_profile_csv_path = nullptr;
+    VkDeviceSize const staging_ring_size = 64ull * 1024 * 1024;
 
+    // Tracing and presentation happen on the generic family. Builds and
+    // uploads move to an async compute and a dedicated transfer family when
+    // the device has them, and fall back to the generic family otherwise.
     uint32_t generic_queue_index;
+    uint32_t compute_queue_index;
+    uint32_t transfer_queue_index;
     VkQueue graphics_queue;
     VkQueue present_queue;
     VkQueue compute_queue;
+    VkQueue transfer_queue;
+    // Signaled by every one-time submission, and waited on by everything
+    // submitted after it, so that builds on the compute queue are visible
+    // to the other queues.
+    VkSemaphore build_timeline = VK_NULL_HANDLE;
+    uint64_t build_timeline_value = 0;
+
+    // Render offscreen and write frames to disk, without GLFW or a swapchain.
+    bool is_headless = false;
+    uint32_t headless_frame_count = 1;
+    // Frames are written to `<p_output_prefix>_<frame>.ppm`.
+    char const* p_output_prefix = "frame";
+    // Trace on the host with `cpu_tracer` instead of on a device, which
+    // implies headless. Set by `initialize()` when no device can ray trace.
+    bool is_cpu_tracing = false;
+    CpuTracer cpu_tracer;
 
     // Window.
     bool prepared = false;
+    // Set when the framebuffer changes size, until the swapchain follows.
     bool resized = false;
     uint32_t const width = 1280;
     uint32_t const height = 720;
     GLFWwindow* window;
     VkSurfaceKHR surface;
 
+    // Mailbox and immediate fall back to FIFO where the surface lacks them.
+    // FIFO blocks on the display once every image but the one on screen is
+    // queued, so its image count bounds how many frames wait to be shown,
+    // and with them the latency, to `max_queued_frames`.
+    VkPresentModeKHR requested_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    VkPresentModeKHR present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    uint32_t max_queued_frames = 2;
+
     uint32_t image_count;
-    VkSwapchainKHR swapchain;
+    VkSwapchainKHR swapchain = VK_NULL_HANDLE;
     VkImage* swapchain_images;
     VkFormat swapchain_image_format;
+    VkExtent2D swapchain_extent;
+
+    // A resize replaces the swapchain through `oldSwapchain`, and the old
+    // one is destroyed, along with its per-image semaphores, once no frame
+    // in flight can still present to it, so that the device never idles.
+    // A signaled fence does not mean that the present after it has run, so
+    // with present wait, its last present must also have completed. Without
+    // it, every image of the current swapchain must have been acquired once,
+    // by which point the presentation engine has moved past the old one.
+    struct RetiredSwapchain {
+        VkSwapchainKHR swapchain;
+        VkImage* p_images;
+        VkSemaphore* p_render_finished_semaphores;
+        uint32_t image_count;
+        // The first frame that presents to its replacement.
+        uint64_t frame;
+        // Zero if nothing was presented to it.
+        uint64_t last_present_id;
+    };
+    std::vector<RetiredSwapchain> retired_swapchains;
+    // Of the current swapchain.
+    uint64_t swapchain_last_present_id = 0;
+    uint32_t unacquired_image_count = 0;
+    uint32_t swapchain_recreation_count = 0;
 
     struct StorageImage {
-        VkDeviceMemory memory;
+        Allocation allocation;
         VkImage image;
         VkImageView view;
         VkFormat format;
     } storage_image;
 
+    // Adaptive sampling keeps a running estimate of every pixel, and a small
+    // compute pass turns its error into how many paths the pixel gets next.
+    bool is_adaptive_sampling = false;
+    // Paths per pixel per frame, when sampling uniformly.
+    uint32_t uniform_sample_count = 1;
+    // The most paths one pixel gets per frame, when sampling adaptively.
+    uint32_t max_sample_count = 4;
+    // Pixels with fewer samples than this always get `max_sample_count`.
+    uint32_t min_sample_count = 4;
+    // Relative standard error of a pixel's mean luminance that counts as
+    // converged.
+    float error_threshold = 0.02f;
+    // Set whenever the scene changes, so that stale samples are dropped.
+    bool should_reset_accumulation = true;
+
+    // The running mean in rgb and the sample count in a, the squared
+    // luminance deviations, and the paths for the next frame.
+    StorageImage accumulation_image;
+    StorageImage variance_image;
+    StorageImage sample_count_image;
+
+    // Matches the push constant block of `sampling.glsl`.
+    struct SamplingPushConstants {
+        uint32_t frame_number;
+        uint32_t is_adaptive;
+        uint32_t uniform_sample_count;
+        uint32_t max_sample_count;
+        uint32_t min_sample_count;
+        float error_threshold;
+        uint32_t stats_slot;
+        uint32_t should_reset;
+        uint32_t render_width;
+        uint32_t render_height;
+    };
+
+    // Written by the sample map pass, one slot per frame in flight, and read
+    // back once that frame's fence signals.
+    struct SamplingStats {
+        uint32_t sample_count;
+        uint32_t active_pixel_count;
+        uint32_t max_pixel_sample_count;
+        uint32_t evaluated_pixel_count;
+        // Set by the host when the frame was recorded.
+        uint32_t was_reset;
+    };
+
+    VkBuffer sampling_stats_buffer;
+    Allocation sampling_stats_buffer_allocation;
+    SamplingStats* p_sampling_stats = nullptr;
+    VkPipeline sample_map_pipeline;
+
+    // Rays are traced into the top left `render_width` x `render_height` of
+    // the storage image, which is then scaled up to the window. With dynamic
+    // resolution, the scale follows the GPU time of the trace pass, so that
+    // it fits in `frame_budget_ms` without recreating any image.
+    bool is_resolution_dynamic = false;
+    double frame_budget_ms = 12.0;
+    float render_scale = 1.0f;
+    float min_render_scale = 0.25f;
+    uint32_t render_width = width;
+    uint32_t render_height = height;
+    uint32_t render_scale_change_count = 0;
+    // The trace pass sample count the scale was last derived from.
+    uint64_t last_scaled_sample_count = 0;
+
+    uint32_t frames_traced = 0;
+    uint64_t rays_traced = 0;
+    uint64_t rays_since_reset = 0;
+    uint32_t frames_since_reset = 0;
+    bool is_converged = false;
+
+    // The host records one frame while the GPU is still working on up to
+    // `max_frames_in_flight - 1` earlier ones.
+    uint32_t max_frames_in_flight = 2;
+    // Indexed by frame in flight.
     VkSemaphore* image_available_semaphores;
-    VkSemaphore* render_finished_semaphores;
     VkFence* in_flight_fences;
+    // Indexed by swapchain image.
+    VkSemaphore* render_finished_semaphores;
     VkFence* images_in_flight;
-    uint32_t current_frame;
+    uint32_t current_frame = 0;
+
+    // Time the host spent blocked on fences, which stays near zero while the
+    // GPU keeps up.
+    double last_frame_wait_ms = 0;
+    double total_frame_wait_ms = 0;
+    uint64_t frames_rendered = 0;
+
+    // Frames start at most `target_frame_rate` times a second, when set.
+    // The loop sleeps until the next one is due, and only then polls input,
+    // so that input is as fresh as the pacing allows.
+    double target_frame_rate = 0;
+    std::chrono::steady_clock::time_point next_frame_time;
+    // When input was last polled, which the next frame is recorded from.
+    std::chrono::steady_clock::time_point input_time;
+
+    // Latency from polling a frame's input to its image being presented,
+    // where `VK_KHR_present_wait` is enabled. Otherwise, it only reaches the
+    // GPU completing the frame, as seen when a blocking wait on its fence
+    // returns, and the display adds up to one refresh plus, under FIFO, the
+    // frames queued ahead of it. `get_latency_name()` tells which it is.
+    // Indexed by frame in flight.
+    std::chrono::steady_clock::time_point* p_input_times = nullptr;
+    bool* p_is_latency_pending = nullptr;
+    // The present IDs, and the swapchains they were presented to.
+    uint64_t* p_present_ids = nullptr;
+    VkSwapchainKHR* p_present_swapchains = nullptr;
+    uint64_t last_present_id = 0;
+    double last_latency_ms = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+    uint64_t latency_sample_count = 0;
 
     //  Raytracing
-    struct Vertex {
-        float pos[3];
-    };
-    Vertex vertices[3] = {
-        {1.0f, 1.0f, 0.0f},
-        {-1.0f, 1.0f, 0.0f},
-        {0.0f, -1.0f, 0.0f},
-    };
+    // Loaded instead of the default triangle when set.
+    char const* p_scene_path = nullptr;
+    Scene scene;
+
+    // Quantized positions are built from as SNORM16 where the device allows
+    // it, and are otherwise converted to half floats into
+    // `p_half_positions` while loading.
+    VkFormat position_format = VK_FORMAT_R16G16B16A16_SNORM;
+    uint16_t* p_half_positions = nullptr;
     VkBuffer vertex_position_buffer;
-    VkDeviceMemory vertex_position_buffer_memory;
+    Allocation vertex_position_buffer_allocation;
+    VkBuffer vertex_normal_buffer;
+    Allocation vertex_normal_buffer_allocation;
+    VkBuffer vertex_uv_buffer;
+    Allocation vertex_uv_buffer_allocation;
 
-    uint32_t indices[3] = {
-        0,
-        1,
-        2,
-    };
     VkBuffer index_buffer;
-    VkDeviceMemory index_buffer_memory;
+    Allocation index_buffer_allocation;
 
+    // The scene's `Mesh` table, indexed by `instanceCustomIndex`.
+    VkBuffer mesh_buffer;
+    Allocation mesh_buffer_allocation;
+    // One transform per mesh, which BLAS builds apply to dequantize its
+    // positions.
+    VkBuffer blas_transform_buffer;
+    Allocation blas_transform_buffer_allocation;
+    VkTransformMatrixKHR* p_blas_transforms = nullptr;
+
+    // One material per triangle, which hit shaders find from the mesh's
+    // first triangle and `gl_PrimitiveID`.
     VkBuffer material_index_buffer;
-    VkDeviceMemory material_index_buffer_memory;
+    Allocation material_index_buffer_allocation;
 
+    // Every `Material` of the scene, with failed textures dropped.
     VkBuffer material_buffer;
-    VkDeviceMemory material_buffer_memory;
+    Allocation material_buffer_allocation;
+
+    // The scene's textures, streamed in by level as hit shaders ask for
+    // them.
+    TextureStreamer texture_streamer;
+    // How many levels above its coarsest one each texture was sampled at,
+    // plus one, which hit shaders raise with `atomicMax`. Counting from the
+    // coarsest level keeps requests meaningful while finer levels come and
+    // go. One slot per frame in flight, every `texture_feedback_stride`
+    // words, reset to `no_texture_request` once read.
+    static constexpr uint32_t no_texture_request = 0;
+    VkBuffer texture_feedback_buffer;
+    Allocation texture_feedback_buffer_allocation;
+    uint32_t* p_texture_feedback = nullptr;
+    uint32_t texture_feedback_stride = 0;
 
     VkPhysicalDeviceRayTracingPipelinePropertiesKHR
         ray_tracing_pipeline_properties;
@@ -76,36 +286,141 @@ struct App {
         acceleration_structure_features;
     VkPhysicalDeviceBufferDeviceAddressFeatures buffer_device_address_features;
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR ray_tracing_pipeline_features;
+    VkPhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_features;
+    VkPhysicalDeviceDescriptorIndexingFeatures descriptor_indexing_features;
+    VkPhysicalDeviceHostQueryResetFeatures host_query_reset_features;
+    // Enabled together where the device supports both, outside headless.
+    VkPhysicalDevicePresentIdFeaturesKHR present_id_features;
+    VkPhysicalDevicePresentWaitFeaturesKHR present_wait_features;
+    bool is_present_wait_enabled = false;
+    VkPhysicalDeviceFeatures2 device_features;
+
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR
+        acceleration_structure_properties;
 
-    VkAccelerationStructureKHR blas;
-    uint64_t blas_address;
-    VkBuffer blas_buffer;
-    VkDeviceMemory blas_buffer_memory;
+    // One BLAS per mesh of the scene.
+    AccelerationStructure* p_blases = nullptr;
+    uint32_t blas_count = 0;
+    // BLASes are built in batches whose scratch memory fits in this budget.
+    VkDeviceSize blas_scratch_budget = 256ull * 1024 * 1024;
+    VkBuildAccelerationStructureFlagsKHR blas_build_flags =
+        VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+    // Copy every BLAS into a right-sized buffer after it is built.
+    bool should_compact_blas = true;
+    // Build BLASes on the CPU, spread over `thread_pool`, instead of on the
+    // GPU. Cleared if the device lacks `accelerationStructureHostCommands`.
+    bool should_build_blas_on_host = false;
+    // Shared by host builds and frame recording.
+    ThreadPool thread_pool;
+    ScratchPool scratch_pool;
+    // Totals over every BLAS from the last `create_blas()`, before and after
+    // compaction, and the scratch memory its largest batch needed.
+    VkDeviceSize blas_build_size = 0;
+    VkDeviceSize blas_size = 0;
+    VkDeviceSize blas_scratch_size = 0;
 
-    VkAccelerationStructureKHR tlas;
+    VkAccelerationStructureKHR tlas = VK_NULL_HANDLE;
+    VkDeviceSize tlas_size = 0;
     uint64_t tlas_address;
     VkBuffer tlas_buffer;
-    VkDeviceMemory tlas_buffer_memory;
+    Allocation tlas_buffer_allocation;
+    ScratchPool tlas_scratch_pool;
+
+    // TLAS instances are edited on the host, and packed into the frame's
+    // slot of a persistently mapped buffer ahead of each build. Moving an
+    // instance is just a host write followed by a refit. Each slot holds
+    // `instances.capacity` instances.
+    VkBuffer instance_buffer;
+    Allocation instance_buffer_allocation;
+    VkDeviceAddress instance_buffer_address;
+    InstanceTable instances;
+    // `create_tlas()` instances the whole scene on a grid until there are at
+    // least this many instances.
+    uint32_t scene_instance_count = 0;
+    // Packing fewer instances than this is not worth waking `thread_pool`.
+    uint32_t min_parallel_instance_count = 16384;
+
+    // Refit the TLAS every frame rather than only building it once.
+    bool is_scene_dynamic = false;
+    // Number of refits before the TLAS is fully rebuilt.
+    uint32_t max_tlas_updates = 64;
+    uint32_t tlas_updates_since_build = 0;
+    bool does_tlas_need_rebuild = true;
+    bool are_instances_dirty = false;
 
     VkImageView ray_trace_image_view;
     VkImage ray_trace_image;
-    VkDeviceMemory ray_trace_image_memory;
+    Allocation ray_trace_image_allocation;
+
+    // Matches the `Camera` uniform block of the ray generation shader.
+    struct CameraUniforms {
+        float origin[4];
+        float lower_left[4];
+        float horizontal[4];
+        float vertical[4];
+    };
 
     VkBuffer uniform_buffer;
-    VkDeviceMemory uniform_buffer_memory;
+    Allocation uniform_buffer_allocation;
+    CameraUniforms* p_camera = nullptr;
+
+    // What the first set binds, laid out for
+    // `ray_trace_descriptor_template`, in binding order.
+    struct RayTraceDescriptors {
+        VkAccelerationStructureKHR tlas;
+        VkDescriptorImageInfo storage_image;
+        VkDescriptorBufferInfo camera;
+        VkDescriptorBufferInfo positions;
+        VkDescriptorBufferInfo normals;
+        VkDescriptorBufferInfo indices;
+        VkDescriptorBufferInfo meshes;
+        VkDescriptorImageInfo accumulation_image;
+        VkDescriptorImageInfo variance_image;
+        VkDescriptorImageInfo sample_count_image;
+        VkDescriptorBufferInfo sampling_stats;
+    };
 
-    VkDescriptorPool descriptor_pool;
-    VkDescriptorSet ray_trace_descriptor_set;
-    VkDescriptorSet material_descriptor_set;
-    VkDescriptorSetLayout* ray_trace_descriptor_set_layouts;
+    DescriptorLayoutCache descriptor_layouts;
+    // Every frame allocates its first set afresh out of its own pools, and
+    // fills it with a single template update from `ray_trace_descriptors`,
+    // so that whatever changed since, such as a grown TLAS, never touches a
+    // set that a frame in flight still uses.
+    FrameDescriptorPools frame_descriptor_pools;
+    VkDescriptorUpdateTemplate ray_trace_descriptor_template;
+    RayTraceDescriptors ray_trace_descriptors;
+    // The set of the frame being recorded.
+    VkDescriptorSet ray_trace_descriptor_set = VK_NULL_HANDLE;
+    VkDescriptorSetLayout ray_trace_descriptor_set_layout;
+    // The second set of hit shaders, with the material tables and every
+    // texture in one array. Textures change views as they stream, which
+    // must not happen under a frame in flight, so there is one set per
+    // frame in flight, rewritten once it is stale and its frame is done.
+    VkDescriptorPool material_descriptor_pool;
+    VkDescriptorSetLayout material_descriptor_set_layout;
+    VkDescriptorSet* p_material_descriptor_sets = nullptr;
+    bool* p_are_material_sets_stale = nullptr;
+    VkSampler texture_sampler;
 
     VkPipeline ray_trace_pipeline;
     VkPipelineLayout ray_trace_pipeline_layout;
+    PipelineCache pipeline_cache;
+    char const* p_pipeline_cache_path = "raytracing.pipeline_cache";
 
     VkBuffer shader_binding_table_buffer;
-    VkDeviceMemory shader_binding_table_buffer_memory;
+    Allocation shader_binding_table_buffer_allocation;
+    VkStridedDeviceAddressRegionKHR raygen_region;
+    VkStridedDeviceAddressRegionKHR miss_region;
+    VkStridedDeviceAddressRegionKHR hit_region;
+    VkStridedDeviceAddressRegionKHR callable_region;
 
-    VkCommandBuffer* p_command_buffers;
+    // Host-visible copy of the storage image, for writing frames to disk.
+    VkBuffer readback_buffer;
+    Allocation readback_buffer_allocation;
+
+    // Each frame is recorded on `recording_thread_count` threads of
+    // `thread_pool`, into separate primaries that are submitted together.
+    static constexpr uint32_t recording_thread_count = 2;
+    FrameCommandPools frame_cmd_pools;
 
     // Because these represent Vulkan functions, I will leave them in camelCase
     // for now.
@@ -121,31 +436,175 @@ struct App {
     PFN_vkCmdBuildAccelerationStructuresKHR
         vkCmdBuildAccelerationStructuresKHR;  // NOLINT
     PFN_vkBuildAccelerationStructuresKHR
-        vkBuildAccelerationStructuresKHR;     // NOLINT
+        vkBuildAccelerationStructuresKHR;  // NOLINT
+    PFN_vkCmdWriteAccelerationStructuresPropertiesKHR
+        vkCmdWriteAccelerationStructuresPropertiesKHR;  // NOLINT
+    PFN_vkCmdCopyAccelerationStructureKHR
+        vkCmdCopyAccelerationStructureKHR;    // NOLINT
+    PFN_vkCreateDeferredOperationKHR vkCreateDeferredOperationKHR;  // NOLINT
+    PFN_vkDestroyDeferredOperationKHR
+        vkDestroyDeferredOperationKHR;  // NOLINT
+    PFN_vkGetDeferredOperationMaxConcurrencyKHR
+        vkGetDeferredOperationMaxConcurrencyKHR;  // NOLINT
+    PFN_vkGetDeferredOperationResultKHR
+        vkGetDeferredOperationResultKHR;                        // NOLINT
+    PFN_vkDeferredOperationJoinKHR vkDeferredOperationJoinKHR;  // NOLINT
     PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR;  // NOLINT
     PFN_vkGetRayTracingShaderGroupHandlesKHR
         vkGetRayTracingShaderGroupHandlesKHR;  // NOLINT
     PFN_vkCreateRayTracingPipelinesKHR
         vkCreateRayTracingPipelinesKHR;  // NOLINT
+    // Only loaded when `is_present_wait_enabled`.
+    PFN_vkWaitForPresentKHR vkWaitForPresentKHR = nullptr;  // NOLINT
+
+    bool is_renderer_initialized = false;
 
     // Methods
     void initialize();
+    // The stages of `initialize()`, in order.
+    void initialize_device();
+    void initialize_scene();
+    void initialize_renderer();
     void render_loop();
+    // Trace `headless_frame_count` frames and write each of them to disk.
+    void render_headless();
+    // Release everything `initialize_scene()` created, so that another scene
+    // can be loaded.
+    void free_scene();
+    // Release the BLASes and the TLAS, but keep the scene's buffers.
+    void free_acceleration_structures();
     void free();
 
+    // Scene setup, as run by `initialize_scene()`.
+    void create_vertex_buffer();
+    void create_index_buffer();
+    void create_mesh_buffer();
+    void create_blas();
+    void create_tlas();
+
+    auto add_instance(uint32_t blas_index,
+                      VkTransformMatrixKHR const& transform) -> uint32_t;
+    void remove_instance(uint32_t instance_index);
+    void set_instance_transform(uint32_t instance_index,
+                                VkTransformMatrixKHR const& transform);
+    // Refit or rebuild the TLAS if any instance changed, after every frame
+    // in flight is done with it.
+    void update_tlas();
+
   private:
+    // What the threads recording a frame share.
+    struct FrameRecording {
+        App* p_app;
+        uint32_t frame_index;
+        uint32_t image_index;
+        // The TLAS build, if any, and then the rest of the frame. Null
+        // until recorded.
+        VkCommandBuffer cmd_buffers[recording_thread_count] = {};
+    };
+
+    void create_instance();
+    // Whether any device has every extension the renderer needs, checked
+    // through a throwaway instance.
+    auto has_ray_tracing_device() -> bool;
     void create_surface();
+    auto does_device_support_extensions(VkPhysicalDevice physical_device)
+        -> bool;
+    // Whether a device has every feature the renderer requires, which must
+    // only be asked once it is known to have the extensions.
+    static auto does_device_support_features(VkPhysicalDevice physical_device)
+        -> bool;
     void create_physical_device();
+    void find_queue_families();
     void create_logical_device();
+    // Replaces `swapchain`, if any, through `oldSwapchain`.
     void create_swapchain();
+    // Follow the window's new size, once it has one.
+    void recreate_swapchain();
+    // Destroy swapchains that were retired before `first_pending_frame`,
+    // which is the oldest frame the GPU may still be working on, and whose
+    // presents are done. `is_device_idle` releases every one of them.
+    void release_retired_swapchains(uint64_t first_pending_frame,
+                                    bool is_device_idle);
     void create_cmd_pool();
-    void create_vertex_buffer();
-    void create_index_buffer();
+    void create_camera();
+    // Frame the scene's bounding box, looking down -Z.
+    auto frame_scene() const -> CameraUniforms;
+    void create_ray_trace_descriptors();
+    // Allocate the frame's first set, once its frame is done with the last
+    // one, and fill it from `ray_trace_descriptors`.
+    void write_frame_descriptors(uint32_t frame_index);
+    void create_material_descriptor_sets();
+    // Point a material set at the textures' current views.
+    void write_texture_descriptors(uint32_t frame_index);
+    auto create_shader_module(char const* p_file_name) -> VkShaderModule;
+    void create_ray_trace_pipeline();
+    void create_shader_binding_table();
+    void create_sampling_stats_buffer();
+    void create_sample_map_pipeline();
+    void record_trace_rays(VkCommandBuffer p_command_buffer,
+                           uint32_t stats_slot);
+    // Count the rays of the frame that last used `stats_slot`, once it is
+    // done, and free the slot for the next one.
+    void collect_sampling_stats(uint32_t stats_slot);
+    void print_sampling_stats() const;
+    // Resize the traced rectangle from the latest trace pass timings.
+    void update_render_scale();
+    void create_readback_buffer();
+    void record_readback(VkCommandBuffer p_command_buffer);
+    void write_frame(char const* p_file_name);
+    void render_headless_on_cpu();
+    void free_renderer();
     void create_material_buffer();
+    void create_image(StorageImage& image, VkFormat format,
+                      VkImageUsageFlags usage_flags);
     void create_storage_image();
     void create_textures();
+    // Turn the feedback of the frame that last used `frame_index` into
+    // requests, and stream textures ahead of recording `frame`.
+    void stream_textures(uint32_t frame_index, uint64_t frame);
     void create_cmd_buffers();
+    void create_sync_objects();
+    // The semaphores and fences kept per swapchain image.
+    void create_image_sync_objects();
+    // Sleep until the next frame is due, blocking on the frames in flight
+    // meanwhile so that their latency is measured as they finish.
+    void pace_frame();
+    // Block for at most `timeout` nanoseconds until the frame is presented,
+    // or without present wait, until its fence signals, and record its
+    // latency when the wait returns. Returns false if it timed out, and the
+    // frame is still pending.
+    auto collect_latency(uint32_t frame_index, uint64_t timeout) -> bool;
+    // What the recorded latency runs up to, for printing.
+    auto get_latency_name() const -> char const*;
+    void record_frame(VkCommandBuffer p_command_buffer, uint32_t frame_index,
+                      uint32_t image_index);
+    static void record_frame_job(uint32_t thread_index, void* p_data);
+    void draw_frame();
     void load_every_pfn();
-    void create_blas();
-    void create_tlas();
+    void build_blas_on_host(
+        VkAccelerationStructureBuildGeometryInfoKHR* p_build_geometry_infos,
+        VkAccelerationStructureBuildRangeInfoKHR const* const*
+            pp_build_range_infos,
+        VkDeviceSize const* p_scratch_sizes, uint32_t const* p_batch_ends,
+        uint32_t batch_count, VkDeviceSize max_batch_scratch_size);
+    void compact_blas(VkQueryPool& compacted_size_query_pool);
+    void reserve_instances(uint32_t capacity);
+    // Block until no frame in flight or pending build can still read the
+    // TLAS, its scratch or the instance buffer.
+    void wait_for_tlas_users();
+    // Pack every instance into the frame's slot of the instance buffer, which
+    // `record_tlas_build()` then builds from.
+    void write_instances(uint32_t frame_index);
+    auto get_tlas_geometry(uint32_t frame_index)
+        -> VkAccelerationStructureGeometryKHR;
+    auto get_tlas_build_flags() const -> VkBuildAccelerationStructureFlagsKHR;
+    // Builds from what `write_instances()` last packed into the frame's
+    // slot.
+    void record_tlas_build(VkCommandBuffer p_command_buffer,
+                           uint32_t frame_index);
+    void animate_instances(double seconds);
+    auto begin_one_time_cmd_buffer(VkQueue& queue) -> VkCommandBuffer;
+    // Waits on every earlier upload and one-time submission first.
+    void submit_one_time_cmd_buffer(VkCommandBuffer p_command_buffer,
+                                    VkQueue& queue);
 };
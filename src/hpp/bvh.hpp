@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "scene.hpp"
+#include "thread_pool.hpp"
+
+// 32 bytes, so that two siblings share a cache line.
+struct BvhNode {
+    float min[3];
+    // The first triangle of a leaf, or the left child of an interior node,
+    // whose right child follows it.
+    uint32_t first;
+    float max[3];
+    // Zero for interior nodes.
+    uint16_t triangle_count;
+    // The axis that interior nodes were split along.
+    uint16_t axis;
+
+    auto is_leaf() const -> bool {
+        return this->triangle_count != 0;
+    }
+};
+
+// Laid out for Möller-Trumbore, in the order that leaves reference them.
+struct BvhTriangle {
+    float v0[3];
+    float edge1[3];
+    float edge2[3];
+    // Scene vertices, for shading.
+    uint32_t vertices[3];
+};
+
+// A binary BVH over every triangle of a scene, in object space, built with
+// binned SAH. The top of the tree is split on the calling thread, and the
+// subtrees below it are then built in parallel.
+struct Bvh {
+    static constexpr uint32_t bin_count = 16;
+    static constexpr uint32_t max_leaf_size = 8;
+    // Relative to intersecting one triangle.
+    static constexpr float traversal_cost = 1.0f;
+    // Deeper nodes are made leaves regardless of their size, which bounds
+    // the traversal stack.
+    static constexpr uint32_t max_depth = 62;
+    // Except for those with more triangles than a leaf can count, which are
+    // halved until they fit. Any 32-bit count fits after this many halvings.
+    static constexpr uint32_t max_leaf_triangle_count = UINT16_MAX;
+    static constexpr uint32_t max_overflow_depth = 17;
+    // Enough for traversal to push both children of every node on a path.
+    static constexpr uint32_t max_stack_size =
+        max_depth + max_overflow_depth + 2;
+
+    std::vector<BvhNode> nodes;
+    std::vector<BvhTriangle> triangles;
+
+    // Positions are decoded from the scene's SNORM16 stream, so that the
+    // triangles are exactly those the GPU builds from.
+    void build(Scene const& scene, ThreadPool& thread_pool);
+    void free();
+};
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stx/panic.h>
+#include <vulkan/vulkan.h>
+
+// One transient command pool per frame in flight and per recording thread.
+// Each thread only allocates out of its own pool, so recording takes no
+// locks, and a frame's pools are reset in bulk once its fence has signaled
+// instead of resetting command buffers one at a time.
+struct FrameCommandPools {
+    static constexpr uint32_t max_cmd_buffers_per_pool = 16;
+
+    struct Pool {
+        VkCommandPool cmd_pool = VK_NULL_HANDLE;
+        // Allocated on first use, and recycled by every reset after that.
+        VkCommandBuffer cmd_buffers[max_cmd_buffers_per_pool];
+        uint32_t allocated_count = 0;
+        uint32_t used_count = 0;
+    };
+
+    VkDevice logical_device;
+    uint32_t frame_count = 0;
+    uint32_t thread_count = 0;
+    // Indexed by `frame_index * thread_count + thread_index`.
+    Pool* p_pools = nullptr;
+
+    void initialize(VkDevice& logical_device, uint32_t queue_family_index,
+                    uint32_t frame_count, uint32_t thread_count);
+    // Must only be called once the GPU is done with the frame.
+    void reset(uint32_t frame_index);
+    // A primary command buffer that is ready to begin, and which stays valid
+    // until the frame's next `reset()`.
+    auto allocate(uint32_t frame_index, uint32_t thread_index)
+        -> VkCommandBuffer;
+    void free();
+};
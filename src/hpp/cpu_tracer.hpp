@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+#include "bvh.hpp"
+#include "scene.hpp"
+#include "thread_pool.hpp"
+
+// Traces the scene on the host, for machines without a device that can ray
+// trace. Frames match those of the ray tracing pipeline with uniform
+// sampling: the same camera, jitter, lighting and running mean, written as
+// RGBA8, but every surface has the default material. Rays are traced as
+// packets of eight, one 4x2 block of pixels per packet, and threads steal
+// tiles from each other once their own run out.
+struct CpuTracer {
+    static constexpr uint32_t tile_size = 16;
+
+    Scene const* p_scene = nullptr;
+    ThreadPool* p_thread_pool = nullptr;
+    Bvh bvh;
+
+    // Matches the `Camera` uniform block of the ray generation shader.
+    float origin[3];
+    float lower_left[3];
+    float horizontal[3];
+    float vertical[3];
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // The running mean in rgb, and the sample count in a.
+    float* p_accumulation = nullptr;
+    uint8_t* p_pixels = nullptr;
+
+    uint64_t rays_traced = 0;
+    double trace_ms = 0;
+
+    void initialize(Scene const& scene, ThreadPool& thread_pool,
+                    uint32_t width, uint32_t height);
+    void set_camera(float const* p_origin, float const* p_lower_left,
+                    float const* p_horizontal, float const* p_vertical);
+    // Add `sample_count` samples to every pixel, starting over when
+    // `should_reset` is set, and refresh `p_pixels`.
+    void trace_frame(uint32_t frame_number, uint32_t sample_count,
+                     bool should_reset);
+    void print_stats() const;
+    void free();
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstdint>
+#include <stx/panic.h>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Creates each distinct descriptor set layout once, and hands it back to
+// anyone who asks for the same bindings. Layouts are looked up by a hash of
+// their bindings, which are only compared in full when the hash matches.
+struct DescriptorLayoutCache {
+    struct Layout {
+        uint64_t hash;
+        VkDescriptorSetLayoutCreateFlags flags;
+        // Sorted by binding, with the binding flags in the same order.
+        std::vector<VkDescriptorSetLayoutBinding> bindings;
+        std::vector<VkDescriptorBindingFlags> binding_flags;
+        VkDescriptorSetLayout layout;
+    };
+
+    VkDevice logical_device;
+    std::vector<Layout> layouts;
+
+    void initialize(VkDevice& logical_device);
+    // Bindings may come in any order, and must not have immutable samplers.
+    // `p_binding_flags` is either null or has one entry per binding. The
+    // layout lives until `free()`.
+    auto get(VkDescriptorSetLayoutBinding const* p_bindings,
+             uint32_t binding_count,
+             VkDescriptorBindingFlags const* p_binding_flags = nullptr,
+             VkDescriptorSetLayoutCreateFlags flags = 0)
+        -> VkDescriptorSetLayout;
+    void free();
+};
+
+// Descriptor pools per frame in flight, from which sets are allocated while
+// recording and never freed one at a time. A frame's pools are reset in
+// bulk once its fence has signaled. Whenever a frame runs out, it moves on
+// to a pool twice as large as the last, so pools stop being created once
+// they hold what a frame needs.
+struct FrameDescriptorPools {
+    static constexpr uint32_t first_pool_set_count = 8;
+    static constexpr uint32_t max_pool_set_count = 1024;
+
+    struct Frame {
+        // Every pool the frame has needed so far. Those before
+        // `current_pool` are full.
+        std::vector<VkDescriptorPool> pools;
+        uint32_t current_pool = 0;
+        // Since the current pool was last reset.
+        uint32_t current_pool_set_count = 0;
+    };
+
+    VkDevice logical_device;
+    // How many descriptors of each type a pool holds per set.
+    std::vector<VkDescriptorPoolSize> sizes_per_set;
+    uint32_t frame_count = 0;
+    Frame* p_frames = nullptr;
+    uint32_t pool_count = 0;
+
+    void initialize(VkDevice& logical_device, uint32_t frame_count,
+                    VkDescriptorPoolSize const* p_sizes_per_set,
+                    uint32_t size_count);
+    // Must only be called once the GPU is done with the frame.
+    void reset(uint32_t frame_index);
+    // A set that stays valid until the frame's next `reset()`.
+    auto allocate(uint32_t frame_index, VkDescriptorSetLayout layout)
+        -> VkDescriptorSet;
+    void free();
+
+  private:
+    auto create_pool(uint32_t set_count) -> VkDescriptorPool;
+};
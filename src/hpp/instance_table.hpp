@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vulkan/vulkan.h>
+
+// TLAS instances, stored as one array per field. Animation only touches the
+// arrays it changes, and `write()` packs a range of instances into the
+// layout that builds read.
+struct InstanceTable {
+    // Row-major 3x4 transforms, with one array per matrix element.
+    float* p_transforms[12] = {};
+    // Only the low 24 bits of these two are kept.
+    uint32_t* p_custom_indices = nullptr;
+    uint32_t* p_sbt_offsets = nullptr;
+    uint8_t* p_masks = nullptr;
+    uint8_t* p_flags = nullptr;
+    uint64_t* p_blas_addresses = nullptr;
+    uint32_t count = 0;
+    uint32_t capacity = 0;
+
+    // Keeps every instance below `count`.
+    void reserve(uint32_t capacity);
+    // There must be room for it already.
+    auto add(VkTransformMatrixKHR const& transform, uint32_t custom_index,
+             uint8_t mask, uint32_t sbt_offset, uint8_t flags,
+             uint64_t blas_address) -> uint32_t;
+    // Instances are unordered, so the last one fills the gap.
+    void remove(uint32_t index);
+    auto get_transform(uint32_t index) const -> VkTransformMatrixKHR;
+    void set_transform(uint32_t index, VkTransformMatrixKHR const& transform);
+    // Pack instances `begin` through `end - 1` into `p_instances`, four at a
+    // time with SSE. The destination is written front to back and never
+    // read, so that it can be write-combined mapped memory.
+    void write(uint32_t begin, uint32_t end,
+               VkAccelerationStructureInstanceKHR* p_instances) const;
+    void free();
+};
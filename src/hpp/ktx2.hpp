@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vulkan/vulkan.h>
+
+// A memory-mapped KTX2 file holding one 2D texture in a BCn format, without
+// supercompression. Levels are read straight out of the mapping, so a level
+// costs nothing until it is uploaded.
+struct Ktx2File {
+    static constexpr uint32_t max_level_count = 16;
+
+    struct Level {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    VkFormat format = VK_FORMAT_UNDEFINED;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    // Level 0 is the largest.
+    uint32_t level_count = 0;
+    Level levels[max_level_count];
+    // Bytes per 4x4 block.
+    uint32_t block_size = 0;
+
+    auto load(char const* p_path) -> bool;
+    auto level_width(uint32_t level) const -> uint32_t;
+    auto level_height(uint32_t level) const -> uint32_t;
+    auto level_data(uint32_t level) const -> void const*;
+    void free();
+
+  private:
+    void* p_mapping = nullptr;
+    size_t mapping_size = 0;
+};
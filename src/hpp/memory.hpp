@@ -1,17 +1,84 @@
 #pragma once
 
 #include <stx/panic.h>
+#include <vector>
 #include <vulkan/vulkan.h>
 
+// A range of device memory sub-allocated out of a `MemoryBlock`.
+struct Allocation {
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize offset = 0;
+    VkDeviceSize size = 0;
+    uint32_t block_index = 0;
+    // Points at `offset` inside the block's persistent mapping, or is null if
+    // the memory is not host-visible.
+    void* p_mapped = nullptr;
+};
+
+struct MemoryBlock {
+    struct FreeRange {
+        VkDeviceSize offset;
+        VkDeviceSize size;
+    };
+
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    VkDeviceSize size = 0;
+    VkDeviceSize used = 0;
+    uint32_t memory_type_index = 0;
+    // Buffers and linear images never share a block with optimally tiled
+    // images, so `bufferImageGranularity` can not be violated between
+    // neighbouring allocations.
+    bool is_linear = true;
+    // Blocks made for a single oversized request are released as soon as
+    // that request is freed.
+    bool is_dedicated = false;
+    void* p_mapped = nullptr;
+    // Sorted by offset, and always coalesced.
+    std::vector<FreeRange> free_ranges;
+};
+
+// Sub-allocates buffers and images out of large `VkDeviceMemory` pages, so
+// that a scene does not cost one `vkAllocateMemory` per resource.
+struct DeviceAllocator {
+    VkDevice logical_device;
+    VkPhysicalDevice physical_device;
+    VkDeviceSize block_size = 64ull * 1024 * 1024;
+    std::vector<MemoryBlock> blocks;
+    // Buffers are shared concurrently between these queue families, when
+    // there is more than one, instead of transferring ownership per buffer.
+    uint32_t queue_family_indices[3];
+    uint32_t queue_family_count = 0;
+
+    void initialize(VkDevice& logical_device,
+                    VkPhysicalDevice& physical_device);
+    auto allocate(VkMemoryRequirements const& memory_requirements,
+                  VkMemoryPropertyFlags memory_property_flags, bool is_linear)
+        -> Allocation;
+    void deallocate(Allocation& allocation);
+    auto bytes_allocated() const -> VkDeviceSize;
+    auto bytes_used() const -> VkDeviceSize;
+    void print_stats() const;
+    void free();
+
+  private:
+    auto create_block(uint32_t memory_type_index, VkDeviceSize size,
+                      bool is_linear) -> uint32_t;
+    auto try_allocate_from(uint32_t block_index,
+                           VkMemoryRequirements const& memory_requirements,
+                           Allocation& allocation) -> bool;
+};
+
+// Round `value` up to a multiple of `alignment`, which need not be a power
+// of two.
+auto align_up(VkDeviceSize value, VkDeviceSize alignment) -> VkDeviceSize;
+
 auto find_memory_type(uint32_t type_filter, VkMemoryPropertyFlags properties,
                       VkPhysicalDevice& physical_device) -> uint32_t;
 
-void create_buffer(VkDevice& logical_device, VkPhysicalDevice& physical_device,
-                   VkBufferUsageFlags usage_flags,
+void create_buffer(DeviceAllocator& allocator, VkBufferUsageFlags usage_flags,
                    VkMemoryPropertyFlags memory_property_flags,
                    VkDeviceSize size, VkBuffer& p_buffer,
-                   VkDeviceMemory* p_buffer_memory);
+                   Allocation* p_buffer_allocation);
 
-void copy_buffer(VkDevice& logical_device, VkCommandPool& cmd_pool,
-                 VkBuffer p_src_buffer, VkBuffer p_dst_buffer,
-                 VkDeviceSize size, VkQueue& queue);
+void destroy_buffer(DeviceAllocator& allocator, VkBuffer& p_buffer,
+                    Allocation* p_buffer_allocation);
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+
+// Marks vertices that no index refers to, in the remaps below.
+constexpr uint32_t unused_vertex = ~0u;
+// Post-transform cache size that triangle orders are optimized for.
+constexpr uint32_t vertex_cache_size = 16;
+
+// Map every vertex to the first vertex whose attributes are bit-identical to
+// it, numbering the survivors in order. Returns how many there are.
+auto deduplicate_vertices(float const* p_positions, float const* p_normals,
+                          float const* p_uvs, uint32_t vertex_count,
+                          uint32_t* p_remap) -> uint32_t;
+
+// Reorder triangles in place so that consecutive ones share vertices, with
+// Tipsify (Sander et al. 2007), which runs in linear time. If given,
+// `p_triangle_order` receives the old index of every triangle in its new
+// order, so that per-triangle data can follow.
+void optimize_vertex_cache(uint32_t* p_indices, uint32_t index_count,
+                           uint32_t vertex_count,
+                           uint32_t* p_triangle_order = nullptr);
+
+// Renumber vertices in the order the indices first use them, so that fetches
+// walk the vertex streams front to back. Unreferenced vertices map to
+// `unused_vertex`. Returns how many vertices are left.
+auto reorder_vertices_for_fetch(uint32_t* p_indices, uint32_t index_count,
+                                uint32_t vertex_count, uint32_t* p_remap)
+    -> uint32_t;
+
+// Quantize positions to four 16-bit SNORM components each, normalized to
+// the bounding box of the finite ones. A position decodes to
+// `scale * q / 32767 + offset`, and non-finite components decode to the
+// middle of the box.
+void quantize_positions(float const* p_positions, uint32_t vertex_count,
+                        int16_t* p_quantized, float* p_scale,
+                        float* p_offset);
+
+// Round to the nearest IEEE half, for devices that can not build from SNORM.
+// Only ever given decoded SNORM16 values, so NaN comes out as infinity.
+auto float_to_half(float value) -> uint16_t;
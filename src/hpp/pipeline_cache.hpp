@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stx/panic.h>
+#include <vulkan/vulkan.h>
+
+// Prefixed to the driver's cache data on disk. A cache written by another
+// device or driver is discarded rather than handed to the driver.
+struct PipelineCacheHeader {
+    static constexpr char expected_magic[4] = {'R', 'T', 'P', 'C'};
+    static constexpr uint32_t current_version = 1;
+
+    char magic[4];
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t pipeline_cache_uuid[VK_UUID_SIZE];
+    uint64_t data_size;
+};
+
+// A `VkPipelineCache` that persists between runs, so that warm starts skip
+// most of the driver's shader compilation.
+struct PipelineCache {
+    VkDevice logical_device;
+    VkPipelineCache cache = VK_NULL_HANDLE;
+    char const* p_path = nullptr;
+    PipelineCacheHeader expected_header;
+    // Whether usable data was loaded from `p_path`.
+    bool is_warm = false;
+
+    void initialize(VkDevice& logical_device,
+                    VkPhysicalDevice& physical_device, char const* p_path);
+    // Write the cache back to `p_path`, replacing the previous file.
+    void save();
+    void free();
+};
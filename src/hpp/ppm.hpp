@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstdint>
+
+// Write tightly packed RGBA8 pixels as a binary PPM, which has no alpha
+// channel.
+auto write_ppm(char const* p_file_name, uint8_t const* p_pixels,
+               uint32_t width, uint32_t height) -> bool;
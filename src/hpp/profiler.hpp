@@ -0,0 +1,78 @@
+#pragma once
+
+#include <mutex>
+#include <stx/panic.h>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+// Times named scopes of GPU work with pairs of timestamp queries. Results are
+// read back without waiting, some frames after the scopes were submitted,
+// and each stage keeps a window of recent samples for its statistics. Scopes
+// may be begun from several recording threads at once.
+struct GpuProfiler {
+    static constexpr uint32_t max_scopes_in_flight = 512;
+    static constexpr uint32_t samples_per_stage = 256;
+    static constexpr uint32_t no_scope = ~0u;
+
+    struct Stage {
+        // Scopes are grouped by name, so this must outlive the profiler.
+        char const* p_name;
+        uint64_t sample_count = 0;
+        double total_ms = 0;
+        double max_ms = 0;
+        // The last `samples_per_stage` samples, as a ring.
+        double samples_ms[samples_per_stage];
+    };
+
+    struct Statistics {
+        uint64_t sample_count;
+        double average_ms;
+        double p50_ms;
+        double p95_ms;
+        double p99_ms;
+        double max_ms;
+    };
+
+    // Queues without timestamp support, or devices without `hostQueryReset`,
+    // leave the profiler disabled, and every scope becomes a no-op. Query
+    // slots are reset on the host, so the device must be created with
+    // `hostQueryReset` whenever it supports it.
+    bool is_enabled = false;
+    VkDevice logical_device;
+    VkQueryPool query_pool = VK_NULL_HANDLE;
+    double ns_per_tick;
+    uint64_t timestamp_mask;
+    std::vector<Stage> stages;
+
+    // The stage of each scope, indexed by scope modulo the ring size.
+    uint32_t scope_stages[max_scopes_in_flight];
+    // Both of these only ever grow. Scopes are resolved in the order they
+    // were begun.
+    uint64_t next_scope = 0;
+    uint64_t resolved_scope = 0;
+    uint64_t dropped_scope_count = 0;
+
+    void initialize(VkDevice& logical_device,
+                    VkPhysicalDevice& physical_device,
+                    uint32_t queue_family_index);
+    // Returns `no_scope` when profiling is disabled, or when every query is
+    // still waiting on the GPU.
+    auto begin_scope(VkCommandBuffer p_command_buffer, char const* p_name)
+        -> uint32_t;
+    void end_scope(VkCommandBuffer p_command_buffer, uint32_t scope);
+    // Collect every finished scope, without blocking.
+    void resolve();
+    auto get_statistics(Stage const& stage) const -> Statistics;
+    // The most recent sample of a stage, or zero if it has none yet.
+    auto get_last_sample_ms(char const* p_name) const -> double;
+    void print_stats() const;
+    auto write_csv(char const* p_path) const -> bool;
+    void free();
+
+  private:
+    // Guards the scope ring and the stages.
+    std::mutex mutex;
+
+    auto find_stage(char const* p_name) -> uint32_t;
+    void resolve_locked();
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <stx/panic.h>
+#include <vector>
+
+// A contiguous range of a scene's vertices and indices. Indices are relative
+// to `first_vertex`.
+struct Mesh {
+    uint32_t first_vertex;
+    uint32_t vertex_count;
+    uint32_t first_index;
+    uint32_t index_count;
+    // Where the mesh starts in the encoded index stream, in 32-bit words.
+    // Meshes with at most 65535 vertices pack two 16-bit indices per word.
+    uint32_t index_word_offset = 0;
+    uint32_t is_index_16_bit = 0;
+    // Encoded positions decode to `scale * q / 32767 + offset` per axis.
+    float position_scale[3] = {1, 1, 1};
+    float position_offset[3] = {0, 0, 0};
+
+    auto triangle_count() const -> uint32_t {
+        return this->index_count / 3;
+    }
+};
+
+// Matches `Material` in the closest hit shader.
+struct Material {
+    static constexpr uint32_t no_texture = ~0u;
+
+    // Linear RGBA8, which scales the diffuse texture when there is one. The
+    // default is the grey that untextured scenes are shaded with.
+    uint32_t diffuse = 0xFFCCCCCC;
+    uint32_t texture_index = no_texture;
+};
+
+// The size and modification time of a file that a scene cache was built
+// from. A file that did not exist has a size of `missing_size`.
+struct SourceFileStamp {
+    static constexpr uint64_t missing_size = ~0ull;
+
+    uint64_t size;
+    int64_t mtime_ns;
+
+    auto operator==(SourceFileStamp const& other) const -> bool = default;
+};
+
+// Layout of a preprocessed scene file, which is memory-mapped in place of
+// parsing an OBJ. Every blob offset is aligned to `blob_alignment`.
+struct SceneCacheHeader {
+    static constexpr char expected_magic[4] = {'R', 'T', 'S', 'C'};
+    static constexpr uint32_t current_version = 5;
+    static constexpr uint64_t blob_alignment = 64;
+
+    char magic[4];
+    uint32_t version;
+    // The cache is stale once the source OBJ's size or mtime changes.
+    uint64_t source_size;
+    int64_t source_mtime_ns;
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t mesh_count;
+    uint32_t encoded_index_word_count;
+    uint32_t texture_count;
+    uint32_t texture_names_size;
+    uint32_t material_count;
+    // It is stale as well once a material library that the OBJ names
+    // changes. Their names are NUL-terminated and relative to the OBJ's
+    // directory, and each has a `SourceFileStamp`.
+    uint32_t material_library_count;
+    uint32_t material_library_names_size;
+    uint64_t positions_offset;
+    uint64_t normals_offset;
+    uint64_t uvs_offset;
+    uint64_t indices_offset;
+    uint64_t meshes_offset;
+    uint64_t encoded_positions_offset;
+    uint64_t encoded_indices_offset;
+    uint64_t texture_names_offset;
+    uint64_t materials_offset;
+    uint64_t material_indices_offset;
+    uint64_t material_library_names_offset;
+    uint64_t material_library_stamps_offset;
+    uint64_t file_size;
+};
+
+// Vertex attributes are kept as separate streams, so that acceleration
+// structure builds only read the tightly packed positions, while normals and
+// UVs are left for the hit shaders.
+struct Scene {
+    // Views of the scene data, which point either into the storage below or
+    // into a memory-mapped scene cache.
+    float const* p_positions = nullptr;  // Three floats per vertex.
+    float const* p_normals = nullptr;    // Three floats per vertex.
+    float const* p_uvs = nullptr;        // Two floats per vertex.
+    uint32_t const* p_indices = nullptr;
+    Mesh const* p_meshes = nullptr;
+    uint32_t vertex_count = 0;
+    uint32_t index_count = 0;
+    uint32_t mesh_count = 0;
+    // What the GPU builds from: positions quantized per mesh to four SNORM16
+    // components, and indices at the narrowest width each mesh allows.
+    int16_t const* p_encoded_positions = nullptr;
+    uint32_t const* p_encoded_indices = nullptr;
+    uint32_t encoded_index_word_count = 0;
+    // The KTX2 files of the materials' diffuse textures, as NUL-terminated
+    // names relative to `directory`, one after the other.
+    char const* p_texture_names = nullptr;
+    uint32_t texture_count = 0;
+    uint32_t texture_names_size = 0;
+    // Material 0 is for faces that name none. Textures are indexed in the
+    // order of `p_texture_names`.
+    Material const* p_materials = nullptr;
+    uint32_t material_count = 0;
+    // One material per triangle, in the order of `p_indices`.
+    uint32_t const* p_material_indices = nullptr;
+    // Where the OBJ is, with a trailing slash unless it is empty.
+    std::string directory;
+
+    // Load an OBJ file through its binary cache, which is (re)built next to
+    // it as `<path>.cache` whenever it is missing or stale.
+    auto load(char const* p_path) -> bool;
+    // Load every shape of a Wavefront OBJ file as its own mesh.
+    auto load_obj(char const* p_path) -> bool;
+    // A single triangle, for running without any scene file.
+    void load_triangle();
+    // Generate `mesh_count` rippled grid meshes side by side, with about
+    // `triangle_count` triangles between them. Used for benchmarking.
+    void load_grid(uint32_t triangle_count, uint32_t mesh_count);
+    void free();
+
+  private:
+    std::vector<float> position_storage;
+    std::vector<float> normal_storage;
+    std::vector<float> uv_storage;
+    std::vector<uint32_t> index_storage;
+    std::vector<Mesh> mesh_storage;
+    std::vector<int16_t> encoded_position_storage;
+    std::vector<uint32_t> encoded_index_storage;
+    std::vector<char> texture_name_storage;
+    uint32_t texture_name_count = 0;
+    std::vector<Material> material_storage;
+    std::vector<uint32_t> material_index_storage;
+    // Only kept for writing the cache after parsing an OBJ.
+    std::vector<char> material_library_name_storage;
+    std::vector<SourceFileStamp> material_library_stamps;
+    void* p_mapping = nullptr;
+    size_t mapping_size = 0;
+
+    // Deduplicate and reorder every mesh's vertices for the caches, and then
+    // fill the encoded streams. Runs once per OBJ, before caching.
+    void encode_meshes();
+    void point_at_storage();
+    // Record the stamps of the material libraries that the OBJ names.
+    void stamp_material_libraries(char const* p_path);
+    auto map_cache(char const* p_cache_path, SourceFileStamp source_stamp)
+        -> bool;
+    auto write_cache(char const* p_cache_path,
+                     SourceFileStamp source_stamp) const -> bool;
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+#include "ktx2.hpp"
+#include "memory.hpp"
+#include "upload.hpp"
+
+// Keeps textures resident from their coarsest levels up to whichever level
+// was last asked for, within a memory budget. Only the small levels are
+// uploaded when a texture is added. Finer levels are streamed in one per
+// texture per `update()`, and the finest level of the least recently used
+// texture is evicted whenever the budget would otherwise be exceeded.
+//
+// Images can not grow or shrink in place, so every change of residency
+// makes a new image with the levels that are now resident. Levels the old
+// image has are copied over on the GPU when the format allows it, only new
+// ones are uploaded from the mapped file, and the old image is retired once
+// no frame can still be reading it. Retired images count against the budget
+// until then.
+struct TextureStreamer {
+    static constexpr uint32_t no_texture = ~0u;
+
+    struct Texture {
+        Ktx2File file;
+        VkImage image = VK_NULL_HANDLE;
+        VkImageView view = VK_NULL_HANDLE;
+        Allocation allocation;
+        // Level 0 of the image is this level of the file.
+        uint32_t resident_level = 0;
+        // Never evicted past this level, which is loaded up front.
+        uint32_t coarse_level = 0;
+        uint32_t requested_level = 0;
+        uint64_t last_requested_frame = 0;
+        VkDeviceSize resident_size = 0;
+        // Whether the format can be copied between images. Without it, every
+        // change of residency uploads all of the levels from the file.
+        bool can_copy_levels = false;
+    };
+
+    struct RetiredImage {
+        VkImage image;
+        VkImageView view;
+        Allocation allocation;
+        // The first frame after which nothing reads it, including the
+        // copies out of it.
+        uint64_t frame;
+    };
+
+    VkDevice logical_device;
+    DeviceAllocator* p_allocator;
+    UploadManager* p_uploader;
+
+    VkDeviceSize memory_budget = 256ull * 1024 * 1024;
+    // Bytes read from files per `update()`, so that a frame never waits on
+    // more than this much streaming.
+    VkDeviceSize max_bytes_per_update = 16ull * 1024 * 1024;
+    // Levels no larger than this on either side are loaded up front.
+    uint32_t coarse_level_size = 64;
+    // Whether the device was created with `textureCompressionBC`. Without
+    // it, every texture fails to load.
+    bool is_block_compression_enabled = false;
+
+    std::vector<Texture> textures;
+    std::vector<RetiredImage> retired_images;
+    // Of the textures' current images, and of the retired ones.
+    VkDeviceSize resident_size = 0;
+    VkDeviceSize retired_size = 0;
+    // Set whenever a texture's view changes, and cleared by whoever writes
+    // the views into descriptors.
+    bool are_views_dirty = false;
+
+    uint64_t levels_streamed = 0;
+    uint64_t levels_evicted = 0;
+    VkDeviceSize bytes_streamed = 0;
+
+    void initialize(VkDevice& logical_device, DeviceAllocator& allocator,
+                    UploadManager& uploader);
+    // Map a KTX2 file and upload its coarse levels. Textures that fail to
+    // load, or whose format the device can not sample, still take an index,
+    // without an image.
+    auto add(char const* p_path) -> uint32_t;
+    // Ask for `level` of a texture to be resident, as seen by `frame`.
+    void request(uint32_t texture_index, uint32_t level, uint64_t frame);
+    // Stream and evict levels for `frame`, and release images that were
+    // retired before `first_pending_frame`, which is the oldest frame the
+    // GPU may still be working on.
+    void update(uint64_t frame, uint64_t first_pending_frame);
+    void print_stats() const;
+    void free();
+
+  private:
+    // Replace a texture's image with one whose finest level is `level`, and
+    // return how many bytes were uploaded from the file for it.
+    auto make_resident(Texture& texture, uint32_t level, uint64_t frame)
+        -> VkDeviceSize;
+    void release(RetiredImage& retired_image);
+};
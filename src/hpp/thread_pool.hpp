@@ -0,0 +1,38 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// A fixed set of worker threads that sleep until the same function is run on
+// several of them at once. The calling thread always takes part as thread 0.
+struct ThreadPool {
+    using Function = void (*)(uint32_t thread_index, void* p_data);
+
+    // Includes the calling thread.
+    uint32_t thread_count = 1;
+
+    // Spawns `thread_count - 1` workers. Zero picks one per hardware thread.
+    void initialize(uint32_t thread_count);
+    // Call `p_function` on threads `0` through `thread_count - 1`, and return
+    // once every call has.
+    void run(uint32_t thread_count, Function p_function, void* p_data);
+    void free();
+
+  private:
+    std::thread* p_workers = nullptr;
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    // Bumped by every `run()`, so that workers can tell new work apart from a
+    // spurious wake-up.
+    uint64_t generation = 0;
+    uint32_t active_thread_count = 0;
+    uint32_t remaining_thread_count = 0;
+    Function p_function = nullptr;
+    void* p_data = nullptr;
+    bool should_exit = false;
+
+    void work(uint32_t thread_index);
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Scoped CPU trace zones, which are written out in the Chrome trace event
+// format for chrome://tracing or Perfetto. Zones compile to nothing unless
+// the `TRACE` CMake option is on.
+namespace trace {
+
+struct Event {
+    // Zone names must be string literals, because only the pointer is kept.
+    char const* p_name;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+};
+
+// Each thread appends to its own buffer, so recording an event never takes
+// a lock. Full buffers drop events rather than grow.
+struct ThreadBuffer {
+    static constexpr uint32_t capacity = 1u << 16;
+
+    uint32_t thread_index;
+    // Only the owning thread writes this. Events below it are complete.
+    std::atomic<uint32_t> event_count = 0;
+    uint32_t dropped_event_count = 0;
+    Event events[capacity];
+};
+
+auto now_ns() -> uint64_t;
+void record(char const* p_name, uint64_t begin_ns, uint64_t end_ns);
+// Must be called once every traced thread is idle.
+auto write_chrome_json(char const* p_path) -> bool;
+
+struct Zone {
+    char const* p_name;
+    uint64_t begin_ns;
+
+    explicit Zone(char const* p_name) : p_name(p_name), begin_ns(now_ns()) {
+    }
+    ~Zone() {
+        record(this->p_name, this->begin_ns, now_ns());
+    }
+    Zone(Zone const&) = delete;
+    auto operator=(Zone const&) -> Zone& = delete;
+};
+
+}  // namespace trace
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+#ifdef RAYTRACING_TRACE
+#define TRACE_ZONE(name) \
+    trace::Zone TRACE_CONCAT(trace_zone_, __LINE__)(name)
+#else
+#define TRACE_ZONE(name)
+#endif
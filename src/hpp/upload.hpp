@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stx/panic.h>
+#include <vulkan/vulkan.h>
+
+#include "memory.hpp"
+#include "profiler.hpp"
+
+// Streams host data into device-local buffers through one persistently mapped
+// staging ring. Copies are batched into a few command buffers, and ring space
+// is recycled as soon as the fence of the batch that read it signals. Every
+// batch also signals a timeline semaphore, which other queues wait on before
+// they read what was uploaded.
+struct UploadManager {
+    static constexpr uint32_t max_batches_in_flight = 4;
+
+    struct Batch {
+        VkCommandBuffer cmd_buffer;
+        VkFence fence;
+        // Monotonic ring position one past the last byte this batch reads.
+        VkDeviceSize ring_end = 0;
+        uint32_t copy_count = 0;
+        bool is_pending = false;
+    };
+
+    VkDevice logical_device;
+    DeviceAllocator* p_allocator;
+    VkQueue queue;
+    VkCommandPool cmd_pool;
+    // Set for a dedicated transfer queue, which can not name the stages that
+    // read uploads in its barriers. The timeline semaphore covers them.
+    bool is_transfer_only = false;
+
+    // Reaches `timeline_value` once every submitted batch is done.
+    VkSemaphore timeline = VK_NULL_HANDLE;
+    uint64_t timeline_value = 0;
+
+    VkBuffer ring_buffer;
+    Allocation ring_allocation;
+    VkDeviceSize ring_size;
+    // Of the queue's family, which image copies are split along.
+    VkExtent3D image_transfer_granularity;
+    // Both of these only ever grow. `head - tail` is the number of bytes that
+    // are still waiting on the GPU.
+    VkDeviceSize head = 0;
+    VkDeviceSize tail = 0;
+    // Where the batch being recorded started writing into the ring.
+    VkDeviceSize batch_begin = 0;
+
+    Batch batches[max_batches_in_flight];
+    uint32_t current_batch = 0;
+    bool is_recording = false;
+
+    VkDeviceSize bytes_uploaded = 0;
+    uint32_t submit_count = 0;
+
+    // Times every batch when set.
+    GpuProfiler* p_profiler = nullptr;
+    uint32_t batch_scope = GpuProfiler::no_scope;
+
+    void initialize(VkDevice& logical_device, DeviceAllocator& allocator,
+                    uint32_t queue_family_index, VkQueue& queue,
+                    VkDeviceSize ring_size);
+    // Copy `size` bytes from `p_data` into `dst_buffer`, with the transfer
+    // being deferred until the current batch is flushed.
+    void upload_buffer(VkBuffer dst_buffer, VkDeviceSize dst_offset,
+                       void const* p_data, VkDeviceSize size);
+    // Copy one level of a block-compressed image that nothing uses yet, and
+    // leave it in `GENERAL`, where it can be both sampled and copied from.
+    // Levels too large for one copy are split into runs of block rows.
+    void upload_image_level(VkImage dst_image, uint32_t mip_level,
+                            uint32_t width, uint32_t height,
+                            uint32_t block_size, void const* p_data);
+    // Copy a level of an image that earlier uploads left in `GENERAL` into
+    // a level of one that nothing uses yet, and leave that in `GENERAL` too.
+    // The source may still be sampled meanwhile.
+    void copy_image_level(VkImage src_image, uint32_t src_mip_level,
+                          VkImage dst_image, uint32_t dst_mip_level,
+                          uint32_t width, uint32_t height);
+    // Submit the batch being recorded, without waiting on it.
+    void flush();
+    // Retire any batches whose fences have signaled, without blocking.
+    void poll();
+    // Block until every submitted batch has retired.
+    void wait_idle();
+    void print_stats() const;
+    void free();
+
+  private:
+    // `ring_begin` is where the batch's first reserved copy starts, since
+    // the ring space is reserved before the batch begins.
+    void begin_batch(VkDeviceSize ring_begin);
+    void retire(uint32_t batch_index, bool should_wait);
+    void record_image_barrier(VkImage image, uint32_t mip_level,
+                              VkImageLayout old_layout,
+                              VkImageLayout new_layout);
+    auto reserve(VkDeviceSize size, VkDeviceSize alignment) -> VkDeviceSize;
+};
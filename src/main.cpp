@@ -1,8 +1,11 @@
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <vulkan/vulkan.h>
 #include <vulkan/vulkan_core.h>
 
 #include "app.hpp"
+#include "trace.hpp"
 
 struct RayTracingScratchBuffer {
     uint64_t device_address = 0;
@@ -10,12 +13,103 @@ struct RayTracingScratchBuffer {
     VkDeviceMemory memory = VK_NULL_HANDLE;
 };
 
-auto main(int /*argc*/, char* /*argv*/[]) -> int {
+// Usage: raytracing [--headless] [--frames N] [--output PREFIX]
+//                   [--frames-in-flight N] [--profile-csv PATH]
+//                   [--trace PATH] [--dynamic] [--host-blas] [--adaptive]
+//                   [--samples N] [--error-threshold X]
+//                   [--frame-budget MS] [--instances N] [--cpu]
+//                   [--texture-budget MB]
+//                   [--present mailbox|immediate|fifo]
+//                   [--max-queued-frames N] [--frame-rate N] [scene.obj]
+auto main(int argc, char* argv[]) -> int {
     std::cout << "Hello, user!\n";
     App app;
+    char const* p_trace_path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) {
+            app.is_headless = true;
+        } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            app.headless_frame_count =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            app.p_output_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--frames-in-flight") == 0 &&
+                   i + 1 < argc) {
+            app.max_frames_in_flight =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            if (app.max_frames_in_flight == 0) {
+                app.max_frames_in_flight = 1;
+            }
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            p_trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+            app.p_profile_csv_path = argv[++i];
+        } else if (strcmp(argv[i], "--dynamic") == 0) {
+            app.is_scene_dynamic = true;
+        } else if (strcmp(argv[i], "--host-blas") == 0) {
+            app.should_build_blas_on_host = true;
+        } else if (strcmp(argv[i], "--cpu") == 0) {
+            app.is_cpu_tracing = true;
+        } else if (strcmp(argv[i], "--adaptive") == 0) {
+            app.is_adaptive_sampling = true;
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            // The uniform count, or the per-frame cap when adaptive.
+            uint32_t const sample_count =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            app.uniform_sample_count = sample_count;
+            app.max_sample_count = sample_count;
+        } else if (strcmp(argv[i], "--error-threshold") == 0 &&
+                   i + 1 < argc) {
+            app.error_threshold = std::strtof(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            app.scene_instance_count =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (strcmp(argv[i], "--frame-budget") == 0 && i + 1 < argc) {
+            app.is_resolution_dynamic = true;
+            app.frame_budget_ms = std::strtod(argv[++i], nullptr);
+        } else if (strcmp(argv[i], "--texture-budget") == 0 &&
+                   i + 1 < argc) {
+            app.texture_streamer.memory_budget =
+                std::strtoull(argv[++i], nullptr, 10) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--present") == 0 && i + 1 < argc) {
+            char const* p_mode = argv[++i];
+            if (strcmp(p_mode, "mailbox") == 0) {
+                app.requested_present_mode = VK_PRESENT_MODE_MAILBOX_KHR;
+            } else if (strcmp(p_mode, "immediate") == 0) {
+                app.requested_present_mode = VK_PRESENT_MODE_IMMEDIATE_KHR;
+            } else {
+                app.requested_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+            }
+        } else if (strcmp(argv[i], "--max-queued-frames") == 0 &&
+                   i + 1 < argc) {
+            app.max_queued_frames =
+                static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+            if (app.max_queued_frames == 0) {
+                app.max_queued_frames = 1;
+            }
+        } else if (strcmp(argv[i], "--frame-rate") == 0 && i + 1 < argc) {
+            app.target_frame_rate = std::strtod(argv[++i], nullptr);
+        } else {
+            app.p_scene_path = argv[i];
+        }
+    }
     app.initialize();
-    app.render_loop();
+    if (app.is_headless) {
+        app.render_headless();
+    } else {
+        app.render_loop();
+    }
     app.free();
 
+    if (p_trace_path != nullptr) {
+#ifdef RAYTRACING_TRACE
+        if (!trace::write_chrome_json(p_trace_path)) {
+            std::cout << "Failed to write " << p_trace_path << ".\n";
+        }
+#else
+        std::cout << "Tracing is compiled out, configure with -DTRACE=ON.\n";
+#endif
+    }
+
     return EXIT_SUCCESS;
 }
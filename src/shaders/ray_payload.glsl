@@ -0,0 +1,6 @@
+struct RayPayload {
+    vec3 color;
+    // How fast the ray's footprint widens with distance, in radians, which
+    // picks texture levels.
+    float spread_angle;
+};
@@ -0,0 +1,34 @@
+// Shared by the ray generation shader and the sample map pass. Matches
+// `App::SamplingPushConstants`.
+layout(push_constant) uniform Sampling {
+    uint frame_number;
+    uint is_adaptive;
+    // Paths per pixel per frame when sampling uniformly.
+    uint uniform_sample_count;
+    // The most paths one pixel may get in a frame when sampling adaptively.
+    uint max_sample_count;
+    // Pixels below this many samples are not trusted to have converged.
+    uint min_sample_count;
+    // Relative standard error of the mean luminance that counts as converged.
+    float error_threshold;
+    // Which of `SamplingStats` this frame's pass writes.
+    uint stats_slot;
+    // Start accumulating from scratch, because the scene changed.
+    uint should_reset;
+    // The part of the images being traced into, which is smaller than the
+    // images themselves with dynamic resolution.
+    uint render_width;
+    uint render_height;
+}
+sampling;
+
+// Running mean color in rgb, and the number of samples in a.
+layout(binding = 7, rgba32f) uniform image2D accumulation_image;
+// Sum of squared luminance deviations from the mean, as in Welford's method.
+layout(binding = 8, r32f) uniform image2D variance_image;
+// How many paths each pixel gets this frame, when sampling adaptively.
+layout(binding = 9, r32ui) uniform uimage2D sample_count_image;
+
+float luminance(vec3 color) {
+    return dot(color, vec3(0.2126, 0.7152, 0.0722));
+}